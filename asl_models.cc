@@ -67,15 +67,15 @@ Copyright (C) 2010-2011 University of Oxford */
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include "asl_models.h"
+#include "tools.h"
 
 namespace OXASL {
 
 // --- Kinetic curve functions ---
 //Arterial
 
-  double AIFModel_nodisp::kcblood(const double ti, const double deltblood, const double taub, const double T_1b, const bool casl,const ColumnVector dispparam) const {
+  double AIFModel_nodisp::kcblood(const double ti, const double deltblood, const double taub, const double T_1b, const bool casl,const ColumnVector& dispparam) const {
   // Non dispersed arterial curve
-  Tracer_Plus tr("OXASL:kcblood_nodisp");
   double kcblood = 0.0;
 
 
@@ -103,16 +103,20 @@ namespace OXASL {
   return kcblood;
 }
 
-  double AIFModel_gammadisp::kcblood(const double ti,const double deltblood,const double taub,const double T_1b,const bool casl,const ColumnVector dispparam) const {
+  double AIFModel_gammadisp::Igamc(const double a, const double x) const {
+    if (igammaTable) return igammaTable->Q(a,x);
+    else             return igamc(a,x);
+  }
+
+  double AIFModel_gammadisp::kcblood(const double ti,const double deltblood,const double taub,const double T_1b,const bool casl,const ColumnVector& dispparam) const {
     // Gamma dispersed arterial curve (pASL)
-    Tracer_Plus tr("OXASL:kcblood_gammadisp");
     double kcblood = 0.0;
 
     //extract dispersion parameters
     double s; double p;
-    s = (dispparam.Row(1)).AsScalar();
+    s = dispparam(1);
     s = exp(s);
-    double sp = (dispparam.Row(2)).AsScalar();
+    double sp = dispparam(2);
     sp = exp(sp);
     if (sp>10) sp=10;
     p = sp/s;
@@ -128,13 +132,13 @@ namespace OXASL {
 	if (casl) kcblood = 2 * exp(-deltblood/T_1b);
 	else	  kcblood = 2 * exp(-ti/T_1b);
 	
-	kcblood *= ( 1 - igamc(k,s*(ti-deltblood))  ); 
+	kcblood *= ( 1 - Igamc(k,s*(ti-deltblood))  ); 
       }
       else //(ti > deltblood + taub)
 	{
 	  if (casl) kcblood = 2 * exp(-deltblood/T_1b);
 	  else	    kcblood = 2 * exp(-ti/T_1b);
-	  kcblood *= ( igamc(k,s*(ti-deltblood-taub)) - igamc(k,s*(ti-deltblood)) ) ; 
+	  kcblood *= ( Igamc(k,s*(ti-deltblood-taub)) - Igamc(k,s*(ti-deltblood)) ) ; 
 	  
 	}
     
@@ -253,47 +257,43 @@ double kcblood_gallichan(const double ti,const double deltblood,const double tau
   */
   //-----------------------------------------
   //Residue functions (these are primiarly specified for use with the numerical tissue model)
-  double ResidModel_wellmix::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
+  double ResidModel_wellmix::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const {
     // Well mixed single compartment
     // Buxton (1998) model
-    Tracer_Plus tr("OXASL::residmodel_wellmix");
 
     double T_1app = 1/( 1/T_1 + fcalib/lambda );
     return exp(-ti/T_1app);
   }
 
-double ResidModel_simple::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
+double ResidModel_simple::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const {
     // Simple impermeable comparment
   // decays with T1b
-    Tracer_Plus tr("OXASL::residmodel_simple");
 
     return exp(-ti/T_1b);;
   }
 
-  double ResidModel_imperm::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
+  double ResidModel_imperm::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const {
     // impermeable compartment with transit time
     //decays with T1b
-    Tracer_Plus tr("OXASL::residmodel_imperm");
 
-    double transit = (residparam.Row(1)).AsScalar();
+    double transit = residparam(1);
     double resid = exp(-ti/T_1b);
     if (ti>transit) resid=0.0;
     return resid;
   }
 
-  double ResidModel_twocpt::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
+  double ResidModel_twocpt::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const {
     // Two compartment model - the simplest form of the two cpt model
     // No backflow from tissue to blood
     // no venous outflow
     // From Parkes & Tofts and also St. Lawrence 2000 - both models are the same under these assumptions
-    Tracer_Plus tr("OXASL::residmodel_twocpt");
 
     // extract residue function parameters
     double kw; //exchange rate = PS/vb
-    kw = (residparam.Row(1)).AsScalar();
+    kw = residparam(1);
     //double PS; double vb;
-    //PS = (residparam.Row(1)).AsScalar();
-    //vb = (residparam.Row(2)).AsScalar();
+    //PS = residparam(1);
+    //vb = residparam(2);
 
     // calculate the residue function
     double a = kw + 1/T_1b;
@@ -301,17 +301,16 @@ double ResidModel_simple::resid(const double ti, const double fcalib, const doub
     return b*exp(-ti/T_1) + (1-b)*exp(-a*ti);
     }
 
-  double ResidModel_spa::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const {
+  double ResidModel_spa::resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const {
     // Two compartment model - Single Pass Approximation from St. Lawrence (2000)
     // No backflow from tissue to blood
     // label starts to leave the cappilliary after a capilliary transit time
-    Tracer_Plus tr("OXASL::residmodel_spa");
 
 // extract residue function parameters
     double PS; double vb; double tauc;
-    PS = (residparam.Row(1)).AsScalar();
-    vb = (residparam.Row(2)).AsScalar();
-    tauc = (residparam.Row(3)).AsScalar();
+    PS = residparam(1);
+    vb = residparam(2);
+    tauc = residparam(3);
 
     // calcualte residue function
     double a = PS/vb + 1/T_1b;
@@ -329,10 +328,9 @@ double ResidModel_simple::resid(const double ti, const double fcalib, const doub
 
   //----------------------------------
   //Tissue Model
-double TissueModel_nodisp_simple::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
+double TissueModel_nodisp_simple::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
   // Tissue kinetic curve - well mixed, but no outflow and decay with T1 blood only
   // (This is just the impermeable model with infinite residence time)
-  Tracer_Plus tr("OXASL::kctissue_nodisp_simple");
   double kctissue = 0.0;
 
 
@@ -356,10 +354,9 @@ double TissueModel_nodisp_simple::kctissue(const double ti,const double fcalib,
   return kctissue;
 }
 
-  double TissueModel_nodisp_wellmix::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
+  double TissueModel_nodisp_wellmix::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
   // Tissue kinetic curve no dispersion
   // Buxton (1998) model
-  Tracer_Plus tr("OXASL::kctissue_nodisp_wellmix");
   double kctissue = 0.0;
 
   double T_1app = 1/( 1/T_1 + fcalib/lambda );
@@ -381,13 +378,12 @@ double TissueModel_nodisp_simple::kctissue(const double ti,const double fcalib,
   return kctissue;
 }
 
-  double TissueModel_nodisp_imperm::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
+  double TissueModel_nodisp_imperm::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
   // Tissue kinetic curve no dispersion impermeable vessel
-  Tracer_Plus tr("OXASL::kctissue_nodisp_imperm");
   double kctissue = 0.0;
 
   //extract the pre-cap residence time
-  double taup = residparam.AsScalar();
+  double taup = residparam(1);
 
   if (ti>delttiss && ti<delttiss+taup+tau) {
     if (ti<delttiss+tau && ti < delttiss+taup) {
@@ -415,19 +411,18 @@ double TissueModel_nodisp_simple::kctissue(const double ti,const double fcalib,
   return kctissue;
 }
 
-double TissueModel_nodisp_2cpt::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
+double TissueModel_nodisp_2cpt::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
     // Two compartment model - the simplest form of the two cpt model
     // No backflow from tissue to blood
     // no venous outflow
     // From Parkes & Tofts and also St. Lawrence 2000 - both models are the same under these assumptions
-    Tracer_Plus tr("OXASL::Tissuemodel_nodisp_twocpt");
 
     // extract residue function parameters
     double kw; //exchange rate = PS/vb
-    kw = (residparam.Row(1)).AsScalar();
+    kw = residparam(1);
     //double PS; double vb;
-    //PS = (residparam.Row(1)).AsScalar();
-    //vb = (residparam.Row(2)).AsScalar();
+    //PS = residparam(1);
+    //vb = residparam(2);
 
     // calculate the residue function
     double a = kw + 1/T_1b; //alpha
@@ -456,20 +451,19 @@ double TissueModel_nodisp_2cpt::kctissue(const double ti,const double fcalib, co
   return kctissue;
 }
 
-double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
+double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
     // Two compartment model
     // No backflow from tissue to blood
     // venous outflow (alhtough we dont model a venous component to the signal here)
     // St. Lawrence 2000
-    Tracer_Plus tr("OXASL::Tissuemodel_nodisp_spa");
 
     assert(!casl);
 
     // extract residue function parameters
     double PS; double vb; double tauc;
-    PS = (residparam.Row(1)).AsScalar();
-    vb = (residparam.Row(2)).AsScalar(); //NB for SPA on the whole vb and PS appear together (as kw), but PS is on its own in ER
-    tauc = (residparam.Row(3)).AsScalar();
+    PS = residparam(1);
+    vb = residparam(2); //NB for SPA on the whole vb and PS appear together (as kw), but PS is on its own in ER
+    tauc = residparam(3);
 
     // calcualte residue function
    
@@ -500,7 +494,6 @@ double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, con
 }
 
   double TissueModel_nodisp_spa::Q(const double t1, const double t2, const double t3,const double PS, const double vb, const double tauc, const double fcalib, const double T_1, const double T_1b) const {
-    Tracer_Plus tr("OXASL::TissueModel_nodisp_spa::Q");
     double a = PS/vb + 1/T_1b;
     double b = (PS*T_1*T_1b) / (PS*T_1*T_1b + (T_1-T_1b)*vb );
     double S = 1/T_1-1/T_1b;
@@ -509,24 +502,22 @@ double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, con
   }
 
   double TissueModel_nodisp_spa::R(const double t1, const double t2, const double t3,const double PS, const double vb, const double tauc, const double fcalib, const double T_1, const double T_1b) const {
-    Tracer_Plus tr("OXASL::TissueModel_nodisp_spa::R");
     double b = (PS*T_1*T_1b) / (PS*T_1*T_1b + (T_1-T_1b)*vb );
     double ER = 1 - exp(-PS/fcalib - (1/T_1b - 1/T_1)*tauc);
     double S = 1/T_1-1/T_1b;
     return b*ER/S*exp(-t3/T_1)*(exp(S*t2)-exp(S*t1));
   }
 
-  double TissueModel_gammadisp_wellmix::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
-  Tracer_Plus tr("OXASL::kctissue_gammadisp_wellmix");
+  double TissueModel_gammadisp_wellmix::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
   double kctissue = 0.0;
 
   assert(!casl); //only pASL at the moment!
 
   //extract dispersion parameters
   double s; double p;
-  s = (dispparam.Row(1)).AsScalar();
+  s = dispparam(1);
   s = exp(s);
-  double sp = (dispparam.Row(2)).AsScalar();
+  double sp = dispparam(2);
   sp = exp(sp);
   if (sp>10) sp=10;
   p = sp/s;
@@ -614,84 +605,34 @@ double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, con
 }
   */
 
- double TissueModel_aif_residue::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const {
-  Tracer_Plus tr("OXASL::kctissue_aif_residue");
-  double kctissue = 0.0;
-
-  // calculate the appropraite time series for the aif and residue
-  // assume that the aif is zero before TI=0 (true of most aif models under sensible parameter values)
-
-  // OLD fixed number of discrete time points
-  // int nint = 10; //number of intervals for simpsons rule;
-  // int niti = 2*nint+1; //the number of time points to use in the integration - for simpsons rule follow the patttern (2*x)+1
-  // double delti = ti/(niti-1);
-
-  // fixed time intervals for discretization (these discrete time points are termed iti)
-  double delti=0.1; // time interval for the iti
-  double dti =  fmod(ti,delti); // the time not covered by the iti
-  //double maxiti = ti - dti; //largest iti
-  int niti = floor(ti/delti)+1; // number of iti (include the itit at 0)
- 
-  ColumnVector aifts(niti);
-  ColumnVector rests(niti);
-  double iti;
-  //calacute aif and residue function for all the iti
-  for (int i=0; i<niti; i++) { //start from iTI = 0 and go up to iTI=niti*delti)
-    iti = i*delti;
-    aifts(i+1) = aifmodel->kcblood(iti,delttiss,tau,T_1b,casl,dispparam);
-    rests(i+1) = residmodel->resid(iti+dti,fcalib,T_1,T_1b,lambda,residparam); //NB offset on this ready for when we reverse it
-  }
-  //cacualte the aif and residue at the TI
-  double aifti = aifmodel->kcblood(ti,delttiss,tau,T_1b,casl,dispparam);
-  //double resti = residmodel->resid(ti,fcalib,T_1,lambda,residparam);
-
-  // do convolution to get the value at this TI
-  ColumnVector prod(niti);
-  prod = SP(aifts,rests.Reverse());
-  double prodti = aifti; //becasue resti at time zero is 1
-
-  string integrate = "trapezoid";
-  //if (integrate == "rect") {}
-  // rect intergration
-    //nothing to do here - this is essentially done as the default option
-  if (integrate == "trapezoid") {
-    ColumnVector trap(niti);
-    trap = 1;
-    trap(1) = 0.5;
-    trap(niti) = 0.5;
-    prod = SP(prod,trap);
-  }
-  else if (integrate == "simpson") {
-  // simpson
-    //work out how many time points we can apply simpson to
-    int nsimp = floor( (niti-1)/2 )*2 +1;
-
-    ColumnVector simpson(niti);
-    simpson(1) = 1/3;
-    for (int h=2; h<nsimp; h += 2) {
-      simpson(h) = 4/3;
-      simpson(h+1) = 2/3;
-    }
-    simpson(nsimp) = 1/3;
-
-    if (nsimp<niti) {
-      //we still have another time point to incorporate do this using trapezium rule
-      assert(niti-nsimp==1);
-      simpson(nsimp) = simpson(nsimp)+0.5;
-      simpson(niti) = 0.5;
-    }
-    prod = SP(prod,simpson);
+ // Single TI: evaluates the aif and residue as it goes, so nothing is allocated
+ double TissueModel_aif_residue::kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const {
+  const double delti = 0.1; // time interval for the iti
+  const double dti = fmod(ti,delti); // the time not covered by the iti
+  const int niti = floor(ti/delti)+1; // number of iti (include the itit at 0)
+
+  // convolution at this TI by the trapezium rule: aif(iti) * resid(ti-iti),
+  // with half weight on the end points
+  double prodsum = 0.0;
+  double prodlast = 0.0;
+  for (int i=0; i<niti; i++) {
+    double prod = aifmodel->kcblood(i*delti,delttiss,tau,T_1b,casl,dispparam)
+      * residmodel->resid((niti-1-i)*delti+dti,fcalib,T_1,T_1b,lambda,residparam);
+    if (i==0 || i==niti-1) prod *= 0.5; // just once if niti is 1
+    if (i==niti-1) prodlast = prod;
+    prodsum += prod;
   }
 
-    kctissue = prod.Sum()*delti; //NB must be multiplied by the timespacing
-    kctissue += (0.5*prodti+0.5*prod(niti))*dti; // plus the last bit (which we will do with trapezium rule)
+  //cacualte the aif at the TI (the residue at time zero is 1)
+  double prodti = aifmodel->kcblood(ti,delttiss,tau,T_1b,casl,dispparam);
 
+  double kctissue = prodsum*delti; //NB must be multiplied by the timespacing
+  kctissue += (0.5*prodti + 0.5*prodlast)*dti; // plus the last bit (which we will do with trapezium rule)
   return kctissue;
  }
 
 // --- useful general functions ---
   double icgf(const double a,const double x) {
-    Tracer_Plus tr("OXASL::icgf");
     
     //incomplete gamma function with a=k, based on the incomplete gamma integral
     
@@ -699,7 +640,6 @@ double TissueModel_nodisp_spa::kctissue(const double ti,const double fcalib, con
   }
   
   double gvf(const double t,const double s,const double p) {
-    Tracer_Plus tr("OXASL::gvf");
     
     //The Gamma Variate Function (correctly normalised for area under curve) 
     // Form of Rausch 2000
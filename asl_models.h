@@ -78,13 +78,15 @@ using namespace MISCMATHS;
 
 using namespace Utilities;
 
+class IncompleteGammaTable; // tools.h
+
 namespace OXASL {
 
   // generic AIF model class
   class AIFModel {
   public:
     //evaluate the model
-    virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl,const ColumnVector dispparam) const = 0;
+    virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl,const ColumnVector& dispparam) const = 0;
     //report the number of dispersion parameters 
     virtual int NumDisp() const = 0;
     // return default priors for the parameters
@@ -99,17 +101,22 @@ namespace OXASL {
   //Specific AIF models
   class AIFModel_nodisp : public AIFModel {
     //AIFModel_nodisp() {}
-    virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl, const ColumnVector dispparam) const;
+    virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl, const ColumnVector& dispparam) const;
   virtual int NumDisp() const {return 0;}
   virtual string Name() const { return "None"; }
   };
 
   class AIFModel_gammadisp : public AIFModel {
   public:
-    AIFModel_gammadisp() { priors.ReSize(4); priors << 2 << -0.3 << 10 << 10; }
-    virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl,const ColumnVector dispparam) const;
+    // igtable (if given) is used instead of igamc; it must cover 1 <= a <= 11
+    AIFModel_gammadisp(const IncompleteGammaTable* igtable = NULL) : igammaTable(igtable) { priors.ReSize(4); priors << 2 << -0.3 << 10 << 10; }
+    virtual double kcblood(const double ti, const double deltblood, const double taub, const double T_1b, bool casl,const ColumnVector& dispparam) const;
     virtual int NumDisp() const {return 2;}
     virtual string Name() const { return "Gamma dispersion kernel"; }
+
+  private:
+    const IncompleteGammaTable* igammaTable;
+    double Igamc(const double a, const double x) const;
   };
 
   //  double kcblood_gvf(const double ti, const double deltblood,const double taub,const double T_1b, const double s, const double p, bool casl);
@@ -121,7 +128,7 @@ namespace OXASL {
   //generic residue function model class
   class ResidModel {
   public:
-    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const = 0;
+    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const = 0;
     //report the number of residue function parameters
     virtual int NumResid() const = 0;
     // return the default priors for the parameters
@@ -135,7 +142,7 @@ namespace OXASL {
   //specific residue function models
   class ResidModel_wellmix : public ResidModel {
   public:
-    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const;
+    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const;
 
     virtual int NumResid() const {return 0;}
     virtual string Name() const { return "Well mixed"; }
@@ -143,7 +150,7 @@ namespace OXASL {
 
   class ResidModel_simple : public ResidModel {
   public:
-    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const;
+    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const;
     
     virtual int NumResid() const {return 0;}
     virtual string Name() const { return "Simple"; }
@@ -152,7 +159,7 @@ namespace OXASL {
   class ResidModel_imperm : public ResidModel {
   public:
     ResidModel_imperm() { residpriors.ReSize(2); residpriors << 0.5 << 10; }
-    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const;
+    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const;
 
     virtual int NumResid() const {return 1;}
     virtual string Name() const { return "Impermeable"; }
@@ -161,7 +168,7 @@ namespace OXASL {
   class ResidModel_twocpt : public ResidModel {
   public:
     ResidModel_twocpt() { residpriors.ReSize(2); residpriors << 0.8 << 10; }
-    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const;
+    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const;
 
     virtual int NumResid() const {return 1;}
     virtual string Name() const { return "Two comparment (no backflow, no venous output)"; }
@@ -170,7 +177,7 @@ namespace OXASL {
   class ResidModel_spa : public ResidModel {
   public:
     ResidModel_spa() { residpriors.ReSize(6); residpriors << 0.02 << 0.03 << 2 << 1e-3 << 1e12 << 10; }
-    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector residparam) const;
+    virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b, const double lambda, const ColumnVector& residparam) const;
 
     virtual int NumResid() const {return 3;}
     virtual string Name() const { return "Single Pass Approximation (2 compartment, no backflow)"; }
@@ -181,7 +188,7 @@ namespace OXASL {
   class TissueModel {
   public:
     //evalute the model
-    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const = 0;
+    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const = 0;
     // report the number of dipersion parameters
     virtual int NumDisp() const = 0;
     // report the number of residue function parameters (beyond the normal ones)
@@ -199,7 +206,7 @@ namespace OXASL {
   //specific tissue models
 
   class TissueModel_nodisp_simple : public TissueModel {
-    virtual double kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual double kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
     virtual int NumDisp() const {return 0;}
     virtual int NumResid() const {return 0;}
     virtual string Name() const { return "No dispersion | Simple"; }
@@ -207,7 +214,7 @@ namespace OXASL {
 
   class TissueModel_nodisp_wellmix : public TissueModel {
   public:
-    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
  virtual int NumDisp() const {return 0;}
  virtual int NumResid() const {return 0;}
  virtual string Name() const { return "No dispersion | Well mixed"; }
@@ -216,7 +223,7 @@ namespace OXASL {
   class TissueModel_nodisp_imperm : public TissueModel {
   public:
     TissueModel_nodisp_imperm() { residpriors.ReSize(2); residpriors << 0.5 << 10; }
-    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
  virtual int NumDisp() const {return 0;}
  virtual int NumResid() const {return 1;}
  virtual string Name() const { return "No dispersion | Impermeable"; }
@@ -225,7 +232,7 @@ namespace OXASL {
   class TissueModel_nodisp_2cpt : public TissueModel {
   public:
     TissueModel_nodisp_2cpt() { residpriors.ReSize(2); residpriors << 0.8 << 10; }
-    virtual double kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual double kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
     virtual int NumDisp() const {return 0;}
     virtual int NumResid() const {return 1;}
     virtual string Name() const { return "No dispersion | Two compartmentr (no backflow, no venous output)"; }
@@ -234,7 +241,7 @@ namespace OXASL {
   class TissueModel_nodisp_spa : public TissueModel {
   public:
     TissueModel_nodisp_spa() { residpriors.ReSize(6); residpriors << 0.02 << 0.03 << 2 << 1e-3 << 1e12 << 10; }
-virtual double kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+virtual double kctissue(const double ti,const double fcalib, const double delttiss,const double tau,const double T_1b,const double T_1, const double lambda,const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
  virtual int NumDisp() const {return 0;}
  virtual int NumResid() const {return 3;}
  virtual string Name() const { return "No dispersion | Single Pass Approximation (2 compartment no backflow)"; }
@@ -247,7 +254,7 @@ virtual double kctissue(const double ti,const double fcalib, const double deltti
   class TissueModel_gammadisp_wellmix : public TissueModel {
   public:
     TissueModel_gammadisp_wellmix() { disppriors.ReSize(4); disppriors << 2 << -0.3 << 10 << 10; } 
-    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1, const double lambda, const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
  virtual int NumDisp() const {return 2;}
  virtual int NumResid() const {return 0;}
   virtual string Name() const { return "Gamma kernel dispersion | Well mixed"; }
@@ -265,7 +272,7 @@ virtual double kctissue(const double ti,const double fcalib, const double deltti
 	disppriors << aifmodel->Priors();
 	residpriors << residmodel->Priors();
       }
-    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1app, const double lambda, const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual double kctissue(const double ti, const double fcalib, const double delttiss, const double tau, const double T_1b, const double T_1app, const double lambda, const bool casl, const ColumnVector& dispparam, const ColumnVector& residparam) const;
     virtual int NumDisp() const {return aifmodel->NumDisp();}
     virtual int NumResid() const {return residmodel->NumResid();}
     virtual string Name() const { string name; name = "NUMERICAL CONVOLUTION - " + aifmodel->Name() + residmodel->Name(); return name; }
@@ -0,0 +1,301 @@
+/*  checkpoint.cc - Journal of finished voxels, for resuming runs
+
+    Michael Chappell, FMRIB Image Analysis Group
+
+    Copyright (C) 2007-2008 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "checkpoint.h"
+#include <unistd.h>
+#include <cstring>
+#include "easyoptions.h"
+
+static const char checkpointMagic[8] = { 'F','A','B','C','K','P','T','1' };
+
+int Checkpoint::Load(const string& filename, int nVoxels, const string& layout,
+		     vector<MVNDist*>& mvns, vector<double>& Fs,
+		     Matrix& fits, vector<bool>& fitsValid,
+		     vector<double>* extra, long* validBytes)
+{
+  Tracer_Plus tr("Checkpoint::Load");
+  if (validBytes != NULL) *validBytes = 0;
+
+  FILE* in = fopen(filename.c_str(), "rb");
+  if (in == NULL)
+    return 0;
+
+  char magic[8];
+  int n = 0, layoutLen = -1;
+  string fileLayout;
+  bool ok = (fread(magic, 1, 8, in) == 8 && memcmp(magic, checkpointMagic, 8) == 0
+	     && fread(&n, sizeof(n), 1, in) == 1
+	     && fread(&layoutLen, sizeof(layoutLen), 1, in) == 1
+	     && layoutLen >= 0 && layoutLen < 65536);
+  if (ok && layoutLen > 0)
+    {
+      vector<char> chars(layoutLen);
+      ok = (fread(&chars[0], 1, layoutLen, in) == (size_t)layoutLen);
+      fileLayout.assign(chars.begin(), chars.end());
+    }
+  if (!ok)
+    {
+      fclose(in);
+      throw Invalid_option("--resume: '" + filename + "' isn't a checkpoint file");
+    }
+  if (n != nVoxels)
+    {
+      fclose(in);
+      throw Invalid_option("--resume: checkpoint has " + stringify(n) 
+	  + " voxels, but there are " + stringify(nVoxels) + " in the mask");
+    }
+  if (fileLayout != layout)
+    {
+      fclose(in);
+      throw Invalid_option("--resume: checkpoint was written by a different model or noise model\n"
+	  "  checkpoint: " + fileLayout + "\n  this run:   " + layout);
+    }
+  long good = ftell(in);
+
+  vector<bool> restored(nVoxels, false);
+  vector<double> values;
+  int mvnLen = 0, fitsLen = 0; // as set by the first voxel that has them
+  string corrupt;
+  while (true)
+    {
+      int voxel, count;
+      if (fread(&voxel, sizeof(voxel), 1, in) != 1 
+	  || fread(&count, sizeof(count), 1, in) != 1
+	  || voxel < 0 || voxel > nVoxels || count < 0)
+	break;
+      values.resize(count);
+      if (count > 0 && fread(&values[0], sizeof(double), count, in) != (size_t)count)
+	break;
+
+      if (voxel == 0)
+	{
+	  if (extra != NULL) *extra = values;
+	  good = ftell(in);
+	  continue;
+	}
+
+      // A voxel is its number of parameters, F, means, covariance and then 
+      // any model fit; treat anything shorter as a torn tail too
+      if (count < 2)
+	break;
+      const int len = int(values[0]);
+      if (len <= 0 || len > count)
+	break;
+      const int fitLen = count - 2 - len - len*(len+1)/2;
+      if (fitLen < 0)
+	break;
+
+      // Whole records that disagree with the earlier ones aren't a torn 
+      // tail; the file is bad
+      if (mvnLen == 0) mvnLen = len;
+      if (fitLen > 0 && fitsLen == 0) fitsLen = fitLen;
+      if (len != mvnLen || (fitLen > 0 && fitLen != fitsLen))
+	{
+	  corrupt = "voxel " + stringify(voxel) + " has " + stringify(len) 
+	    + " parameters and a model fit of " + stringify(fitLen) 
+	    + ", but earlier voxels have " + stringify(mvnLen) + " and " 
+	    + stringify(fitsLen);
+	  break;
+	}
+      good = ftell(in);
+
+      MVNDist* mvn = new MVNDist(len);
+      SymmetricMatrix cov(len);
+      int i = 2;
+      for (int r = 1; r <= len; r++)
+	mvn->means(r) = values[i++];
+      for (int r = 1; r <= len; r++)
+	for (int c = 1; c <= r; c++)
+	  cov(r,c) = values[i++];
+      mvn->SetCovariance(cov);
+
+      if ((int)mvns.size() < nVoxels) mvns.resize(nVoxels, NULL);
+      delete mvns[voxel-1];
+      mvns[voxel-1] = mvn;
+      if ((int)Fs.size() == nVoxels)
+	Fs[voxel-1] = values[1];
+      if (fitLen > 0)
+	{
+	  if (fits.Nrows() != fitLen || fits.Ncols() != nVoxels)
+	    {
+	      // Only ever the first time, so no restored fit is lost
+	      fits.ReSize(fitLen, nVoxels);
+	      fitsValid.assign(nVoxels, false);
+	    }
+	  if ((int)fitsValid.size() != nVoxels)
+	    fitsValid.assign(nVoxels, false);
+	  for (int r = 1; r <= fitLen; r++)
+	    fits(r, voxel) = values[i++];
+	  fitsValid[voxel-1] = true;
+	}
+      restored[voxel-1] = true;
+    }
+  fclose(in);
+  if (corrupt != "")
+    throw Invalid_option("--resume: checkpoint '" + filename + "' is corrupt: " + corrupt);
+
+  if (validBytes != NULL) *validBytes = good;
+
+  int nRestored = 0;
+  for (int v = 0; v < nVoxels; v++)
+    if (restored[v]) nRestored++;
+  return nRestored;
+}
+
+void Checkpoint::Start(const string& name, int nVoxels, const string& layout,
+		       int everyN, long validBytes)
+{
+  Tracer_Plus tr("Checkpoint::Start");
+  Close();
+  filename = name;
+  every = everyN;
+  pending = 0;
+  buffer.clear();
+
+  if (validBytes > 0)
+    {
+      // Drop any half-written record and carry on after the last good one
+      if (truncate(filename.c_str(), validBytes) != 0 
+	  || (file = fopen(filename.c_str(), "ab")) == NULL)
+	throw Runtime_error(("Couldn't reopen checkpoint file " + filename).c_str());
+    }
+  else
+    {
+      file = fopen(filename.c_str(), "wb");
+      if (file == NULL)
+	throw Runtime_error(("Couldn't create checkpoint file " + filename).c_str());
+      const int layoutLen = layout.size();
+      fwrite(checkpointMagic, 1, 8, file);
+      fwrite(&nVoxels, sizeof(nVoxels), 1, file);
+      fwrite(&layoutLen, sizeof(layoutLen), 1, file);
+      fwrite(layout.data(), 1, layoutLen, file);
+      if (fflush(file) != 0)
+	throw Runtime_error(("Couldn't write checkpoint file " + filename).c_str());
+    }
+}
+
+void Checkpoint::AddVoxel(int voxel, const MVNDist& mvn, double F, 
+			  const ColumnVector* fit)
+{
+  const int len = mvn.means.Nrows();
+  const SymmetricMatrix& cov = mvn.GetCovariance();
+  vector<double> values;
+  values.reserve(2 + len + len*(len+1)/2 + (fit ? fit->Nrows() : 0));
+  values.push_back(len);
+  values.push_back(F);
+  for (int r = 1; r <= len; r++)
+    values.push_back(mvn.means(r));
+  for (int r = 1; r <= len; r++)
+    for (int c = 1; c <= r; c++)
+      values.push_back(cov(r,c));
+  if (fit != NULL)
+    for (int r = 1; r <= fit->Nrows(); r++)
+      values.push_back((*fit)(r));
+  AddRecord(voxel, values);
+}
+
+void Checkpoint::AddExtra(const vector<double>& values)
+{
+  AddRecord(0, values);
+}
+
+void Checkpoint::AddRecord(int voxel, const vector<double>& values)
+{
+  assert(file != NULL);
+  const int count = values.size();
+  const char* p;
+  p = (const char*)&voxel; buffer.insert(buffer.end(), p, p + sizeof(voxel));
+  p = (const char*)&count; buffer.insert(buffer.end(), p, p + sizeof(count));
+  if (count > 0)
+    {
+      p = (const char*)&values[0];
+      buffer.insert(buffer.end(), p, p + count*sizeof(double));
+    }
+  if (++pending >= every && every > 0)
+    Flush();
+}
+
+void Checkpoint::Flush()
+{
+  if (file == NULL || buffer.empty())
+    return;
+  if (fwrite(&buffer[0], 1, buffer.size(), file) != buffer.size() 
+      || fflush(file) != 0)
+    throw Runtime_error(("Couldn't write to checkpoint file " + filename).c_str());
+  buffer.clear();
+  pending = 0;
+}
+
+void Checkpoint::Close()
+{
+  if (file == NULL)
+    return;
+  Flush();
+  fclose(file);
+  file = NULL;
+}
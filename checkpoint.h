@@ -0,0 +1,130 @@
+/*  checkpoint.h - Journal of finished voxels, for resuming runs
+
+    Michael Chappell, FMRIB Image Analysis Group
+
+    Copyright (C) 2007-2008 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "dist_mvn.h"
+
+// Append-only journal of finished voxels, so that a run that dies part way
+// through can carry on where it left off (--checkpoint-every, --resume).
+//
+// The file is a short header (magic, number of voxels, and a layout string
+// saying what the voxels' MVNs hold) followed by records, each an int voxel number,
+// an int count n and n doubles.  For a voxel the doubles are the MVN size, 
+// the free energy, the means, the lower triangle of the covariance and 
+// (optionally) the model fit.  Voxel 0 is used for anything else the 
+// inference technique wants to keep, e.g. spatial VB's hyperparameters.
+// Records are buffered and only written every so often; a partly-written
+// record at the end (if we died while writing it) is ignored.
+class Checkpoint
+{
+public:
+    Checkpoint() : file(NULL), every(0), pending(0) { return; }
+    ~Checkpoint() { try { Close(); } catch (...) { } }
+
+    // Read back the voxels an earlier run finished, filling in those 
+    // entries of mvns, Fs and (if it was kept) fits.  Later records for the
+    // same voxel replace earlier ones.  extra gets the last voxel-0 record.
+    // Returns the number of voxels restored; *validBytes is the length of 
+    // the file up to the end of the last complete record.  Throws if the
+    // file was written with a different layout, or is inconsistent.
+    static int Load(const string& filename, int nVoxels, const string& layout,
+		    vector<MVNDist*>& mvns, vector<double>& Fs,
+		    Matrix& fits, vector<bool>& fitsValid,
+		    vector<double>* extra = NULL, long* validBytes = NULL);
+
+    // Start a new journal, or carry on with one that Load() has read 
+    // (validBytes > 0).  Buffered records are written out every 'every' 
+    // records (0 = only on Flush/Close).
+    void Start(const string& filename, int nVoxels, const string& layout,
+	       int every, long validBytes = 0);
+    bool IsOpen() const { return file != NULL; }
+
+    void AddVoxel(int voxel, const MVNDist& mvn, double F, 
+		  const ColumnVector* fit = NULL);
+    void AddExtra(const vector<double>& values);
+
+    void Flush();
+    void Close();
+
+private:
+    void AddRecord(int voxel, const vector<double>& values);
+
+    FILE* file;
+    string filename;
+    int every;
+    int pending;
+    vector<char> buffer;
+
+    // Not copyable (owns the FILE)
+    Checkpoint(const Checkpoint&);
+    const Checkpoint& operator=(const Checkpoint&);
+};
@@ -68,6 +68,7 @@
 
 #include "easylog.h"
 #include "dataset.h"
+#include <map>
 
 using namespace MISCMATHS;
 using namespace std;
@@ -105,15 +106,16 @@ void DataSet::LoadData(ArgsType& args)
 {
   Tracer_Plus tr("LoadData");
 
-  if (EasyOptions::UsingMatrixIO())
+  if (args.UsingMatrixIO())
     {
+      matrixIO = &args.GetMatrixIO();
       string dataFile = args.Read("data");
-      voxelData = EasyOptions::InMatrix(dataFile);
+      voxelData = matrixIO->In(dataFile);
 
       string voxelCoordsFile = args.ReadWithDefault("voxelCoords","");
       if (voxelCoordsFile != "")
       {
-	voxelCoords = EasyOptions::InMatrix(voxelCoordsFile);
+	voxelCoords = matrixIO->In(voxelCoordsFile);
 	// leave mask undefined
       }
       else
@@ -123,7 +125,7 @@ void DataSet::LoadData(ArgsType& args)
 
       string suppdataFile = args.ReadWithDefault("suppdata","none");
       if (suppdataFile != "none") {
-	voxelSuppData = EasyOptions::InMatrix(suppdataFile);
+	voxelSuppData = matrixIO->In(suppdataFile);
       }
 
       return;
@@ -307,3 +309,74 @@ void DataSet::LoadData(ArgsType& args)
 #endif //__FABBER_LIBRARYONLY
 }
 
+void DataSet::Downsample(DataSet& coarse, vector<int>& fineToCoarse) const
+{
+  Tracer_Plus tr("DataSet::Downsample");
+  const int Nvoxels = voxelData.Ncols();
+
+  if (voxelCoords.Ncols() != Nvoxels)
+    throw Invalid_option("Voxel coordinates are required to downsample the data");
+
+  // Coarse voxel positions, keyed (z,y,x) so that the coarse voxels end up 
+  // in the same order as a mask-thresholded volume would give them.
+  map<vector<int>, int> coarseIds;
+  vector<vector<int> > keys(Nvoxels, vector<int>(3));
+  for (int v = 1; v <= Nvoxels; v++)
+    {
+      for (int dim = 0; dim < 3; dim++)
+	keys[v-1][2-dim] = int(voxelCoords(dim+1, v)) / 2;
+      coarseIds[keys[v-1]] = 0;
+    }
+
+  const int Ncoarse = coarseIds.size();
+  coarse.voxelCoords.ReSize(3, Ncoarse);
+  int id = 0;
+  for (map<vector<int>, int>::iterator it = coarseIds.begin(); 
+       it != coarseIds.end(); it++)
+    {
+      it->second = ++id;
+      for (int dim = 0; dim < 3; dim++)
+	coarse.voxelCoords(dim+1, id) = it->first[2-dim];
+    }
+
+  // Average the data (and supplementary data) over each coarse voxel
+  ColumnVector counts(Ncoarse); counts = 0;
+  coarse.voxelData.ReSize(voxelData.Nrows(), Ncoarse);
+  coarse.voxelData = 0;
+  const bool haveSupp = (voxelSuppData.Ncols() > 0);
+  if (haveSupp)
+    {
+      coarse.voxelSuppData.ReSize(voxelSuppData.Nrows(), Ncoarse);
+      coarse.voxelSuppData = 0;
+    }
+
+  fineToCoarse.resize(Nvoxels);
+  for (int v = 1; v <= Nvoxels; v++)
+    {
+      const int c = coarseIds[keys[v-1]];
+      fineToCoarse[v-1] = c;
+      counts(c) += 1;
+      coarse.voxelData.Column(c) += voxelData.Column(v);
+      if (haveSupp)
+	coarse.voxelSuppData.Column(c) += voxelSuppData.Column(v);
+    }
+
+  for (int c = 1; c <= Ncoarse; c++)
+    {
+      coarse.voxelData.Column(c) *= 1.0/counts(c);
+      if (haveSupp)
+	coarse.voxelSuppData.Column(c) *= 1.0/counts(c);
+    }
+}
+
+void DataSet::SubsetVoxels(DataSet& subset, int firstVoxel, int lastVoxel) const
+{
+  Tracer_Plus tr("DataSet::SubsetVoxels");
+  assert(1 <= firstVoxel && firstVoxel <= lastVoxel && lastVoxel <= voxelData.Ncols());
+
+  subset.voxelData = voxelData.Columns(firstVoxel, lastVoxel);
+  if (voxelCoords.Ncols() > 0)
+    subset.voxelCoords = voxelCoords.Columns(firstVoxel, lastVoxel);
+  if (voxelSuppData.Ncols() > 0)
+    subset.voxelSuppData = voxelSuppData.Columns(firstVoxel, lastVoxel);
+}
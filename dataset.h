@@ -79,8 +79,12 @@ using namespace Utilities;
 class DataSet
 {
  public:
+  DataSet() : matrixIO(NULL) { return; }
   void LoadData(ArgsType& args);
 
+  // In fabber_library mode, where the data came from and results go
+  MatrixIO* GetMatrixIO() const { return matrixIO; }
+
 #ifndef __FABBER_LIBRARYONLY
   const NEWIMAGE::volume<float>& GetMask() const { return mask; }
 #endif // __FABBER_LIBRARYONLY
@@ -88,6 +92,16 @@ class DataSet
   const NEWMAT::Matrix& GetVoxelCoords() const { return voxelCoords; }
   const NEWMAT::Matrix& GetVoxelSuppData() const { return voxelSuppData; }
 
+  // Half-resolution copy for coarse-to-fine methods: each coarse voxel is the
+  // average of the fine voxels inside it.  fineToCoarse[v-1] is the coarse
+  // voxel id (from 1) of fine voxel v.  The coarse mask is left unset.
+  void Downsample(DataSet& coarse, std::vector<int>& fineToCoarse) const;
+
+  // Copy of voxels firstVoxel..lastVoxel (from 1), e.g. one slab of the
+  // volume since voxels are ordered with z changing slowest.  The mask is
+  // left unset.
+  void SubsetVoxels(DataSet& subset, int firstVoxel, int lastVoxel) const;
+
  protected:
 #ifndef __FABBER_LIBRARYONLY
   NEWIMAGE::volume<float> mask; // Will be unset if UsingMatrixIO!
@@ -99,6 +113,8 @@ class DataSet
 
   // coordinates of each voxel
   NEWMAT::Matrix voxelCoords;  // is 3 x Nvox; integer indices (from 0), NOT mm positions
+
+  MatrixIO* matrixIO; // not owned; NULL unless using fabber_library
 };
 
 
@@ -69,6 +69,12 @@
 #include "dist_mvn.h"
 #include "easyoptions.h"
 #include "miscmaths/miscmaths.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace NEWIMAGE;
 using namespace Utilities;
@@ -251,6 +257,64 @@ const SymmetricMatrix& MVNDist::GetCovariance() const
   return covariance;
 }
 
+void MVNDist::GetMarginalVariances(ColumnVector& vars) const
+{
+  if (len == -1) throw Logic_error("MVN is uninitialized!\n");
+  vars.ReSize(len);
+  if (covarianceValid)
+    {
+      for (int i = 1; i <= len; i++)
+	vars(i) = covariance(i,i);
+      return;
+    }
+
+  // precisions = L*L.t(), so covariance = Linv.t()*Linv and its i'th 
+  // diagonal element is the sum of squares of column i of Linv
+  assert(precisionsValid);
+  LowerTriangularMatrix Linv;
+  try
+    {
+      LowerTriangularMatrix L = Cholesky(precisions);
+      Linv = L.i();
+    }
+  catch (Exception)
+    {
+      // Not positive definite: same fallback as GetCovariance
+      const SymmetricMatrix& cov = GetCovariance();
+      for (int i = 1; i <= len; i++)
+	vars(i) = cov(i,i);
+      return;
+    }
+  for (int i = 1; i <= len; i++)
+    {
+      double sum = 0;
+      for (int k = i; k <= len; k++)
+	sum += Linv(k,i)*Linv(k,i);
+      vars(i) = sum;
+    }
+}
+
+void MVNDist::GetMarginals(const vector<MVNDist*>& mvns, 
+			   Matrix& means, Matrix& variances)
+{
+  Tracer_Plus tr("MVNDist::GetMarginals");
+  const int nVoxels = mvns.size();
+  assert(nVoxels > 0 && mvns.at(0) != NULL);
+  const int nParams = mvns.at(0)->means.Nrows();
+  means.ReSize(nParams, nVoxels);
+  variances.ReSize(nParams, nVoxels);
+
+  ColumnVector vars;
+  for (int vox = 1; vox <= nVoxels; vox++)
+    {
+      const MVNDist& mvn = *mvns.at(vox-1);
+      assert(mvn.means.Nrows() == nParams);
+      mvn.GetMarginalVariances(vars);
+      means.Column(vox) = mvn.means;
+      variances.Column(vox) = vars;
+    }
+}
+
 void MVNDist::SetPrecisions(const SymmetricMatrix& from)
 {
   Tracer_Plus tr("MVNDist::SetPrecisions");
@@ -320,6 +384,20 @@ void MVNDist::Load(vector<MVNDist*>& mvns, const string& filename, const volume<
 {
     Tracer_Plus tr("MVNDist::Load (static)");
     
+    const string packedName = PackedMVNFile::Find(filename);
+    if (packedName != "")
+    {
+        for (unsigned i = 0; i < mvns.size(); i++) 
+            assert(mvns[i] == NULL);
+        LOG_ERR("Reading packed MVNs from " << packedName << endl);
+        PackedMVNFile in(packedName);
+        in.CheckMask(mask);
+        mvns.resize(in.NumVoxels(), NULL);
+        for (int vox = 1; vox <= in.NumVoxels(); vox++)
+            mvns[vox-1] = in.NewMVN(vox);
+        return;
+    }
+
     Matrix vols; 
     LOG_ERR("Reading MVNs from " << filename << endl);
  
@@ -401,3 +479,276 @@ void MVNDist::Save(const vector<MVNDist*>& mvns, const string& filename, const v
     output.setDisplayMaximumMinimum(output.max(),output.min());
     save_volume4D(output,filename);
 }
+
+
+// Packed MVN files
+
+static const char packedMagic[8] = { 'F','A','B','M','V','N','P','1' };
+
+// Header: magic, then int nVoxels, nParams, bytesPerValue, nNames, then 
+// uint64 maskHash, then int namesBytes and the names (each followed by a 
+// '\0').  The values start at the next multiple of 8 bytes.
+static const size_t packedHeaderBytes = 8 + 4*sizeof(int) + sizeof(uint64_t) + sizeof(int);
+
+string PackedMVNFile::Find(const string& filename)
+{
+  const string names[2] = { filename, filename + ".fmvn" };
+  for (int n = 0; n < 2; n++)
+    {
+      FILE* in = fopen(names[n].c_str(), "rb");
+      if (in == NULL) 
+	continue;
+      char magic[8];
+      const bool packed = (fread(magic, 1, 8, in) == 8 
+			   && memcmp(magic, packedMagic, 8) == 0);
+      fclose(in);
+      if (packed) 
+	return names[n];
+    }
+  return "";
+}
+
+uint64_t PackedMVNFile::HashMask(const volume<float>& mask)
+{
+  // FNV-1a hash of the dimensions and the indices of the voxels in the mask
+  uint64_t hash = 14695981039346656037ULL;
+  const int dims[3] = { mask.xsize(), mask.ysize(), mask.zsize() };
+  vector<int> ints(dims, dims+3);
+  int index = 0;
+  for (int z = 0; z < dims[2]; z++)
+    for (int y = 0; y < dims[1]; y++)
+      for (int x = 0; x < dims[0]; x++, index++)
+	if (mask(x,y,z) > 0)
+	  ints.push_back(index);
+  for (unsigned i = 0; i < ints.size(); i++)
+    {
+      const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&ints[i]);
+      for (unsigned b = 0; b < sizeof(int); b++)
+	{
+	  hash ^= bytes[b];
+	  hash *= 1099511628211ULL;
+	}
+    }
+  return hash;
+}
+
+void PackedMVNFile::Save(const vector<MVNDist*>& mvns, const string& filename, 
+			 const vector<string>& paramNames, uint64_t maskHash, 
+			 bool doublePrecision)
+{
+  Tracer_Plus tr("PackedMVNFile::Save");
+
+  const int nVoxels = mvns.size();
+  assert(nVoxels > 0 && mvns.at(0) != NULL);   
+  const int nParams = mvns.at(0)->means.Nrows();
+
+  PackedMVNWriter out(filename, nVoxels, nParams, paramNames, maskHash, doublePrecision);
+  for (int vox = 1; vox <= nVoxels; vox++)
+    out.AddVoxel(mvns.at(vox-1)->means, mvns.at(vox-1)->GetCovariance());
+  out.Close();
+}
+
+PackedMVNWriter::PackedMVNWriter(const string& name, int nVox, int nPar,
+				 const vector<string>& paramNames, uint64_t maskHash, 
+				 bool dp)
+  : filename(name), out(NULL), nVoxels(nVox), nParams(nPar), added(0),
+    doublePrecision(dp), ok(true), dbl(nPar + nPar*(nPar+1)/2), flt(dbl.size())
+{
+  out = fopen(filename.c_str(), "wb");
+  if (out == NULL)
+    throw Runtime_error(("Couldn't create " + filename).c_str());
+  PackedMVNFile::WriteHeader(out, nVoxels, nParams, paramNames, maskHash, doublePrecision);
+}
+
+void PackedMVNWriter::AddVoxel(const ColumnVector& means, const SymmetricMatrix& cov)
+{
+  assert(out != NULL && added < nVoxels);
+  assert(means.Nrows() == nParams && cov.Nrows() == nParams);
+
+  // Means first, in the precision we're writing
+  int i = 0;
+  for (int r = 1; r <= nParams; r++)
+    dbl[i++] = means(r);
+  for (int r = 1; r <= nParams; r++)
+    for (int c = 1; c <= r; c++)
+      dbl[i++] = cov(r,c);
+
+  const size_t perVoxel = dbl.size();
+  if (doublePrecision)
+    ok = ok && (fwrite(&dbl[0], sizeof(double), perVoxel, out) == perVoxel);
+  else
+    {
+      for (i = 0; i < (int)perVoxel; i++) flt[i] = dbl[i];
+      ok = ok && (fwrite(&flt[0], sizeof(float), perVoxel, out) == perVoxel);
+    }
+  added++;
+}
+
+void PackedMVNWriter::Close()
+{
+  assert(out != NULL);
+  const bool closed = (fclose(out) == 0);
+  out = NULL;
+  if (!closed || !ok || added != nVoxels)
+    throw Runtime_error(("Couldn't write " + filename).c_str());
+}
+
+void PackedMVNFile::WriteHeader(FILE* out, int nVoxels, int nParams, 
+				const vector<string>& paramNames, uint64_t maskHash, 
+				bool doublePrecision)
+{
+  const int bytesPerValue = doublePrecision ? sizeof(double) : sizeof(float);
+  const int nNames = paramNames.size();
+  assert(nNames <= nParams);
+
+  string names;
+  for (int i = 0; i < nNames; i++)
+    names += paramNames[i] + '\0';
+  const int namesBytes = names.size();
+  names.resize((packedHeaderBytes + namesBytes + 7) / 8 * 8 - packedHeaderBytes, '\0');
+
+  fwrite(packedMagic, 1, 8, out);
+  fwrite(&nVoxels, sizeof(int), 1, out);
+  fwrite(&nParams, sizeof(int), 1, out);
+  fwrite(&bytesPerValue, sizeof(int), 1, out);
+  fwrite(&nNames, sizeof(int), 1, out);
+  fwrite(&maskHash, sizeof(uint64_t), 1, out);
+  fwrite(&namesBytes, sizeof(int), 1, out);
+  fwrite(names.data(), 1, names.size(), out);
+}
+
+PackedMVNFile::PackedMVNFile(const string& name)
+  : filename(name), mapped(NULL), mappedBytes(0), values(NULL)
+{
+  Tracer_Plus tr("PackedMVNFile::PackedMVNFile");
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      if (fd >= 0) close(fd);
+      throw Invalid_option("Couldn't open packed MVN file " + filename);
+    }
+  mappedBytes = st.st_size;
+  if (mappedBytes >= packedHeaderBytes)
+    mapped = mmap(NULL, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping stays valid
+  if (mapped == MAP_FAILED || mapped == NULL)
+    {
+      mapped = NULL;
+      throw Invalid_option("Couldn't read packed MVN file " + filename);
+    }
+
+  const char* p = static_cast<const char*>(mapped);
+  int nNames, namesBytes;
+  const bool magicOk = (memcmp(p, packedMagic, 8) == 0);
+  p += 8;
+  memcpy(&nVoxels, p, sizeof(int)); p += sizeof(int);
+  memcpy(&nParams, p, sizeof(int)); p += sizeof(int);
+  memcpy(&bytesPerValue, p, sizeof(int)); p += sizeof(int);
+  memcpy(&nNames, p, sizeof(int)); p += sizeof(int);
+  memcpy(&maskHash, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&namesBytes, p, sizeof(int)); p += sizeof(int);
+
+  const size_t dataStart = (packedHeaderBytes + namesBytes + 7) / 8 * 8;
+  const size_t dataBytes = size_t(nVoxels) * (nParams + nParams*(nParams+1)/2) * bytesPerValue;
+  bool namesOk = (magicOk && namesBytes >= 0 && nNames >= 0
+		  && packedHeaderBytes + namesBytes <= mappedBytes);
+  const char* next = p;
+  for (int i = 0; i < nNames && namesOk; i++)
+    {
+      const char* end = static_cast<const char*>(
+        memchr(next, '\0', p + namesBytes - next));
+      namesOk = (end != NULL);
+      if (namesOk)
+	{
+	  paramNames.push_back(string(next, end));
+	  next = end + 1;
+	}
+    }
+
+  if (!namesOk || nVoxels < 1 || nParams < 1 || nNames < 0 || nNames > nParams
+      || (bytesPerValue != 4 && bytesPerValue != 8)
+      || dataStart + dataBytes > mappedBytes)
+    {
+      munmap(mapped, mappedBytes);
+      mapped = NULL;
+      throw Invalid_option("Packed MVN file " + filename + " is corrupt or truncated");
+    }
+
+  values = static_cast<const char*>(mapped) + dataStart;
+}
+
+PackedMVNFile::~PackedMVNFile()
+{
+  if (mapped != NULL)
+    munmap(mapped, mappedBytes);
+}
+
+void PackedMVNFile::CheckMask(const volume<float>& mask) const
+{
+  if (HashMask(mask) != maskHash)
+    throw Invalid_option("The mask doesn't match the one " + filename 
+			 + " was saved with");
+}
+
+double PackedMVNFile::Value(int voxel, int i) const
+{
+  const size_t index = size_t(voxel-1) * (nParams + nParams*(nParams+1)/2) + i;
+  if (bytesPerValue == sizeof(double))
+    {
+      double d;
+      memcpy(&d, values + index*sizeof(double), sizeof(double));
+      return d;
+    }
+  float f;
+  memcpy(&f, values + index*sizeof(float), sizeof(float));
+  return f;
+}
+
+MVNDist* PackedMVNFile::NewMVN(int voxel) const
+{
+  assert(voxel >= 1 && voxel <= nVoxels);
+  MVNDist* mvn = new MVNDist(nParams);
+  SymmetricMatrix cov(nParams);
+  int i = 0;
+  for (int r = 1; r <= nParams; r++)
+    mvn->means(r) = Value(voxel, i++);
+  for (int r = 1; r <= nParams; r++)
+    for (int c = 1; c <= r; c++)
+      cov(r,c) = Value(voxel, i++);
+  mvn->SetCovariance(cov);
+  return mvn;
+}
+
+MVNDist* PackedMVNFile::NewMVN(int voxel, const vector<int>& remap, 
+			       const ColumnVector& defaultMeans, 
+			       const SymmetricMatrix& defaultCovariance) const
+{
+  assert(voxel >= 1 && voxel <= nVoxels);
+  const int len = remap.size();
+  assert(defaultMeans.Nrows() == len && defaultCovariance.Nrows() == len);
+
+  MVNDist* mvn = new MVNDist(len);
+  mvn->means = defaultMeans;
+  SymmetricMatrix cov = defaultCovariance;
+  for (int r = 1; r <= len; r++)
+    {
+      const int fr = remap[r-1];
+      if (fr == 0) 
+	continue;
+      assert(fr >= 1 && fr <= nParams);
+      mvn->means(r) = Value(voxel, fr-1);
+      for (int c = 1; c <= r; c++)
+	{
+	  const int fc = remap[c-1];
+	  if (fc == 0)
+	    continue;
+	  // Lower triangle of the file's covariance, after the means
+	  const int hi = max(fr, fc), lo = min(fr, fc);
+	  cov(r,c) = Value(voxel, nParams + hi*(hi-1)/2 + lo-1);
+	}
+    }
+  mvn->SetCovariance(cov);
+  return mvn;
+}
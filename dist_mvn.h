@@ -69,6 +69,8 @@
 #pragma once
 
 #include <stdexcept>
+#include <stdint.h>
+#include <cstdio>
 #include "assert.h"
 #include "easylog.h"
 #include "newimage/newimageall.h"
@@ -107,6 +109,16 @@ public:
   void SetPrecisions(const SymmetricMatrix& from);
   void SetCovariance(const SymmetricMatrix& from);
 
+  // Just the diagonal of the covariance.  If only the precisions are known
+  // this comes from their Cholesky factor, without forming the covariance.
+  void GetMarginalVariances(ColumnVector& vars) const;
+
+  // Means and marginal variances of a whole set of MVNs in one pass: a row
+  // per parameter and a column per voxel, so each parameter's values are 
+  // contiguous (in Store()) and ready for volume4D::setmatrix.
+  static void GetMarginals(const vector<MVNDist*>& mvns, 
+			   Matrix& means, Matrix& variances);
+
   void Dump(const string indent = "") const { DumpTo(LOG, indent); }
   void DumpTo(ostream& out, const string indent = "") const;
 
@@ -132,3 +144,90 @@ public:
 inline ostream& operator<<(ostream& out, const MVNDist& dist)
 { dist.DumpTo(out); return out; }
 
+
+// Masked, packed alternative to the NIFTI finalMVN (--mvn-format=packed).
+// Only voxels in the mask are stored, each as its means followed by the
+// lower triangle of its covariance, (1,1) (2,1) (2,2) (3,1)...  The header
+// holds the parameter names, a hash of the mask and the precision (float
+// or double).  Files are memory-mapped, so reading is just a copy into 
+// each voxel's MVNDist, optionally through a remap table.
+class PackedMVNFile {
+public:
+  PackedMVNFile(const string& filename);
+  ~PackedMVNFile();
+
+  // The name of the packed file to read for filename (which may leave off
+  // the .fmvn), or "" if it isn't one -- i.e. it's a NIFTI file.
+  static string Find(const string& filename);
+
+  static void Save(const vector<MVNDist*>& mvns, const string& filename, 
+		   const vector<string>& paramNames, uint64_t maskHash, 
+		   bool doublePrecision = false);
+
+  static uint64_t HashMask(const NEWIMAGE::volume<float>& mask);
+  void CheckMask(const NEWIMAGE::volume<float>& mask) const;
+
+  int NumVoxels() const { return nVoxels; }
+  int NumParams() const { return nParams; }
+  const vector<string>& ParamNames() const { return paramNames; }
+  // Only the forward model parameters are named; the rest are noise.
+  bool DoublePrecision() const { return bytesPerValue == 8; }
+
+  double Mean(int voxel, int p) const { return Value(voxel, p-1); }
+  double Covariance(int voxel, int r, int c) const
+    { if (r < c) swap(r, c); return Value(voxel, nParams + r*(r-1)/2 + c-1); }
+
+  MVNDist* NewMVN(int voxel) const;
+  MVNDist* NewMVN(int voxel, const vector<int>& remap, 
+		  const ColumnVector& defaultMeans, 
+		  const SymmetricMatrix& defaultCovariance) const;
+  // Parameter i of the result is parameter remap[i-1] in the file, or
+  // keeps its default if that's 0.  Covariances are only taken from the
+  // file where both parameters come from it.
+
+ private:
+  string filename;
+  int nVoxels;
+  int nParams;
+  int bytesPerValue; // 4 or 8
+  uint64_t maskHash;
+  vector<string> paramNames;
+
+  void* mapped;
+  size_t mappedBytes;
+  const char* values; // the start of voxel 1
+  double Value(int voxel, int i) const; // i from 0, means first
+
+  static void WriteHeader(FILE* out, int nVoxels, int nParams, 
+			  const vector<string>& paramNames, uint64_t maskHash, 
+			  bool doublePrecision);
+  friend class PackedMVNWriter;
+  // Not copyable (owns the mapping)
+  PackedMVNFile(const PackedMVNFile&);
+  const PackedMVNFile& operator=(const PackedMVNFile&);
+};
+
+// Writes a packed MVN file one voxel at a time, so the whole thing is
+// never in memory.  Add exactly nVoxels voxels, then Close().
+class PackedMVNWriter {
+public:
+  PackedMVNWriter(const string& filename, int nVoxels, int nParams,
+		  const vector<string>& paramNames, uint64_t maskHash, 
+		  bool doublePrecision = false);
+  ~PackedMVNWriter() { if (out != NULL) fclose(out); }
+
+  void AddVoxel(const ColumnVector& means, const SymmetricMatrix& covariance);
+  void Close(); // throws if anything couldn't be written
+
+private:
+  string filename;
+  FILE* out;
+  int nVoxels, nParams, added;
+  bool doublePrecision, ok;
+  vector<double> dbl;
+  vector<float> flt;
+
+  PackedMVNWriter(const PackedMVNWriter&);
+  const PackedMVNWriter& operator=(const PackedMVNWriter&);
+};
+
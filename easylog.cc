@@ -78,7 +78,7 @@
 ostream* EasyLog::filestream = NULL;
 string EasyLog::outDir = "";
 
-void EasyLog::StartLog(const string& basename, bool overwrite)
+void EasyLog::StartLog(const string& basename, bool overwrite, bool append)
 {
   assert(filestream == NULL);
   assert(basename != "");
@@ -114,7 +114,8 @@ void EasyLog::StartLog(const string& basename, bool overwrite)
       count++;
     }
 
-  filestream = new ofstream( (outDir + "/logfile").c_str() );
+  filestream = new ofstream( (outDir + "/logfile").c_str(), 
+			     append ? ios::out | ios::app : ios::out );
 
   if (!filestream->good())
     {
@@ -179,6 +180,11 @@ void Warning::IssueAlways(const string& text)
   LOG_ERR_SAFE("WARNING ALWAYS: " << text << endl);
 }
 
+void Warning::ForgetAll()
+{
+  issueCount.clear();
+}
+
 void Warning::ReissueAll()
 {
   if (issueCount.size() == 0) 
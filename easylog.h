@@ -119,7 +119,8 @@ class EasyLog {
   static const string& GetOutputDirectory()
     { assert(filestream != NULL); return outDir; }
 
-  static void StartLog(const string& basename, bool overwrite);
+  static void StartLog(const string& basename, bool overwrite, bool append = false);
+  // append: carry on the logfile already there (e.g. --resume)
   static void StartLogUsingStream(ostream& s);
   static void StopLog(bool gzip = false);
 
@@ -168,6 +169,7 @@ class Warning {
   static void IssueOnce(const string& text);
   static void IssueAlways(const string& text);
   static void ReissueAll();
+  static void ForgetAll(); // so the next run (e.g. fabber --serve job) starts afresh
  private:
   static map<string, int> issueCount;
 };
@@ -74,11 +74,6 @@ using namespace Utilities;
 #include "miscmaths/miscmaths.h"
 using namespace MISCMATHS;
 
-// Why yes, these are basically global variables.  They're only used in fabber_library mode, and they are only accessed
-// by a few select file-loading/saving functions that are friends of EasyOptions.
-const map<string,const Matrix*>* EasyOptions::inMatrices = NULL;
-map<string,Matrix>* EasyOptions::outMatrices = NULL;
-
 string unescapeFilename(const string& filename)
 {
    if (filename[0]=='<' && filename[filename.size()-1]=='>' && filename.size()>2)
@@ -95,12 +90,12 @@ bool isEscapedFilename(const string& filename)
 }
 
 
-Matrix read_vest_fabber(const string& filename)
+Matrix read_vest_fabber(const string& filename, const EasyOptions& args)
 {
    Tracer_Plus("read_vest_fabber");
-   if (isEscapedFilename(filename))
+   if (isEscapedFilename(filename) && args.UsingMatrixIO())
      {
-	return EasyOptions::InMatrix(unescapeFilename(filename));
+	return args.GetMatrixIO().In(filename);
      }
    else
      {
@@ -109,25 +104,36 @@ Matrix read_vest_fabber(const string& filename)
 }
 
 
-const Matrix& EasyOptions::InMatrix(const string& filename)
+ReturnMatrix MatrixIO::In(const string& filename) const
 {
    if (!isEscapedFilename(filename))
       throw Invalid_option("Should be an escaped matrix name: " + filename);
    string s = unescapeFilename(filename);
-   if (inMatrices->find(s) == inMatrices->end())
+   Matrix m;
+   if (!Read(s, m))
       throw Invalid_option("Missing input matrix " + s);
-   else
-      return *(inMatrices->find(s)->second);
+   m.Release();
+   return m;
 }
    
-Matrix& EasyOptions::OutMatrix(const string& filename) 
+void MatrixIO::Out(const string& filename, const Matrix& m) 
 { 
    if (!isEscapedFilename(filename))
       throw Invalid_option("Should be an escaped matrix name: " + filename);
-   return (*outMatrices)[unescapeFilename(filename)]; 
+   Write(unescapeFilename(filename), m);
+}
+
+bool MapMatrixIO::Read(const string& name, Matrix& m) const
+{
+   map<string,const Matrix*>::const_iterator it = dataIn->find(name);
+   if (it == dataIn->end())
+      return false;
+   m = *(it->second);
+   return true;
 }
 
 EasyOptions::EasyOptions(int argc, char** argv) 
+  : matrixIO(NULL), ownMatrixIO(false), readLog(NULL)
 {
     Tracer_Plus tr("EasyOptions::EasyOptions");
     // Parse argv into key-value pairs
@@ -218,6 +224,7 @@ void EasyOptions::AddKey(const string& key)
 
 string EasyOptions::Read(const string& key, const string& msg)
 {
+    if (readLog != NULL) readLog->insert(key);
     if (args.count(key) == 0)
         throw Invalid_option(msg);
                 
@@ -232,6 +239,7 @@ string EasyOptions::Read(const string& key, const string& msg)
         
 bool EasyOptions::ReadBool(const string& key)
 {
+    if (readLog != NULL) readLog->insert(key);
     if (args.count(key) == 0)
         return false;
         
@@ -248,6 +256,7 @@ bool EasyOptions::ReadBool(const string& key)
 string EasyOptions::ReadWithDefault(const string& key, 
                                     const string& def)
 {
+    if (readLog != NULL) readLog->insert(key);
     if (args.count(key) == 0)
         return def;
     if (args[key] == "")
@@ -68,9 +68,47 @@
 
 #pragma once
 #include <map>
+#include <set>
 #include <string>
 #include "easylog.h"
 
+// Where fabber_library reads its input matrices and puts its results,
+// instead of files.  Options refer to them by escaped filenames, e.g.
+// --data=<data>; results use fixed names such as <means> and <stdevs>.
+// One of these belongs to each run, so separate runs don't share any state.
+class MatrixIO {
+ public:
+  virtual ~MatrixIO() { return; }
+
+  ReturnMatrix In(const string& filename) const;
+  // throws Invalid_option if filename isn't escaped or the matrix is missing
+  void Out(const string& filename, const Matrix& m);
+
+ protected:
+  // name has been unescaped, i.e. "data" rather than "<data>"
+  virtual bool Read(const string& name, Matrix& m) const = 0;
+  virtual void Write(const string& name, const Matrix& m) = 0;
+};
+
+// The original fabber_library interface: inputs are NEWMAT matrices and 
+// each result is copied into a new entry in dataOut.
+class MapMatrixIO : public MatrixIO {
+ public:
+  MapMatrixIO(const map<string,const Matrix*>* dataIn, 
+	      map<string,Matrix>* dataOut)
+    : dataIn(dataIn), dataOut(dataOut) 
+    { assert(dataIn != NULL && dataOut != NULL && dataOut->empty()); }
+
+ protected:
+  virtual bool Read(const string& name, Matrix& m) const;
+  virtual void Write(const string& name, const Matrix& m)
+    { (*dataOut)[name] = m; }
+
+ private:
+  const map<string,const Matrix*>* dataIn;
+  map<string,Matrix>* dataOut;
+};
+
 class EasyOptions {
  public:
     // Create an instance from command-line options
@@ -80,16 +118,19 @@ class EasyOptions {
     EasyOptions(const map<string,string>& src, 
                 const map<string,const Matrix*>* dataIn, 
                 map<string,Matrix>* dataOut) 
-        : args(src) // copy key=value pairs from src; use key="" for no-argument options
+        : args(src), // copy key=value pairs from src; use key="" for no-argument options
+          matrixIO(new MapMatrixIO(dataIn, dataOut)), ownMatrixIO(true), readLog(NULL)
         { 
-          assert(inMatrices==NULL); 
-          assert(outMatrices==NULL); 
-          inMatrices=dataIn; 
-          outMatrices=dataOut; 
-          assert(outMatrices->empty());
 	  args[""] = "fabber_library"; // This would normally hold argv[0].
         }
 
+    EasyOptions(const map<string,string>& src, MatrixIO& io) 
+        : args(src), matrixIO(&io), ownMatrixIO(false), readLog(NULL)
+        { 
+	  args[""] = "fabber_library";
+        }
+        // io must outlast the run (including SaveResults)
+
     // Below: option-reading values.  Once they are called, 
     // the corresponding key=value pair is removed... this is deliberate, to
     // ensure that eacy argument is used exactly once.  If you want to use an
@@ -114,29 +155,42 @@ class EasyOptions {
     void CheckEmpty();
         // throws if there are any options left
 
-    ~EasyOptions() { }; 
+    const map<string,string>& Remaining() const { return args; }
+        // the options that haven't been read yet
+    void Consume(const string& key) { args.erase(key); }
+        // For an option that was used by something kept from an earlier
+        // run (e.g. a cached FwdModel), so it counts as read.
+    void LogReads(set<string>* log) { readLog = log; }
+        // Until called with NULL, add the key of every option asked for
+        // to *log, whether or not it was given.
+
+    ~EasyOptions() { if (ownMatrixIO) delete matrixIO; }
         // throwing an exception in a destructor would be a bad idea!
         // Also, note that args may not be empty, if an exception has
         // been thrown.
 
     friend ostream& operator<<(ostream& out, const EasyOptions& opts);
 
+    // Only set in fabber_library mode:
+    bool UsingMatrixIO() const { return matrixIO != NULL; }
+    MatrixIO& GetMatrixIO() const { assert(matrixIO != NULL); return *matrixIO; }
+
 private:
     map<string,string> args;
         // all remaining unused options.
     void AddKey(const string& key); // internal helper function
 
-    // These are only used in fabber_library mode:
-    static const map<string,const Matrix*>* inMatrices;
-    static map<string,Matrix>* outMatrices;
-public:
-    static bool UsingMatrixIO() { assert(!inMatrices == !outMatrices); return (inMatrices!=NULL); }
-    static const Matrix& InMatrix(const string& filename);  // simpler syntax
-    static Matrix& OutMatrix(const string& filename);
+    MatrixIO* matrixIO;
+    bool ownMatrixIO;
+    set<string>* readLog;
+
+    EasyOptions(const EasyOptions&); // not copyable (owns matrixIO)
+    EasyOptions& operator=(const EasyOptions&);
 };
  
-// Helper function:
-Matrix read_vest_fabber(const string& filename);
+// Helper function: reads a VEST file, or the input matrix if filename is
+// escaped and args are from fabber_library
+Matrix read_vest_fabber(const string& filename, const EasyOptions& args);
 
 typedef EasyOptions ArgsType;
 
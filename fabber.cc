@@ -71,6 +71,13 @@
 #include <stdexcept>
 #include <map>
 #include <string>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "inference.h"
 using namespace std;
 using namespace MISCMATHS;
@@ -85,50 +92,16 @@ void Usage(const string& errorString = "");
 /*** Function implementations ***/
 
 
-int main(int argc, char** argv)
+// One fabber run, from starting its logfile to stopping it.  models is 
+// only given by --serve.  Returns the output directory.
+string RunJob(EasyOptions& args, FwdModelCache* models)
 {
-  bool gzLog = false;
-  try
-    {
-      cout << "------------------\n";
-      cout << "Welcome to FABBER v2.0" << endl;
-      //cout << "Welcome to FABBER development version (1.9)" << endl;
-
-      EasyOptions args(argc, argv);
-
-      if (args.ReadBool("help") || argc==1) 
-        { 
-            string model = args.ReadWithDefault("model","");
-            if (model == "")
-                Usage();
-            else
-                FwdModel::ModelUsageFromName(model, args);
-                                 
-            return 0; 
-        }
-
-      if (args.ReadBool("params"))
-	{ 
-	  string outputDir = args.ReadWithDefault("output",".");
-	  EasyLog::StartLog(outputDir,false); 
-	  ofstream paramFile(( EasyLog::GetOutputDirectory() + "/paramnames.txt").c_str());
-	  vector<string> paramNames;
-	  FwdModel* model;
-	  model = FwdModel::NewFromName(args.Read("model"),args);
-	  model->NameParams(paramNames);
-	  for (unsigned i = 0; i < paramNames.size(); i++)
-	    {
-	      LOG << "      " << paramNames[i] << endl;
-	      paramFile << paramNames[i] << endl;
-	    }
-	  paramFile.close();
-
-	  return 0;
-	}
-
+      // --resume has to carry on in the same output directory, and adds to
+      // the logfile of the run it's resuming
+      const bool resume = args.ReadBool("resume");
       EasyLog::StartLog(
         args.Read("output", "Must specify an output directory, for example: --output=mytestrun"),
-        args.ReadBool("overwrite"));
+        args.ReadBool("overwrite") || resume, resume);
 
         
       LOG_ERR("Logfile started: " << EasyLog::GetOutputDirectory() 
@@ -155,7 +128,7 @@ int main(int argc, char** argv)
         { Tracer_Plus::setinstantstackon(); } // instant stack isn't used?
       if (args.ReadBool("debug-running-stack")) 
         { Tracer_Plus::setrunningstackon(); }
-      gzLog = args.ReadBool("gzip-log");
+      const bool gzLog = args.ReadBool("gzip-log");
 
       Tracer_Plus tr("FABBER main (outer)");
       // can't start it before this or it segfaults if an exception is thown with --debug-timings on.
@@ -165,9 +138,12 @@ int main(int argc, char** argv)
 
       InferenceTechnique* infer = 
         InferenceTechnique::NewFromName(args.Read("method"));
-
+      try
+	{
+      infer->SetModelCache(models);
       infer->Setup(args);
       infer->SetOutputFilenames(EasyLog::GetOutputDirectory());
+      infer->SetResume(resume);
       
       DataSet allData;
       allData.LoadData(args);
@@ -178,6 +154,12 @@ int main(int argc, char** argv)
       // Calculations
       infer->DoCalculations(allData);
       infer->SaveResults(allData);
+	}
+      catch (...)
+	{
+	  delete infer;
+	  throw;
+	}
       delete infer;
       
       LOG_ERR("FABBER is all done." << endl);
@@ -198,9 +180,210 @@ int main(int argc, char** argv)
 
       Warning::ReissueAll();
 
-      cout << "Logfile was: " << EasyLog::GetOutputDirectory() << (gzLog ? "/logfile.gz" : "/logfile") << endl;
+      const string outputDir = EasyLog::GetOutputDirectory();
+      cout << "Logfile was: " << outputDir << (gzLog ? "/logfile.gz" : "/logfile") << endl;
       EasyLog::StopLog(gzLog);
 
+      return outputDir;
+}
+
+// Run the job on one line of --serve input; the reply is "done <output
+// directory>" or "failed <reason>".
+string ServeJob(const string& line, FwdModelCache& models)
+{
+  // Split it up as the shell would (no quoting, like -@ files)
+  vector<string> words(1, "fabber");
+  istringstream is(line);
+  string word;
+  while (is >> word)
+    words.push_back(word);
+  vector<char*> argv;
+  for (unsigned i = 0; i < words.size(); i++)
+    argv.push_back(const_cast<char*>(words[i].c_str()));
+
+  // Warnings are counted per job, like a run of fabber
+  Warning::ForgetAll();
+
+  string error;
+  try
+    {
+      EasyOptions args(argv.size(), &argv[0]);
+      return "done " + RunJob(args, &models);
+    }
+  catch (const Invalid_option& e)
+    {
+      error = Exception::what();
+    }
+  catch (const exception& e)
+    {
+      error = e.what();
+    }
+  catch (Exception)
+    {
+      error = Exception::what();
+    }
+  catch (...)
+    {
+      error = "unknown exception";
+    }
+
+  Warning::ReissueAll();
+  LOG_ERR_SAFE("Job failed:\n  " << error << endl);
+  if (EasyLog::LogStarted())
+    EasyLog::StopLog();
+
+  // The reply has to stay on one line
+  for (unsigned i = 0; i < error.size(); i++)
+    if (error[i] == '\n') error[i] = ' ';
+  return "failed " + error;
+}
+
+// Answer each line read from inFd on outFd, until end of file.  Returns
+// true if a "shutdown" line was read.
+bool ServeJobs(int inFd, int outFd, FwdModelCache& models)
+{
+  string pending;
+  char buffer[4096];
+  bool atEnd = false;
+  while (true)
+    {
+      string::size_type eol;
+      while ((eol = pending.find('\n')) == string::npos && !atEnd)
+	{
+	  ssize_t got = read(inFd, buffer, sizeof(buffer));
+	  if (got < 0 && errno == EINTR)
+	    continue;
+	  if (got <= 0)
+	    atEnd = true;
+	  else
+	    pending.append(buffer, got);
+	}
+      if (pending.empty())
+	return false;
+      // The last line needn't end with a newline
+      string line = pending.substr(0, eol);
+      pending.erase(0, eol == string::npos ? eol : eol + 1);
+
+      if (line.find_first_not_of(" \t\r") == string::npos)
+	continue;
+      if (line == "shutdown")
+	return true;
+
+      const string reply = ServeJob(line, models) + "\n";
+      cout.flush();
+      if (write(outFd, reply.c_str(), reply.size()) != (ssize_t)reply.size())
+	return false; // the client has gone away
+    }
+}
+
+// fabber --serve: run a stream of jobs in one process, each given as a line
+// of the usual options, so that their forward models (and the files they 
+// read) can be reused rather than set up again for every job.
+int Serve(const string& socketPath, int maxModels)
+{
+  Tracer_Plus tr("Serve");
+  FwdModelCache models(maxModels);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (socketPath == "")
+    {
+      // Replies go to stdout, so send everything else that would be
+      // printed there to stderr instead
+      cout.flush();
+      const int replyFd = dup(1);
+      dup2(2, 1);
+      ServeJobs(0, replyFd, models);
+      close(replyFd);
+      return 0;
+    }
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path))
+    throw Invalid_option("--socket path is too long: " + socketPath);
+  strcpy(address.sun_path, socketPath.c_str());
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath.c_str()); // left over from an earlier server
+  if (listener < 0 
+      || bind(listener, (sockaddr*)&address, sizeof(address)) != 0
+      || listen(listener, 8) != 0)
+    throw Runtime_error(("Couldn't listen on socket " + socketPath 
+			 + ": " + strerror(errno)).c_str());
+  cerr << "Serving fabber jobs on " << socketPath << endl;
+
+  // One client at a time; jobs run one after another anyway
+  bool shutdown = false;
+  while (!shutdown)
+    {
+      const int client = accept(listener, NULL, NULL);
+      if (client < 0)
+	{
+	  if (errno == EINTR) continue;
+	  throw Runtime_error(("accept() failed on " + socketPath 
+			       + ": " + strerror(errno)).c_str());
+	}
+      shutdown = ServeJobs(client, client, models);
+      close(client);
+    }
+
+  close(listener);
+  unlink(socketPath.c_str());
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  try
+    {
+      cout << "------------------\n";
+      cout << "Welcome to FABBER v2.0" << endl;
+      //cout << "Welcome to FABBER development version (1.9)" << endl;
+
+      EasyOptions args(argc, argv);
+
+      if (args.ReadBool("help") || argc==1) 
+        { 
+            string model = args.ReadWithDefault("model","");
+            if (model == "")
+                Usage();
+            else
+                FwdModel::ModelUsageFromName(model, args);
+                                 
+            return 0; 
+        }
+
+      if (args.ReadBool("params"))
+	{ 
+	  string outputDir = args.ReadWithDefault("output",".");
+	  EasyLog::StartLog(outputDir,false); 
+	  ofstream paramFile(( EasyLog::GetOutputDirectory() + "/paramnames.txt").c_str());
+	  vector<string> paramNames;
+	  FwdModel* model;
+	  model = FwdModel::NewFromName(args.Read("model"),args);
+	  model->NameParams(paramNames);
+	  for (unsigned i = 0; i < paramNames.size(); i++)
+	    {
+	      LOG << "      " << paramNames[i] << endl;
+	      paramFile << paramNames[i] << endl;
+	    }
+	  paramFile.close();
+
+	  return 0;
+	}
+
+      if (args.ReadBool("serve"))
+	{
+	  const string socketPath = args.ReadWithDefault("socket", "");
+	  const int maxModels = convertTo<int>(args.ReadWithDefault("cached-models", "8"));
+	  if (maxModels < 1)
+	    throw Invalid_option("--cached-models must be at least 1");
+	  args.CheckEmpty();
+	  return Serve(socketPath, maxModels);
+	}
+
+      RunJob(args, NULL);
       return 0;
     }
   catch (const Invalid_option& e)
@@ -263,12 +446,29 @@ void Usage(const string& errorString)
      << "      [--noise-pattern=<phi_index_pattern>] : repeating pattern of noise variances for each data point "
      << "(e.g. --noise-pattern=12 gives odd and even data points different noise variances)\n"
      << "  [--save-model-fit] and [--save-residuals] : Save model fit/residuals files\n"
+     << "  [--save=<list>] : which results to write, from mean,std,zstat,mvn,F,fit,residuals (default: mean,zstat,mvn,F)\n"
+     << "  [--compression={gzip|none|fast|parallel}] : gzip as usual, write uncompressed .nii, gzip quickly, "
+     << "or gzip in blocks shared out between --processes (default: gzip)\n"
+     << "  [--sparse-output] : write results as tables of the voxels in the mask (.fvt, and a packed finalMVN) "
+     << "rather than full-size images; fabber_expand turns them back into images\n"
      << "  [--print-free-energy] : Calculate & dump F to the logfile after each update\n"
+     << "  [--mvn-format={nifti|packed|packed-double}] : save finalMVN as a NIFTI image, or only the masked voxels in a packed file (finalMVN.fmvn) that --continue-from-mvn reads much faster (default: nifti)\n"
+     << "  [--processes=NN] : use up to NN worker processes for steps that can run in parallel (default: 1)\n"
      << "  [--allow-bad-voxels] : Skip to next voxel if a numerical exception occurs (don't stop)\n"
+     << "  [--serve] [--socket=/path] [--cached-models=NN] : keep running and take jobs, one line of the options above each, from stdin "
+     << "(or clients of a UNIX socket); replies 'done <output>' or 'failed <reason>', and 'shutdown' stops it. "
+     << "Jobs that give the same values for every option the model reads (and whose files are unchanged) reuse the same forward model; "
+     << "the NN most recently used models are kept (default: 8)\n"
+     << "  [--checkpoint-every=NN] : save finished voxels to <output>/checkpoint every NN voxels (spatialvb: every NN iterations)\n"
+     << "  [--resume] : carry on from the checkpoint in the --output directory, skipping voxels that were finished\n"
      << "For spatial priors (using --method=spatialvb):\n"
      << "  --param-spatial-priors=<choice_of_prior_forms>: Specify a type of prior to use for each"
      << " forward model parameter.  One letter per parameter.  S=spatial, N=nonspatial, D=Gaussian-process-based combined prior\n"
      << "  --fwd-initial-prior=<prior_vest_file>: specify the nonspatial prior distributions on the forward model parameters.  The vest file is the covariance matrix supplemented by the prior means; see the documentation for details.  Very important if 'D' prior is used.\n"
+     << "  [--multires=NN] : solve on NN-1 successively halved grids first and use each result to initialise the next finer one (default: 1, off)\n"
+     << "  [--spatial-blocks=NN] : split the volume into NN slabs along z, each solved by its own process (N, A, m, M, p and P priors only)\n"
+     << "  [--covariance-cache-mb=NN] : memory budget for cached covariance matrices used by the 'D' prior (default: 0, only keep the current one)\n"
+     << "  [--covariance-cache-dir=/path] : also store these matrices on disk, so later runs on the same mask can reuse them\n"
      << endl;
 
 
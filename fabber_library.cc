@@ -0,0 +1,188 @@
+/*  fabber_library.cc - Running fabber in memory, on the caller's buffers
+
+    Michael Chappell, FMRIB Image Analysis Group
+
+    Copyright (C) 2007-2008 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "fabber_library.h"
+#include "inference.h"
+#include "fwdmodel.h"
+#include "easylog.h"
+#include <pthread.h>
+
+// Held for the whole of each library call, since the log, warnings and
+// tracer stacks are process-wide
+static pthread_mutex_t libraryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+class LibraryLock {
+ public:
+  LibraryLock() { pthread_mutex_lock(&libraryMutex); }
+  ~LibraryLock() { pthread_mutex_unlock(&libraryMutex); }
+ private:
+  LibraryLock(const LibraryLock&);
+  const LibraryLock& operator=(const LibraryLock&);
+};
+
+void FabberBuffer::CopyTo(Matrix& m) const
+{
+  m.ReSize(rows, cols);
+  Real* out = m.Store(); // row-major
+  for (int c = 0; c < cols; c++)
+    for (int r = 0; r < rows; r++)
+      out[r*cols + c] = doubles ? doubles[c*rows + r] : floats[c*rows + r];
+}
+
+void FabberBuffer::CopyFrom(const Matrix& m)
+{
+  if (readOnly)
+    throw Logic_error("Can't write results into a read-only FabberBuffer");
+  if (m.Nrows() != rows || m.Ncols() != cols)
+    throw Invalid_option("Result is " + stringify(m.Nrows()) + " x " 
+			 + stringify(m.Ncols()) + " but its buffer is " 
+			 + stringify(rows) + " x " + stringify(cols));
+  const Real* in = m.Store();
+  for (int c = 0; c < cols; c++)
+    for (int r = 0; r < rows; r++)
+      {
+	if (doubles)
+	  doubles[c*rows + r] = in[r*cols + c];
+	else
+	  floats[c*rows + r] = in[r*cols + c];
+      }
+}
+
+bool BufferMatrixIO::Read(const string& name, Matrix& m) const
+{
+  map<string, FabberBuffer>::const_iterator it = inputs.find(name);
+  if (it == inputs.end())
+    return false;
+  it->second.CopyTo(m);
+  return true;
+}
+
+void BufferMatrixIO::Write(const string& name, const Matrix& m)
+{
+  map<string, FabberBuffer>::iterator it = outputs.find(name);
+  if (it != outputs.end())
+    it->second.CopyFrom(m);
+}
+
+// If the caller hasn't started a log, send LOG nowhere for this scope
+class LibraryLog {
+ public:
+  LibraryLog() : nowhere(NULL), started(!EasyLog::LogStarted()) 
+    { if (started) EasyLog::StartLogUsingStream(nowhere); }
+  ~LibraryLog() { if (started) EasyLog::StopLog(); }
+ private:
+  ostream nowhere; // no streambuf, so writes are ignored
+  bool started;
+};
+
+void RunFabber(const map<string,string>& options, MatrixIO& io)
+{
+  LibraryLock lock;
+  LibraryLog log;
+  Tracer_Plus tr("RunFabber");
+
+  if (options.count("output") || options.count("checkpoint-every") 
+      || options.count("resume"))
+    throw Invalid_option("--output, --checkpoint-every and --resume can't be used with fabber_library");
+
+  EasyOptions args(options, io);
+  InferenceTechnique* infer = 
+    InferenceTechnique::NewFromName(args.Read("method"));
+  try
+    {
+      infer->Setup(args);
+
+      DataSet allData;
+      allData.LoadData(args);
+      args.CheckEmpty();
+
+      infer->DoCalculations(allData);
+      infer->SaveResults(allData);
+    }
+  catch (...)
+    {
+      delete infer;
+      throw;
+    }
+  delete infer;
+}
+
+void FabberParamNames(const map<string,string>& options, vector<string>& names)
+{
+  LibraryLock lock;
+  LibraryLog log;
+  Tracer_Plus tr("FabberParamNames");
+
+  map<string, const Matrix*> noInputs;
+  map<string, Matrix> noOutputs;
+  EasyOptions args(options, &noInputs, &noOutputs);
+  FwdModel* model = FwdModel::NewFromName(args.Read("model"), args);
+  names.clear();
+  model->NameParams(names);
+  delete model;
+}
@@ -0,0 +1,140 @@
+/*  fabber_library.h - Running fabber in memory, on the caller's buffers
+
+    Michael Chappell, FMRIB Image Analysis Group
+
+    Copyright (C) 2007-2008 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include "easyoptions.h"
+
+// A caller-owned array of rows x cols values, stored one column after 
+// another: each voxel's timeseries (or parameters) is contiguous, i.e. 
+// element (r,c), from 1, is at p[(c-1)*rows + r-1].  Either precision.
+// Fabber copies inputs out of these and results into them (CopyTo and
+// CopyFrom), and never allocates, frees or keeps the pointers past a run.
+class FabberBuffer {
+ public:
+  FabberBuffer() : doubles(NULL), floats(NULL), rows(0), cols(0), readOnly(true) { return; }
+  FabberBuffer(double* p, int rows, int cols)
+    : doubles(p), floats(NULL), rows(rows), cols(cols), readOnly(false) { return; }
+  FabberBuffer(float* p, int rows, int cols)
+    : doubles(NULL), floats(p), rows(rows), cols(cols), readOnly(false) { return; }
+  FabberBuffer(const double* p, int rows, int cols)
+    : doubles(const_cast<double*>(p)), floats(NULL), rows(rows), cols(cols), readOnly(true) { return; }
+  FabberBuffer(const float* p, int rows, int cols)
+    : doubles(NULL), floats(const_cast<float*>(p)), rows(rows), cols(cols), readOnly(true) { return; }
+
+  int Nrows() const { return rows; }
+  int Ncols() const { return cols; }
+
+  void CopyTo(Matrix& m) const;
+  void CopyFrom(const Matrix& m); // m must be Nrows() x Ncols()
+
+ private:
+  double* doubles;
+  float* floats;
+  int rows, cols;
+  bool readOnly;
+};
+
+// MatrixIO on caller buffers.  Inputs are named as in the options, e.g.
+// AddInput("data", ...) for --data=<data>.  Results are copied into 
+// whichever of means, stdevs (nParams x nVoxels), noise_means, 
+// noise_stdevs, freeEnergy (1 x nVoxels), modelfit and residuals have been
+// added as outputs; the others are dropped.
+class BufferMatrixIO : public MatrixIO {
+ public:
+  void AddInput(const string& name, const FabberBuffer& buffer)
+    { inputs[name] = buffer; }
+  void AddOutput(const string& name, const FabberBuffer& buffer)
+    { outputs[name] = buffer; }
+
+ protected:
+  virtual bool Read(const string& name, Matrix& m) const;
+  virtual void Write(const string& name, const Matrix& m);
+
+ private:
+  map<string, FabberBuffer> inputs;
+  map<string, FabberBuffer> outputs;
+};
+
+// Run fabber with the given options (as on the command line, without the
+// "--"; use "" as the value of a flag), reading input matrices from io and
+// giving it the results.  Nothing is written to disk, so --output, 
+// --checkpoint-every and --resume aren't allowed.  Each run has its own 
+// options, data and results; if no log has been started everything that 
+// would be logged is discarded.  Throws as fabber would.
+// Runs are serialised: fabber still has process-wide state (the log, 
+// warning counts, Tracer_Plus stacks), so a call from another thread 
+// waits until the current run (or FabberParamNames) has finished.
+void RunFabber(const map<string,string>& options, MatrixIO& io);
+
+// The forward model's parameter names, in the order of the rows of 
+// <means> and <stdevs>.  Only the model options are needed.
+void FabberParamNames(const map<string,string>& options, vector<string>& names);
@@ -69,6 +69,7 @@
 #include "fwdmodel.h"
 
 #include <sstream> 
+#include <sys/stat.h>
 #include "easylog.h"
  
 string FwdModel::ModelVersion() const
@@ -89,6 +90,20 @@ int FwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
   return false;
 }
 
+void FwdModel::LinearParams(vector<bool>& linear) const
+{
+  linear.assign(NumParams(), false);
+}
+
+bool FwdModel::IsLinear() const
+{
+  vector<bool> linear;
+  LinearParams(linear);
+  for (unsigned i = 0; i < linear.size(); i++)
+    if (!linear[i]) return false;
+  return true;
+}
+
 int FwdModel::NumOutputs() const
 {
     ColumnVector params, result;
@@ -299,6 +314,114 @@ FwdModel* FwdModel::NewFromName(const string& name, ArgsType& args)
 }
 
 // If you want usage information from --help --model=yourmodel, add it below.
+// Options that differ from one job to the next without changing the model
+static bool IsJobSpecificOption(const string& key)
+{
+  if (key == "" || key == "output" || key == "overwrite" 
+      || key == "mask" || key == "suppdata")
+    return true;
+  // --data, --data1, --data2, ...
+  return key.compare(0, 4, "data") == 0 
+    && key.find_first_not_of("0123456789", 4) == string::npos;
+}
+
+// What an option value is cached under: the value itself, and if it names
+// a file, the file's identity, size and modification time as well, so that
+// a model isn't reused after a file it read (e.g. --basis) has changed
+string FwdModelCache::CacheKey(const string& value)
+{
+  struct stat st;
+  if (value == "" || stat(value.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    return value;
+  return value + "\n" + stringify(st.st_dev) + ":" + stringify(st.st_ino) 
+    + ":" + stringify(st.st_size) + ":" + stringify(st.st_mtime);
+}
+
+bool FwdModelCache::Matches(const Entry& entry, const map<string,string>& options)
+{
+  for (map<string,string>::const_iterator it = entry.options.begin(); 
+       it != entry.options.end(); it++)
+    {
+      map<string,string>::const_iterator given = options.find(it->first);
+      if (given == options.end() || CacheKey(given->second) != it->second)
+	return false;
+    }
+  for (unsigned i = 0; i < entry.unset.size(); i++)
+    if (options.count(entry.unset[i]) > 0)
+      return false;
+  return true;
+}
+
+FwdModel* FwdModelCache::Get(ArgsType& args)
+{
+  Tracer_Plus tr("FwdModelCache::Get");
+
+  const map<string,string> before = args.Remaining();
+  for (list<Entry>::iterator it = entries.begin(); it != entries.end(); it++)
+    if (Matches(*it, before))
+      {
+	for (map<string,string>::const_iterator opt = it->options.begin(); 
+	     opt != it->options.end(); opt++)
+	  args.Consume(opt->first);
+	entries.splice(entries.begin(), entries, it);
+	LOG << "    Reusing the forward model from an earlier job" << endl;
+	return entries.front().model;
+      }
+
+  // Note every option the model looks at, given or not, so that later jobs
+  // only get it if they agree on all of them
+  set<string> asked;
+  args.LogReads(&asked);
+  FwdModel* model;
+  try
+    {
+      model = FwdModel::NewFromName(args.Read("model"), args);
+    }
+  catch (...)
+    {
+      args.LogReads(NULL);
+      throw;
+    }
+  args.LogReads(NULL);
+
+  Entry entry;
+  entry.model = model;
+  for (set<string>::const_iterator it = asked.begin(); it != asked.end(); it++)
+    {
+      // A model that looks at the job's data can't be shared
+      if (IsJobSpecificOption(*it))
+	return model;
+      map<string,string>::const_iterator given = before.find(*it);
+      if (given == before.end())
+	entry.unset.push_back(*it);
+      else
+	entry.options[*it] = CacheKey(given->second);
+    }
+
+  // Nothing older than this job is still in use, so it's safe to drop
+  entries.push_front(entry);
+  if (entries.size() > maxModels)
+    {
+      delete entries.back().model;
+      entries.pop_back();
+    }
+  return model;
+}
+
+bool FwdModelCache::Owns(const FwdModel* model) const
+{
+  for (list<Entry>::const_iterator it = entries.begin(); it != entries.end(); it++)
+    if (it->model == model)
+      return true;
+  return false;
+}
+
+FwdModelCache::~FwdModelCache()
+{
+  for (list<Entry>::iterator it = entries.begin(); it != entries.end(); it++)
+    delete it->model;
+}
+
 void FwdModel::ModelUsageFromName(const string& name, ArgsType& args)
 {
     // Update this to add your own models to the code
@@ -83,6 +83,7 @@
 #include "newmatap.h"
 #include <string>
 #include <vector>
+#include <list>
 #include "dist_mvn.h"
 #include "easyoptions.h"
 
@@ -106,6 +107,14 @@ public:
 
   virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
   // evaluate the gradient, the int return is to indicate whether a valid gradient is returned by the model
+
+  virtual void LinearParams(vector<bool>& linear) const;
+  // Flag the parameters that g() is exactly linear in, with a Jacobian column
+  // that depends on neither the parameters nor the voxel.  These columns are
+  // only worked out once.  Default: none.
+
+  bool IsLinear() const;
+  // True if LinearParams() flags every parameter, i.e. g(p) = J*p + c
                   
   virtual string ModelVersion() const; 
   // Return a CVS version info string
@@ -174,5 +183,31 @@ public:
   ColumnVector suppdata;
 };
 
+// Forward models kept between the jobs of fabber --serve, so that a job 
+// with the same model options as an earlier one doesn't construct the
+// model again (and re-read its design matrices, pool files, AIFs...).
+// Only the maxModels most recently used are kept.
+class FwdModelCache {
+ public:
+  FwdModelCache(unsigned maxModels = 8) : maxModels(maxModels) { return; }
+  FwdModel* Get(ArgsType& args);
+  // Like NewFromName(args.Read("model"), args), but may return a model made
+  // for an earlier job that gave the same values for every option that
+  // model looked at.  Delete the result only if !Owns() it.
+  bool Owns(const FwdModel* model) const;
+  ~FwdModelCache();
+
+ private:
+  struct Entry {
+    FwdModel* model;
+    map<string,string> options; // what it read, and CacheKey(value)
+    vector<string> unset;       // what it looked for and didn't find
+  };
+  static string CacheKey(const string& value);
+  static bool Matches(const Entry& entry, const map<string,string>& options);
+  unsigned maxModels;
+  list<Entry> entries; // most recently used first
+};
+
 #endif /* __FABBER_FWDMODEL_H */
 
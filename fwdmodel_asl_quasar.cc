@@ -15,6 +15,7 @@
 #include "miscmaths/miscprob.h"
 using namespace NEWIMAGE;
 #include "easylog.h"
+#include "tools.h"
 
 string QuasarFwdModel::ModelVersion() const
 {
@@ -389,7 +390,7 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
   //p = paramcpy(disp_index());
   //if (p>timax-0.2) { p = timax-0.2; }
   s = exp( params(disp_index()) );
-  if (disptype=="gamma" || disptype=="gvf")  {
+  if (dispmodel==DISP_GAMMA || dispmodel==DISP_GVF)  {
     float sp = exp(params(disp_index()+1));
     if (sp>10) sp=10;
     p = sp/s;
@@ -417,8 +418,9 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
 
     //cout << T_1 << " " << FAtrue << " ";
 
-    float T_1app = 1/( 1/T_1 + 0.01/lambdagm - log(cos(FAtrue))/dti);
-    float T_1appwm = 1/( 1/T_1wm + 0.01/lambdawm - log(cos(FAtrue))/dti);
+    float llterm = calibon ? -log(cos(FAtrue))/dti : llrelax;
+    float T_1app = 1/( 1/T_1 + 0.01/lambdagm + llterm);
+    float T_1appwm = 1/( 1/T_1wm + 0.01/lambdawm + llterm);
 
     // Need to be careful with T1 values
     if (T_1b<0.1) T_1b=0.1;
@@ -428,7 +430,7 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     if (fabs(T_1appwm - T_1b)<0.01) T_1appwm += 0.01;
 
     // calculate the 'LL T1' of the blood
-    float T_1ll = 1/( 1/T_1b - log(cos(FAtrue))/dti);
+    float T_1ll = 1/( 1/T_1b + llterm);
     float deltll = deltblood; //the arrival time of the blood within the readout region i.e. where it sees the LL pulses.
 
     float tau=tauset; //bolus length as seen by kintic curve
@@ -443,41 +445,34 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     ColumnVector kcblood(tis.Nrows()); kcblood=0.0;
     ColumnVector kcwm(tis.Nrows()); kcwm=0.0;
 
-    ColumnVector thetis;
-    thetis=tis;
-    thetis += slicedt*coord_z; //account here for an increase in delay between slices
+    if (thetis.Nrows()!=tis.Nrows() || thetisz!=coord_z) {
+      thetis=tis;
+      thetis += slicedt*coord_z; //account here for an increase in delay between slices
+      thetisz=coord_z;
+    }
 
     // generate the kinetic curves
-    if (disptype=="none") {
+    switch (dispmodel) {
+    case DISP_NONE:
       if (infertiss) kctissue=kctissue_nodisp(thetis,delttiss,tau,T_1b,T_1app,deltll,T_1ll);
-    //cout << kctissue << endl;
       if (inferwm) kcwm=kctissue_nodisp(thetis,deltwm,tauwm,T_1b,T_1appwm,deltll,T_1ll);
       if (inferart) kcblood=kcblood_nodisp(thetis,deltblood,taub,T_1b,deltll,T_1ll);
-    //cout << kcblood << endl;
-    }
-    else if (disptype=="gamma") {
+      break;
+    case DISP_GAMMA:
       if (infertiss) kctissue=kctissue_gammadisp(thetis,delttiss,tau,T_1b,T_1app,s,p,deltll,T_1ll);
-    //cout << kctissue << endl;
       if (inferwm) kcwm=kctissue_gammadisp(thetis,deltwm,tauwm,T_1b,T_1appwm,s,p,deltll,T_1ll);
       if (inferart) kcblood=kcblood_gammadisp(thetis,deltblood,taub,T_1b,s,p,deltll,T_1ll);
-    //cout << kcblood << endl;
-    }
-    else if (disptype=="gvf") {
+      break;
+    case DISP_GVF:
       if (infertiss) kctissue=kctissue_gvf(thetis,delttiss,tau,T_1b,T_1app,s,p,deltll,T_1ll);
-    //cout << kctissue << endl;
       if (inferwm) kcwm=kctissue_gvf(thetis,deltwm,tauwm,T_1b,T_1appwm,s,p,deltll,T_1ll);
       if (inferart) kcblood=kcblood_gvf(thetis,deltblood,taub,T_1b,s,p,deltll,T_1ll);
-    //cout << kcblood << endl;
-    }
-   else if (disptype=="gauss") {
-     if (infertiss) kctissue=kctissue_gaussdisp(thetis,delttiss,tau,T_1b,T_1app,s,s,deltll,T_1ll);
-    //cout << kctissue << endl;
-     if (inferwm) kcwm=kctissue_gaussdisp(thetis,deltwm,tauwm,T_1b,T_1appwm,s,s,deltll,T_1ll);
-     if (inferart) kcblood=kcblood_gaussdisp(thetis,deltblood,tau,T_1b,s,s,deltll,T_1ll);
-    //cout << kcblood << endl;
-    }
-    else {
-      throw Exception("Unrecognised dispersion model ");
+      break;
+    case DISP_GAUSS:
+      if (infertiss) kctissue=kctissue_gaussdisp(thetis,delttiss,tau,T_1b,T_1app,s,s,deltll,T_1ll);
+      if (inferwm) kcwm=kctissue_gaussdisp(thetis,deltwm,tauwm,T_1b,T_1appwm,s,s,deltll,T_1ll);
+      if (inferart) kcblood=kcblood_gaussdisp(thetis,deltblood,tau,T_1b,s,s,deltll,T_1ll);
+      break;
     }
 
     /* KC debugging
@@ -496,48 +491,18 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     */
 
     // Nan catching
-    bool cont=true;
-    int it=1;
-    while (cont) {
-      if (isnan(kctissue(it)) | isinf(kctissue(it))) { 
-      
-      LOG << "Warning NaN in kctissue" << endl;
-      LOG << "params: " << params.t() << endl;
-      LOG << "kctissue: " << kctissue.t() << endl;
-      cont =false;
-      kctissue=0.0;
- }
-    it++;
-    if (it>kctissue.Nrows()) cont=false;
-  }
-
-    cont=true;
-    it=1;
-    while (cont) {
-      if (isnan(kcblood(it)) | isinf(kcblood(it))) { 
-      
-      LOG << "Warning NaN in kcblood" << endl;
-      LOG << "params: " << params.t() << endl;
-      LOG << "kcblood: " << kcblood.t() << endl;
-      cont =false;
-      kcblood=0.0;
- }
-    it++;
-    if (it>kcblood.Nrows()) cont=false;
-  }
+    CheckFinite(kctissue,"kctissue",params);
+    CheckFinite(kcblood,"kcblood",params);
 
     // assemble the result
     int nti=tis.Nrows();
-    int nphases=6;
-    if (onephase) nphases=1;
     result.ReSize(tis.Nrows()*repeats*nphases);
 
-
-    ColumnVector artweight(crushdir.Nrows());
+    // weight on the arterial signal for each crusher (0 = not crushed)
+    double bloodweight[5];
+    bloodweight[0] = fblood;
     if (artdir) {
       //sot out the arterial weightings for all the crushed images
-      artweight=1.0;
-      //float angle;
       ColumnVector artdir(3);
       artdir(1) = sin(bloodphi)*cos(bloodth);
       artdir(2) = sin(bloodphi)*sin(bloodth);
@@ -546,55 +511,38 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
       for (int i=1; i<=crushdir.Nrows(); i++) {
 	//artweight(i) = 1.0 - std::max(DotProduct(artdir,crushdir.Row(i)),0.0); # original linear approximation
 	//artweight(i) = exp( -bloodbv * std::max(DotProduct(artdir,crushdir.Row(i)),0.0) ); # exponential based on simple diffusion expt
-	artweight(i) = Sinc( 2 * bloodbv * std::max(DotProduct(artdir,crushdir.Row(i)),0.0) ); // based on laminar flow profile c.f. perfusion tensor imaging
-
-	//angle = fabs(crushdir(i) - blooddir);
-	//if (angle<M_PI/2) {
-	//  artweight(i) = crusheff*sin(angle) + 1.0 - crusheff;
-	//}
+	double artweight = Sinc( 2 * bloodbv * std::max(DotProduct(artdir,crushdir.Row(i)),0.0) ); // based on laminar flow profile c.f. perfusion tensor imaging
+	bloodweight[i] = artweight*fblood;
       }
     }
-
+    else {
+      bloodweight[1] = fbloodc1;
+      bloodweight[2] = fbloodc2;
+      bloodweight[3] = fbloodc3;
+      bloodweight[4] = fbloodc4;
+    }
 
     for(int it=1; it<=tis.Nrows(); it++)
       {
-
+	// the tissue and wm signal is the same in every phase
+	double tisswm = pv_gm*ftiss*kctissue(it) + pv_wm*fwm*kcwm(it);
 
 	/* output */
 	// loop over the repeats
 	for (int rpt=1; rpt<=repeats; rpt++)
 	  {
-
-
 	    // go through all the phases
 	    // phases: C1, C2, NC, C3, C4, NC, (NC LFA)
 	    int tiref = (it-1)*repeats+rpt;
-	    	    
+
 	    if (onephase) {
-	      result(tiref) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
+	      result(tiref) = tisswm + fblood*kcblood(it);
 	    }
-	    else if (artdir) {
-	      result( tiref )                 = pv_gm*ftiss*kctissue(it) + artweight(1)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( nti*repeats + tiref )   = pv_gm*ftiss*kctissue(it) + artweight(2)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 2*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 3*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + artweight(3)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 4*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + artweight(4)*fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      result( 5*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-	      //result( 6*nti*repeats + tiref ) = pv_gm*ftiss*kctissue + fblood*kcblood + pv_wm*fwm*kcwm;
+	    else {
+	      for (int ph=0; ph<nphases; ph++)
+		result( ph*nti*repeats + tiref ) = tisswm + bloodweight[phasecrush[ph]]*kcblood(it);
 	    }
-	    else 
-	      {
-		result( tiref )                 = pv_gm*ftiss*kctissue(it) + fbloodc1*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( nti*repeats + tiref )   = pv_gm*ftiss*kctissue(it) + fbloodc2*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 2*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 3*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fbloodc3*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 4*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fbloodc4*kcblood(it) + pv_wm*fwm*kcwm(it);
-		result( 5*nti*repeats + tiref ) = pv_gm*ftiss*kctissue(it) + fblood*kcblood(it) + pv_wm*fwm*kcwm(it);
-		//result( 6*nti*repeats + tiref ) = pv_gm*ftiss*kctissue + fblood*kcblood + pv_wm*fwm*kcwm;
-	      }
 	  }
-
- 
       }
     //cout << result.t();
 
@@ -606,7 +554,24 @@ void QuasarFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
 }
 
 
+bool QuasarFwdModel::CheckFinite(ColumnVector& kc, const string& name, const ColumnVector& params) const
+{
+  // Zero the whole curve if there is a NaN or inf anywhere in it
+  const Real* v = kc.Store();
+  for (int it=0; it<kc.Nrows(); it++) {
+    if (isnan(v[it]) || isinf(v[it])) {
+      LOG << "Warning NaN in " << name << endl;
+      LOG << "params: " << params.t() << endl;
+      LOG << name << ": " << kc.t() << endl;
+      kc=0.0;
+      return false;
+    }
+  }
+  return true;
+}
+
 QuasarFwdModel::QuasarFwdModel(ArgsType& args)
+  : thetisz(0), igammaTable(NULL)
 {
     string scanParams = args.ReadWithDefault("scan-params","cmdline");
     
@@ -615,6 +580,11 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
       // specify command line parameters here
       //dispersion model
       disptype=args.ReadWithDefault("disp","gamma");
+      if (disptype=="none") dispmodel = DISP_NONE;
+      else if (disptype=="gamma") dispmodel = DISP_GAMMA;
+      else if (disptype=="gvf") dispmodel = DISP_GVF;
+      else if (disptype=="gauss") dispmodel = DISP_GAUSS;
+      else throw Invalid_option("Unrecognised dispersion model (--disp): " + disptype);
 
       repeats = convertTo<int>(args.Read("repeats")); // number of repeats in data
       t1 = convertTo<double>(args.ReadWithDefault("t1","1.3"));
@@ -702,8 +672,21 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
       //determine the TI interval (assume it is even throughout)
       dti = tis(2)-tis(1);
 
+      // approximate igamc in the gamma/gvf dispersion models (k = 1+sp, where sp <= 10)
+      if (args.ReadBool("fast-igamma")) {
+	double tol = convertTo<double>(args.ReadWithDefault("fast-igamma-tol","1e-6"));
+	if (tol <= 0) throw Invalid_option("--fast-igamma-tol must be positive");
+	igammaTable = new IncompleteGammaTable(1, 11, tol);
+	if (!igammaTable->Valid())
+	  {
+	    delete igammaTable; // already warned; igamc is used instead
+	    igammaTable = NULL;
+	  }
+      }
+
       float fadeg = convertTo<double>(args.ReadWithDefault("fa","30"));
       FA = fadeg * M_PI/180;
+      llrelax = -log(cos(FA))/dti;
       
       //setup crusher directions
       //crushdir.ReSize(4);
@@ -718,6 +701,11 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
 
       crushdir /= sqrt(3); //make unit vectors;
 
+      // output phases: C1, C2, NC, C3, C4, NC
+      nphases = onephase ? 1 : 6;
+      int crushorder[6] = {1, 2, 0, 3, 4, 0};
+      phasecrush.assign(crushorder, crushorder+6);
+
       
       singleti = false; //normally we do multi TI ASL
       /*if (tis.Nrows()==1) {
@@ -766,6 +754,11 @@ QuasarFwdModel::QuasarFwdModel(ArgsType& args)
  
 }
 
+QuasarFwdModel::~QuasarFwdModel()
+{
+  delete igammaTable;
+}
+
 void QuasarFwdModel::ModelUsage()
 { 
   cout << "To be added"
@@ -977,11 +970,11 @@ ColumnVector QuasarFwdModel::kcblood_gammadisp(const ColumnVector& tis, float de
 	}
       else if(ti >= deltblood && ti <= (deltblood + taub))
 	{ 
-	  kcblood(it) = 2 * exp(-ti/T_1b) * ( 1 - igamc(k,s*(ti-deltblood))  ); 
+	  kcblood(it) = 2 * exp(-ti/T_1b) * ( 1 - Igamc(k,s*(ti-deltblood))  ); 
 	}
       else //(ti > deltblood + taub)
 	{
-	  kcblood(it) = 2 * exp(-ti/T_1b) * ( igamc(k,s*(ti-deltblood-taub)) - igamc(k,s*(ti-deltblood)) ) ; 
+	  kcblood(it) = 2 * exp(-ti/T_1b) * ( Igamc(k,s*(ti-deltblood-taub)) - Igamc(k,s*(ti-deltblood)) ) ; 
 	  
 	}
       //if (isnan(kcblood(it))) { kcblood(it)=0.0; cout << "Warning NaN in blood KC"; }
@@ -1002,6 +995,8 @@ ColumnVector QuasarFwdModel::kcblood_gvf(const ColumnVector& tis, float deltbloo
   //        no explicit taub (see below). However, it does scale the area under the curve
   //                                      (since it affects the original ammount of labeled blood).
   float ti=0.0;
+  // normalisation of the gvf (see gvf()), the same for every TI
+  float gvfnorm = pow(s,1+s*p) / MISCMATHS::gamma(1+s*p);
 
   for(int it=1; it<=tis.Nrows(); it++)
     {
@@ -1016,7 +1011,7 @@ ColumnVector QuasarFwdModel::kcblood_gvf(const ColumnVector& tis, float deltbloo
 	}
       else //if(ti >= deltblood) && ti <= (deltblood + taub))
 	{ 
-	  kcblood(it) = 2 * exp(-ti/T_1b) * gvf(ti-deltblood,s,p); 
+	  kcblood(it) = 2 * exp(-ti/T_1b) * gvfnorm * pow(ti-deltblood,s*p) * exp(-s*(ti-deltblood)); 
 	}
       // we do not have bolus duration with a GVF AIF - the duration is 'built' into the function shape
       //else //(ti > deltblood + taub)
@@ -1116,17 +1111,17 @@ ColumnVector QuasarFwdModel::kctissue_gammadisp(const ColumnVector& tis, float d
       else if(ti >= delttiss && ti <= (delttiss + tau))
 	{
 	  kctissue(it) = 2* 1/A * exp( -(T_1app*delttiss + (T_1app+T_1b)*ti)/(T_1app*T_1b) )*T_1app*T_1b*pow(B,-k)*
-	    (  exp(delttiss/T_1app + ti/T_1b) * pow(s*T_1app*T_1b,k) * ( 1 - igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
-	       exp(delttiss/T_1b + ti/T_1app) * pow(B,k) * ( -1 + igamc(k,s*(ti-delttiss)) )  );  
+	    (  exp(delttiss/T_1app + ti/T_1b) * pow(s*T_1app*T_1b,k) * ( 1 - Igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
+	       exp(delttiss/T_1b + ti/T_1app) * pow(B,k) * ( -1 + Igamc(k,s*(ti-delttiss)) )  );  
 	  
 	}
       else //(ti > delttiss + tau)
 	{
 	  kctissue(it) = 2* 1/(A*B) *
 	    (  exp(-A/(T_1app*T_1b)*(delttiss+tau) - ti/T_1app)*T_1app*T_1b/C*
-	       (  pow(s,k)*T_1app*T_1b* ( -1 + exp( (-1/T_1app+1/T_1b)*tau )*( 1 - igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
-					  igamc(k,B/(T_1app*T_1b)*(ti-delttiss-tau)) ) - 
-		  exp( -A/(T_1app*T_1b)*(ti-delttiss-tau) )*C*B * ( igamc(k,s*(ti-delttiss-tau)) - igamc(k,s*(ti-delttiss)) ) )  );
+	       (  pow(s,k)*T_1app*T_1b* ( -1 + exp( (-1/T_1app+1/T_1b)*tau )*( 1 - Igamc(k,B/(T_1app*T_1b)*(ti-delttiss)) ) +
+					  Igamc(k,B/(T_1app*T_1b)*(ti-delttiss-tau)) ) - 
+		  exp( -A/(T_1app*T_1b)*(ti-delttiss-tau) )*C*B * ( Igamc(k,s*(ti-delttiss-tau)) - Igamc(k,s*(ti-delttiss)) ) )  );
 	  
 	}
       //if (isnan(kctissue(it))) { kctissue(it)=0.0; cout << "Warning NaN in tissue KC"; }
@@ -1163,12 +1158,12 @@ ColumnVector QuasarFwdModel::kctissue_gvf(const ColumnVector& tis, float delttis
 	{ kctissue(it) = 0.0;}
       else //if(ti >= delttiss && ti <= (delttiss + tau))
 	{
-	  kctissue(it) = 2* 1/(B*C) * exp(-(ti-delttiss)/T_1app)*sps*T_1app*T_1b * (1 - igamc(k,(s-1/T_1app-1/T_1b)*(ti-delttiss)));
+	  kctissue(it) = 2* 1/(B*C) * exp(-(ti-delttiss)/T_1app)*sps*T_1app*T_1b * (1 - Igamc(k,(s-1/T_1app-1/T_1b)*(ti-delttiss)));
 	}
       // bolus duraiton is specified by the CVF AIF shape and is not an explicit parameter
       //else //(ti > delttiss + tau)
       //	{
-      //	  kctissue(it) = exp(-(ti-delttiss-tau)/T_1app) * 2* 1/(B*C) * exp(-(delttiss+tau)/T_1app)*sps*T_1app*T_1b * (1 - igamc(k,(s-1/T_1app-1/T_1b)*(delttiss+tau)));
+      //	  kctissue(it) = exp(-(ti-delttiss-tau)/T_1app) * 2* 1/(B*C) * exp(-(delttiss+tau)/T_1app)*sps*T_1app*T_1b * (1 - Igamc(k,(s-1/T_1app-1/T_1b)*(delttiss+tau)));
       //	}
     }
   return kctissue*tau;
@@ -1208,16 +1203,20 @@ ColumnVector kctissue(tis.Nrows());
 }
 
 // --- useful general functions ---
+double QuasarFwdModel::Igamc(double a, double x) const {
+  // no tracer: this is called several times per TI
+  if (igammaTable) return igammaTable->Q(a,x);
+  else             return igamc(a,x);
+}
+
 float QuasarFwdModel::icgf(float a, float x) const {
-  Tracer_Plus tr("QuasarFwdModel::icgf");
 
   //incomplete gamma function with a=k, based on the incomplete gamma integral
 
-  return MISCMATHS::gamma(a)*igamc(a,x);
+  return MISCMATHS::gamma(a)*Igamc(a,x);
 }
 
 float QuasarFwdModel::gvf(float t, float s, float p) const {
-  Tracer_Plus tr("QuasarFwdModel::gvf");
 
   //The Gamma Variate Function (correctly normalised for area under curve) 
   // Form of Rausch 2000
@@ -9,6 +9,8 @@
 #include "fwdmodel.h"
 #include "inference.h"
 #include <string>
+
+class IncompleteGammaTable;
 using namespace std;
 
 class QuasarFwdModel : public FwdModel {
@@ -29,7 +31,7 @@ public:
     //return 2 - (singleti?1:0) + (infertau?1:0) + (inferart?2:0) + (infert1?2:0) + (inferinveff?1:0) + (infertrailing?1:0) + (infertaub?1:0); 
   } 
 
-  virtual ~QuasarFwdModel() { return; }
+  virtual ~QuasarFwdModel();
 
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const;
 
@@ -103,6 +105,19 @@ protected: // Constants
 
   string disptype;
 
+  // evaluation plan, fixed at construction
+  enum DispModel { DISP_NONE, DISP_GAMMA, DISP_GVF, DISP_GAUSS };
+  DispModel dispmodel;
+  int nphases;
+  vector<int> phasecrush; // crusher used for each output phase (0 = none)
+  float llrelax; // -log(cos(FA))/dti: the Look-Locker readout term if the flip angle is not calibrated
+
+  // TIs for the current slice (only recalculated when coord_z changes)
+  mutable ColumnVector thetis;
+  mutable int thetisz;
+
+  bool CheckFinite(ColumnVector& kc, const string& name, const ColumnVector& params) const;
+
   // ard flags
   bool doard;
   bool tissard;
@@ -129,4 +144,13 @@ protected: // Constants
   float icgf(float a, float x) const;
   float gvf(float t, float s, float p) const;
 
+  // igamc for the gamma/gvf dispersion curves: MISCMATHS::igamc, or with
+  // --fast-igamma a table lookup (only to --fast-igamma-tol, default 1e-6)
+  double Igamc(double a, double x) const;
+  IncompleteGammaTable* igammaTable;
+
+  // Not copyable (owns igammaTable)
+  QuasarFwdModel(const QuasarFwdModel&);
+  const QuasarFwdModel& operator=(const QuasarFwdModel&);
+
 };
@@ -69,6 +69,7 @@
 #include "fwdmodel_asl_satrecov.h"
 
 #include <iostream>
+#include <algorithm>
 #include <newmatio.h>
 #include <stdexcept>
 #include "newimage/newimageall.h"
@@ -161,40 +162,128 @@ void SatrecovFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result
      // note that we do not have sin(FA) here - we actually estiamte the M0 at the flip angle used for the readout!
    }
 
-    // loop over tis
-    //float ti;
-   if (LFAon) result.ReSize(tis.Nrows()*(nphases+1)*repeats);
-   else result.ReSize(tis.Nrows()*nphases*repeats);
-
-   int nti=tis.Nrows();
-   double ti;
-
-    for (int ph=1; ph<=nphases; ph++) {
-      for (int it=1; it<=tis.Nrows(); it++) {
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    ti = tis(it) + slicedt*coord_z; //account here for an increase in delay between slices
-	    result( (ph-1)*(nti*repeats) + (it-1)*repeats+rpt ) = M0tp*(1-A*exp(-ti/T1tp));
-	  }
-      }
+   const int nti = tis.Nrows();
+   const int block = nti*repeats; // one phase
+   if (LFAon) result.ReSize(block*(nphases+1));
+   else result.ReSize(block*nphases);
+
+   // The recovery curve only depends on the TI, so work it out once for the
+   // first phase and copy it to the repeats and the other phases
+   const double tioff = slicedt*coord_z; //account here for an increase in delay between slices
+   Real* out = result.Store();
+   for (int it=1; it<=nti; it++) {
+     const double ti = tis(it) + tioff;
+     const Real val = M0tp*(1-A*exp(-ti/T1tp));
+     for (int rpt=0; rpt<repeats; rpt++) *out++ = val;
+   }
+   for (int ph=2; ph<=nphases; ph++) {
+     std::copy(result.Store(), result.Store() + block, out);
+     out += block;
+   }
+
+   if (LFAon) {
+     T1tp = 1/( 1/T1t - log(cos(lFA))/dti );
+     M0tp = M0t*(1 - exp(-dti/T1t) )/(1 - cos(lFA)*exp(-dti/T1t));
+     const double scale = M0tp*sin(lFA)/sin(FA);
+     //note the sin(LFA)/sin(FA) term since the M0 we estimate is actually MOt*sin(FA)
+     for (int it=1; it<=nti; it++) {
+       const Real val = scale*(1-A*exp(-tis(it)/T1tp));
+       for (int rpt=0; rpt<repeats; rpt++) *out++ = val;
+     }
+   }
+
+  return;
+}
+
+int SatrecovFwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+  Tracer_Plus tr("SatrecovFwdModel::Gradient");
+
+  // Same parameterisation as Evaluate; a parameter that has been clamped 
+  // to zero there has no effect, so gets a zero column
+  ColumnVector paramcpy = params;
+  for (int i=1;i<=NumParams();i++) {
+    if (params(i)<0) { paramcpy(i) = 0; }
+  }
+
+  const double M0t = paramcpy(1);
+  const double T1t = paramcpy(2);
+  const double A = paramcpy(3);
+  const double g = LFAon ? paramcpy(4) : 1.0;
+  const double E = exp(-dti/T1t);
+  const double dEdT1 = E*dti/(T1t*T1t);
+
+  // Effective M0 and T1 for a readout flip angle fa (= (g+dg)*nominal),
+  // with their derivatives wrt M0t, T1t and g
+  double M0tp, dM0dM0, dM0dT1, dM0dg, T1tp, dT1dT1, dT1dg;
+  const int nti = tis.Nrows();
+  const int nparams = NumParams();
+  const int block = nti*repeats;
+  grad.ReSize(block*(nphases + (LFAon?1:0)), nparams);
+  grad = 0;
+  Real* out = grad.Store();
+
+  // The normal phases are all the same, so do the first one and copy it, 
+  // then the low flip angle phase if there is one
+  for (int pass=0; pass<=(LFAon?1:0); pass++) {
+    const bool low = (pass==1);
+    const double nominal = low ? LFA : FAnom;
+    const double fa = (g+dg)*nominal;
+    double scale = 1, dscaledg = 0;
+
+    if (looklocker || low) {
+      const double c = cos(fa);
+      const double dcdg = -sin(fa)*nominal;
+      const double den = 1 - c*E;
+      M0tp = M0t*(1-E)/den;
+      dM0dM0 = (1-E)/den;
+      dM0dT1 = M0t*(c-1)/(den*den) * dEdT1;
+      dM0dg = M0t*(1-E)*E/(den*den) * dcdg;
+      T1tp = 1/( 1/T1t - log(c)/dti );
+      dT1dT1 = T1tp*T1tp/(T1t*T1t);
+      dT1dg = T1tp*T1tp * dcdg/(c*dti);
+    }
+    else {
+      M0tp = M0t; dM0dM0 = 1; dM0dT1 = 0; dM0dg = 0;
+      T1tp = T1t; dT1dT1 = 1; dT1dg = 0;
+    }
+    if (low) {
+      const double FA = (g+dg)*FAnom;
+      scale = sin(fa)/sin(FA);
+      dscaledg = (cos(fa)*LFA*sin(FA) - sin(fa)*cos(FA)*FAnom)/(sin(FA)*sin(FA));
     }
-    if (LFAon) {
-      int ph=nphases+1;
-      T1tp = 1/( 1/T1t - log(cos(lFA))/dti );
-      M0tp = M0t*(1 - exp(-dti/T1t) )/(1 - cos(lFA)*exp(-dti/T1t));
-      for (int it=1; it<=tis.Nrows(); it++) {
-	for (int rpt=1; rpt<=repeats; rpt++)
-	  {
-	    ti = tis(it) + slicedt*coord_z; //account here for an increase in delay between slices
-	    result( (ph-1)*(nti*repeats) + (it-1)*repeats+rpt ) = M0tp*sin(lFA)/sin(FA)*(1-A*exp(-tis(it)/T1tp));
-	    //note the sin(LFA)/sin(FA) term since the M0 we estimate is actually MOt*sin(FA)
-	  }
+
+    // The low flip angle phase ignores the slice timing (as in Evaluate)
+    const double tioff = low ? 0 : slicedt*coord_z;
+    for (int it=1; it<=nti; it++) {
+      const double ti = tis(it) + tioff;
+      const double e = exp(-ti/T1tp);
+      const double dfdM0 = scale*(1-A*e);
+      const double dfdT1 = -scale*M0tp*A*e*ti/(T1tp*T1tp);
+
+      double row[4];
+      row[0] = dfdM0*dM0dM0;
+      row[1] = dfdM0*dM0dT1 + dfdT1*dT1dT1;
+      row[2] = -scale*M0tp*e;
+      row[3] = dscaledg*M0tp*(1-A*e) + dfdM0*dM0dg + dfdT1*dT1dg;
+      for (int i=0; i<nparams; i++)
+	if (params(i+1)<0) row[i] = 0;
+
+      for (int rpt=0; rpt<repeats; rpt++) {
+	std::copy(row, row + nparams, out);
+	out += nparams;
       }
     }
 
-    
+    if (!low) {
+      for (int ph=2; ph<=nphases; ph++) {
+	std::copy(grad.Store(), grad.Store() + block*nparams, out);
+	out += block*nparams;
+      }
+    }
+  }
 
-  return;
+  return true;
 }
 
 
@@ -212,7 +301,7 @@ SatrecovFwdModel::SatrecovFwdModel(ArgsType& args)
 
       // with a look locker readout
       FAnom = convertTo<double>(args.ReadWithDefault("FA","0"));
-      if (FAnom>0) looklocker=true;
+      looklocker = (FAnom>0);
       cout << "Looklocker" << looklocker << endl;
       FAnom = FAnom * M_PI/180;
       LFA = convertTo<double>(args.ReadWithDefault("LFA","0"));
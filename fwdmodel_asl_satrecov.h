@@ -76,6 +76,7 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
   static void ModelUsage();
   virtual string ModelVersion() const;
                   
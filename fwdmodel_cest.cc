@@ -76,6 +76,145 @@
 using namespace NEWIMAGE;
 #include "easylog.h"
 
+// Fixed-size Bloch-McConnell kernels.  For the usual pool counts the model
+// matrices are small (6x6 to 15x15), and NEWMAT's general routines spend
+// most of their time allocating.  These work on N*N row-major arrays on the
+// stack with loops of known length, which the compiler unrolls and
+// vectorises.  Both return false if the matrix is singular, in which case
+// the caller falls back to NEWMAT (which will throw as usual).
+template<int N> struct BlochKernel {
+
+  // c = a*b
+  static void Mult(const double* a, const double* b, double* c)
+  {
+    for (int i=0; i<N*N; i++) c[i] = 0.0;
+    for (int i=0; i<N; i++)
+      for (int k=0; k<N; k++) {
+	const double aik = a[i*N+k];
+	for (int j=0; j<N; j++) c[i*N+j] += aik*b[k*N+j];
+      }
+  }
+
+  static double Norm1(const double* a)
+  {
+    double norm = 0.0;
+    for (int j=0; j<N; j++) {
+      double sum = 0.0;
+      for (int i=0; i<N; i++) sum += fabs(a[i*N+j]);
+      if (sum > norm) norm = sum;
+    }
+    return norm;
+  }
+
+  // Solve a*x = b in place (b becomes x, a is destroyed), partial pivoting
+  static bool Solve(double* a, double* b)
+  {
+    for (int c=0; c<N; c++) {
+      int piv = c;
+      for (int i=c+1; i<N; i++)
+	if (fabs(a[i*N+c]) > fabs(a[piv*N+c])) piv = i;
+      if (a[piv*N+c] == 0.0) return false;
+      if (piv != c)
+	for (int j=0; j<N; j++) {
+	  std::swap(a[c*N+j], a[piv*N+j]);
+	  std::swap(b[c*N+j], b[piv*N+j]);
+	}
+      const double rpiv = 1.0/a[c*N+c];
+      for (int i=c+1; i<N; i++) {
+	const double f = a[i*N+c]*rpiv;
+	if (f == 0.0) continue;
+	for (int j=c; j<N; j++) a[i*N+j] -= f*a[c*N+j];
+	for (int j=0; j<N; j++) b[i*N+j] -= f*b[c*N+j];
+      }
+    }
+    for (int c=N-1; c>=0; c--) {
+      const double rpiv = 1.0/a[c*N+c];
+      for (int j=0; j<N; j++) b[c*N+j] *= rpiv;
+      for (int i=0; i<c; i++) {
+	const double f = a[i*N+c];
+	for (int j=0; j<N; j++) b[i*N+j] -= f*b[c*N+j];
+      }
+    }
+    return true;
+  }
+
+  static bool Inverse(const double* in, double* out)
+  {
+    double a[N*N];
+    for (int i=0; i<N*N; i++) { a[i] = in[i]; out[i] = 0.0; }
+    for (int i=0; i<N; i++) out[i*N+i] = 1.0;
+    return Solve(a, out);
+  }
+
+  // Same approximants as CESTFwdModel::PadeApproximant; coefficients b0..bm
+  static bool Pade(const double* A, int m, double* X)
+  {
+    static const double c3[] = {120, 60, 12, 1};
+    static const double c5[] = {30240, 15120, 3360, 420, 30, 1};
+    static const double c7[] = {17297280, 8648640, 1995840, 277200, 25200, 1512, 56, 1};
+    static const double c9[] = {1.7643225600e10, 8.821612800e9, 2.075673600e9, 3.02702400e8, 30270240, 2162160, 110880, 3960, 90, 1};
+    static const double c13[] = {6.4764752532480000e16, 3.2382376266240000e16, 7.771770303897600e15, 1.187353796428800e15, 1.29060195264000e14, 1.0559470521600e13, 6.70442572800e11, 3.3522128640e10, 1323241920, 40840800, 960960, 16380, 182, 1};
+    const double* b = (m==3) ? c3 : (m==5) ? c5 : (m==7) ? c7 : (m==9) ? c9 : c13;
+
+    double A2[N*N], A4[N*N], A6[N*N], Ueven[N*N], U[N*N], V[N*N];
+    Mult(A, A, A2);
+    if (m >= 5) Mult(A2, A2, A4);
+    if (m >= 7) Mult(A2, A4, A6);
+
+    if (m == 13) {
+      double T[N*N];
+      for (int i=0; i<N*N; i++) T[i] = b[13]*A6[i] + b[11]*A4[i] + b[9]*A2[i];
+      Mult(A6, T, Ueven);
+      for (int i=0; i<N*N; i++) T[i] = b[12]*A6[i] + b[10]*A4[i] + b[8]*A2[i];
+      Mult(A6, T, V);
+      for (int i=0; i<N*N; i++) {
+	Ueven[i] += b[7]*A6[i] + b[5]*A4[i] + b[3]*A2[i];
+	V[i] += b[6]*A6[i] + b[4]*A4[i] + b[2]*A2[i];
+      }
+    } else {
+      // sum the even powers from the highest down, Horner-style in A2
+      double A8[N*N];
+      if (m == 9) Mult(A4, A4, A8);
+      const double* P[5] = {NULL, A2, A4, A6, A8};
+      for (int i=0; i<N*N; i++) { Ueven[i] = 0.0; V[i] = 0.0; }
+      for (int j=1; j<=(m-1)/2; j++)
+	for (int i=0; i<N*N; i++) {
+	  Ueven[i] += b[2*j+1]*P[j][i];
+	  V[i] += b[2*j]*P[j][i];
+	}
+    }
+    for (int i=0; i<N; i++) { Ueven[i*N+i] += b[1]; V[i*N+i] += b[0]; }
+    Mult(A, Ueven, U);
+
+    // X = (V-U)^-1 (V+U); they commute, so same as (U+V)*(-U+V).i()
+    double D[N*N];
+    for (int i=0; i<N*N; i++) { D[i] = V[i] - U[i]; X[i] = V[i] + U[i]; }
+    return Solve(D, X);
+  }
+
+  // As CESTFwdModel::expm_pade
+  static bool Expm(const double* in, double* out)
+  {
+    static const float thetam[5] = {1.495585217958292e-002, 2.539398330063230e-001, 9.504178996162932e-001, 2.097847961257068e+000, 5.371920351148152e+000};
+    static const int mvals[4] = {3, 5, 7, 9};
+    const double norm = Norm1(in);
+    for (int i=0; i<4; i++)
+      if (norm <= thetam[i]) return Pade(in, mvals[i], out);
+
+    int s = (int)ceil(log2(norm/thetam[4]));
+    if (s < 0) s = 0;
+    double A[N*N];
+    const double scale = ldexp(1.0, -s);
+    for (int i=0; i<N*N; i++) A[i] = in[i]*scale;
+    if (!Pade(A, 13, out)) return false;
+    for (int k=0; k<s; k++) {
+      Mult(out, out, A);
+      for (int i=0; i<N*N; i++) out[i] = A[i];
+    }
+    return true;
+  }
+};
+
 string CESTFwdModel::ModelVersion() const
 {
   return "$Id: fwdmodel_cest.cc,v 1.7 2014/02/06 17:00:14 mwebster Exp $";
@@ -555,6 +694,17 @@ CESTFwdModel::CESTFwdModel(ArgsType& args)
       // check that the method chosen is possible
       if ((npool>1) & lorentz) throw invalid_argument("Lorentzian (analytic) solution only compatible with single pool");
 
+      // pick the fixed-size matrix routines for this number of pools
+      kernelSize = 3*npool;
+      switch (npool)
+	{
+	case 2: kernelExpm = BlochKernel<6>::Expm;  kernelInverse = BlochKernel<6>::Inverse;  break;
+	case 3: kernelExpm = BlochKernel<9>::Expm;  kernelInverse = BlochKernel<9>::Inverse;  break;
+	case 4: kernelExpm = BlochKernel<12>::Expm; kernelInverse = BlochKernel<12>::Inverse; break;
+	case 5: kernelExpm = BlochKernel<15>::Expm; kernelInverse = BlochKernel<15>::Inverse; break;
+	default: kernelExpm = NULL; kernelInverse = NULL; break;
+	}
+
       /* OLD
     //initialization
     npool = 3;
@@ -810,9 +960,55 @@ void CESTFwdModel::UpdateARD(
 ReturnMatrix CESTFwdModel::expm(Matrix inmatrix) const
 {
   // to set the routine we use to do expm
+  if (kernelExpm != NULL && inmatrix.Nrows() == kernelSize && inmatrix.Ncols() == kernelSize)
+    {
+      Matrix X(kernelSize, kernelSize);
+      if (kernelExpm(inmatrix.Store(), X.Store()))
+	return X;
+    }
   return expm_pade(inmatrix);
 }
 
+ReturnMatrix CESTFwdModel::Inverse(const Matrix& A) const
+{
+  if (kernelInverse != NULL && A.Nrows() == kernelSize && A.Ncols() == kernelSize)
+    {
+      Matrix Ai(kernelSize, kernelSize);
+      if (kernelInverse(A.Store(), Ai.Store()))
+	return Ai;
+    }
+  Matrix Ai = A.i();
+  return Ai;
+}
+
+// The Bloch-McConnell matrices only depend on the exchange, relaxation and
+// frequency parameters - not on M0 - so in a lot of consecutive Evaluate 
+// calls (e.g. the Jacobian) they are exactly the same as last time.  Keep the
+// last inverse and exponential calculated for each (sample, segment) slot.
+const Matrix& CESTFwdModel::CachedInverse(const Matrix& A, int slot) const
+{
+  if ((int)cachedA.size() <= slot) {
+    cachedA.resize(slot+1); cachedAinv.resize(slot+1);
+  }
+  if (!(cachedA[slot].Nrows()==A.Nrows() && cachedA[slot]==A)) {
+    cachedA[slot] = A;
+    cachedAinv[slot] = Inverse(A);
+  }
+  return cachedAinv[slot];
+}
+
+const Matrix& CESTFwdModel::CachedExpm(const Matrix& At, int slot) const
+{
+  if ((int)cachedAt.size() <= slot) {
+    cachedAt.resize(slot+1); cachedExpmAt.resize(slot+1);
+  }
+  if (!(cachedAt[slot].Nrows()==At.Nrows() && cachedAt[slot]==At)) {
+    cachedAt[slot] = At;
+    cachedExpmAt[slot] = expm(At);
+  }
+  return cachedExpmAt[slot];
+}
+
 ReturnMatrix CESTFwdModel::expm_eig(Matrix inmatrix) const
 {
   // Do matrix exponential using eigen decomposition of the matrix
@@ -871,6 +1067,7 @@ ReturnMatrix CESTFwdModel::expm_pade(Matrix inmatrix) const
 	// Using Pade Approximant degree 13 and scaling and squaring
 	//cout << "Doing m = 13" << endl;
 	int s = ceil(log2(A.Norm1()/thetam[4]));
+	if (s<0) s=0; // norm between thetam[3] and thetam[4]: no scaling needed
 	//cout << s << endl;
 	float half=0.5;
 	A *= MISCMATHS::pow(half,s);
@@ -1045,6 +1242,17 @@ void CESTFwdModel::Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const
        //Mz(k) = M0(1);
      }
      else {
+     // Repeated samples (same offset, B1 and saturation time) give the same answer
+     int repeatOf = 0;
+     for (int k2=1; k2<k && repeatOf==0; k2++) {
+       if (wvec(k2)==wvec(k) && w1(k2)==w1(k) && t(k2)==t(k) 
+	   && wi.Column(k2)==wi.Column(k)) repeatOf = k2;
+     }
+     if (repeatOf>0) {
+       M.Column(k) = M.Column(repeatOf);
+       continue;
+     }
+
      //Calculate new A matrix for this sample
      for (int i=1; i<=mpool; i++) {
      st = (i-1)*3;
@@ -1067,7 +1275,7 @@ void CESTFwdModel::Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const
 
      if (steadystate) {
        Matrix Ai; 
-       Ai = A.i();
+       Ai = Inverse(A);
        //Mz(k) = -(Ai.Row(3)*B).AsScalar(); //Only want the z-component of the water pool
        M.Column(k) = -Ai*B;
      }
@@ -1078,22 +1286,8 @@ void CESTFwdModel::Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const
        // first: go once through the full pulse and calcualte all the required matrices
        vector<Matrix> AiBseg;
        vector<Matrix> expmAseg;
+       vector<float> tsegs;
        for (int s=1; s<=nseg; s++) {
-	 //assemble the appropriate A matrix
-	 Matrix Atemp(A);
-	 for (int i=1; i<=mpool; i++) {
-	   st = (i-1)*3;
-	   Atemp(st+2,st+3) = -w1(k)*pmagvec(s);
-	   Atemp(st+3,st+2) = w1(k)*pmagvec(s);
-	 }
-
-	 // Make the AinvB term
-	 Matrix AiBtemp;
-	 AiBtemp = Atemp.i()*B;
-	 AiBseg.push_back(AiBtemp);
-
-	 // make matrix exponential term
-	 Matrix expmAtemp;
 	 float tseg;
 	 // sort out the duration of the pulse
 	 if (ptvec(s)>1e6) {
@@ -1108,9 +1302,36 @@ void CESTFwdModel::Mz_spectrum(ColumnVector& Mz, const ColumnVector& wvec, const
 	   // t now contains the number of times this pulse is repeated
 	   npulse=t(k);
 	 }
+	 tsegs.push_back(tseg);
+
+	 // pulse shapes often repeat the same segment (e.g. the gaps), in 
+	 // which case the matrices are the same too
+	 int same = 0;
+	 for (int s2=1; s2<s && same==0; s2++) {
+	   if (pmagvec(s2)==pmagvec(s) && tsegs[s2-1]==tseg) same = s2;
+	 }
+	 if (same>0) {
+	   AiBseg.push_back(AiBseg[same-1]);
+	   expmAseg.push_back(expmAseg[same-1]);
+	   continue;
+	 }
+
+	 //assemble the appropriate A matrix
+	 Matrix Atemp(A);
+	 for (int i=1; i<=mpool; i++) {
+	   st = (i-1)*3;
+	   Atemp(st+2,st+3) = -w1(k)*pmagvec(s);
+	   Atemp(st+3,st+2) = w1(k)*pmagvec(s);
+	 }
 
-	 expmAtemp = expm(Atemp*tseg);
-	 expmAseg.push_back(expmAtemp);
+	 // Make the AinvB term
+	 const int slot = (k-1)*nseg + s-1;
+	 Matrix AiBtemp;
+	 AiBtemp = CachedInverse(Atemp, slot)*B;
+	 AiBseg.push_back(AiBtemp);
+
+	 // make matrix exponential term
+	 expmAseg.push_back(CachedExpm(Atemp*tseg, slot));
        }
 
        // now we step through all the pulses
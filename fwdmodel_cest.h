@@ -114,6 +114,9 @@ protected:
   ReturnMatrix expm_pade(Matrix inmatrix) const;
   ReturnMatrix PadeApproximant(Matrix inmatrix, int m) const;
   ReturnMatrix PadeCoeffs(int m) const;
+  ReturnMatrix Inverse(const Matrix& A) const;
+  const Matrix& CachedInverse(const Matrix& A, int slot) const;
+  const Matrix& CachedExpm(const Matrix& At, int slot) const;
 
 // Constants
 
@@ -155,6 +158,18 @@ protected:
 
   // processing flags
   mutable bool fastgrad; //use a fast approximation to the expm because we are caculating the gradient
+
+  // fixed-size expm/inverse for 3*npool square matrices (NULL if npool
+  // has no specialised version); see BlochKernel in fwdmodel_cest.cc
+  int kernelSize;
+  bool (*kernelExpm)(const double* in, double* out);
+  bool (*kernelInverse)(const double* in, double* out);
+
+  // results of the last CachedInverse/CachedExpm for each (sample, segment)
+  mutable vector<Matrix> cachedA;
+  mutable vector<Matrix> cachedAinv;
+  mutable vector<Matrix> cachedAt;
+  mutable vector<Matrix> cachedExpmAt;
   
   // ard flags
   bool doard;
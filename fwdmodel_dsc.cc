@@ -232,13 +232,13 @@ void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) con
  
 
    // deal with delay parameter - this shifts the aif
-   ColumnVector aifnew(aif);
-   aifnew = aifshift(aif,delta,hdelt);
+   UpdateConvolution(delta);
 
-   ColumnVector C_art(aif);
-   if (inferart) {
+   if (inferart && !(haveart && artdelta==artdelay)) {
      //local arterial contribution is the aif, but with a local time shift
-     C_art = artmag*aifshift(aif,artdelay,hdelt);
+     aifart = aifshift(aif,artdelay,hdelt);
+     artdelta = artdelay;
+     haveart = true;
    }
 
    /*
@@ -288,7 +288,7 @@ void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) con
    //gmu = alpha*beta;
    //float gvar = alpha*beta*beta;
 
-   residue = 1 - gammacdf(htsamp.t()-htsamp(1),gmu,gvar).t();
+   residue = 1 - gammacdf(htimes,gmu,gvar).t();
 
    //tracer retention
    residue = (1-tracerret)*residue + tracerret;
@@ -301,9 +301,6 @@ void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) con
      }*/
 
    // Do the convolution
-   // form the convolution matrix (there is probably a better way!)
-   
-   //aifnew = aif;
    
    //cout << "--------------------" << endl;
    //cout << "cbf: " << cbf << " gmu: " << gmu << " log(lambda): " << lambda << " delta: " << delta << " sig0: " << sig0 << endl;
@@ -311,65 +308,23 @@ void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) con
    //cout << "residue: " << residue.t() << endl;
    //cout << "aifnew: " << aifnew.t() << endl;
 
-   LowerTriangularMatrix A(nhtpts); A=0.0;
-
-   if (convmtx=="simple")
-     {
-       // Simple convolution matrix
-       for (int i=1; i<=nhtpts; i++) {
-	 for (int j=1; j <= i; j++) {
-	   A(i,j) = aifnew(i-j+1); //note we are using the local aifnew here! (i.e. it has been suitably time shifted)
-	 }
-       }
-     }
-   //cout << "new run" << endl;
-   //cout << A << endl;
-
-   else if (convmtx=="voltera")
-     {
-       ColumnVector aifextend(nhtpts+2);
-       ColumnVector zero(1);
-       zero=0;
-       aifextend = zero & aifnew & zero;
-       int x, y, z;
-       //voltera convolution matrix (as defined by Sourbron 2007) - assume zeros outside aif range
-       for (int i=1; i<=nhtpts; i++) {
-	 for (int j=1; j <= i; j++) {
-	   //cout << i << "  " << j << endl;
-	   x = i+1;y=j+1; z = i-j+1;
-	   if (j==1) { A(i,j) =(2*aifextend(x) + aifextend(x-1))/6; }
-	   else if (j==i) { A(i,j) = (2*aifextend(2) + aifextend(3))/6; }
-	   else { 
-	     A(i,j) =  (4*aifextend(z) + aifextend(z-1) + aifextend(z+1))/6; 
-	     //cout << x << "  " << y << "  " << z << "  " << ( 4*aifextend(z) + aifextend(z-1) + aifextend(z+1) )/6 << "  " << 1/6*(4*aifextend(z) + aifextend(z-1) + aifextend(z+1)) << endl;
-	     // cout << aifextend(z) << "  " << aifextend(z-1) << "  " << aifextend(z+1) << endl;
-	   }
-	   //cout << i << "  " << j << "  " << aifextend(z) << "  " << A(i,j) << endl<<endl;
-	 }
-       }
-     }
-
-   //cout << A << endl;
-
-   // do the multiplication
-   ColumnVector C; 
-   C = cbf*hdelt*A*residue;
-   //convert to the DSC signal
-
-   //cout  << "C: " << C.t() << endl;
-
-   //cout << "sig0: " << sig0 << " r2: " << r2 << " te: " << te << endl;
-   
-   //cout<< htsamp.t() << endl;
-
+   // do the multiplication, C = cbf*hdelt*A*residue, where A is the
+   // convolution matrix - but only for the time points we need
+   const Real* r = residue.Store();
+   const Real* first = convfirst.Store();
+   const Real* mid = convmid.Store();
    ColumnVector C_low(ntpts);
    for (int i=1; i<=ntpts; i++) {
-     C_low(i) = C((i-1)*upsample+1);
+     int hi = (i-1)*upsample+1;
+     double sum = first[hi-1]*r[0];
+     for (int j=2; j<hi; j++) sum += mid[hi-j]*r[j-1];
+     if (hi>1) sum += convlast*r[hi-1];
+     C_low(i) = cbf*hdelt*sum;
      //C_low(i) = interp1(htsamp,C,tsamp(i));
      if (inferart) { //add in arterial contribution
-       C_low(i) += C_art((i-1)*upsample+1);
+       C_low(i) += artmag*aifart(hi);
      }
-     } 
+   } 
 
    result.ReSize(ntpts);
    for (int i=1; i<=ntpts; i++) {
@@ -403,6 +358,7 @@ void DSCFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) con
 }
 
 DSCFwdModel::DSCFwdModel(ArgsType& args)
+  : haveconv(false), haveart(false)
 {
   Tracer_Plus tr("DSCFwdModel::DSCFwdModel");
     string scanParams = args.ReadWithDefault("scan-params","cmdline");
@@ -424,6 +380,9 @@ DSCFwdModel::DSCFwdModel(ArgsType& args)
       inferret = args.ReadBool("inferret");
 
       convmtx = args.ReadWithDefault("convmtx","simple");
+      if (convmtx=="simple") voltera = false;
+      else if (convmtx=="voltera") voltera = true;
+      else throw Invalid_option("Unrecognised convolution matrix (--convmtx): " + convmtx);
       
       // Read in the arterial signal
       ColumnVector artsig;
@@ -461,6 +420,7 @@ DSCFwdModel::DSCFwdModel(ArgsType& args)
       }
       htsamp(nhtpts)=tsamp(ntpts);
       aif(nhtpts) = aif_low(ntpts);
+      htimes = htsamp.t() - htsamp(1);
 
       doard=false;
       if (inferart) doard=true;     
@@ -511,6 +471,41 @@ void DSCFwdModel::NameParams(vector<string>& names) const
 
 
 
+void DSCFwdModel::UpdateConvolution(float delta) const
+{
+  if (haveconv && convdelta==delta) return;
+
+  ColumnVector aifnew;
+  aifnew = aifshift(aif,delta,hdelt); //note we are using the local aifnew here! (i.e. it has been suitably time shifted)
+
+  convfirst.ReSize(nhtpts);
+  convmid.ReSize(nhtpts); // mid(1) isn't used
+  if (voltera)
+    {
+      //voltera convolution matrix (as defined by Sourbron 2007) - assume zeros outside aif range
+      ColumnVector aifextend(nhtpts+2);
+      ColumnVector zero(1);
+      zero=0;
+      aifextend = zero & aifnew & zero;
+      for (int i=1; i<=nhtpts; i++) {
+	convfirst(i) = (2*aifextend(i+1) + aifextend(i))/6; // j==1
+	if (i>1) convmid(i) = (4*aifextend(i) + aifextend(i-1) + aifextend(i+1))/6; // z = i-j+1
+      }
+      convlast = (2*aifextend(2) + aifextend(3))/6; // j==i
+    }
+  else
+    {
+      // Simple convolution matrix: A(i,j) = aifnew(i-j+1)
+      convfirst = aifnew;
+      convmid = aifnew;
+      convlast = aifnew(1);
+    }
+  convmid(1) = 0;
+
+  convdelta = delta;
+  haveconv = true;
+}
+
 ColumnVector DSCFwdModel::aifshift( const ColumnVector& aif, const float delta, const float hdelt ) const
 {
   // Shift a vector in time by interpolation (linear)
@@ -99,6 +99,21 @@ public:
 protected: 
 
   ColumnVector aifshift( const ColumnVector& aif, const float delta, const float hdelt ) const;
+
+  // Convolution weights for the aif shifted by delta.  Row i of the 
+  // convolution matrix is first(i), mid(i-1)..mid(2), last (see Evaluate),
+  // so the matrix itself is never formed.  Kept from the last call, since
+  // delta is often unchanged (e.g. while the Jacobian is being calculated).
+  void UpdateConvolution(float delta) const;
+  mutable bool haveconv;
+  mutable float convdelta;
+  mutable ColumnVector convfirst;
+  mutable ColumnVector convmid;
+  mutable double convlast;
+  // likewise for the arterial component
+  mutable bool haveart;
+  mutable float artdelta;
+  mutable ColumnVector aifart;
   
 // Constants
 
@@ -134,6 +149,7 @@ protected:
   int nhtpts;
   float hdelt;
   ColumnVector htsamp;
+  RowVector htimes; // htsamp - htsamp(1), for the residue function
 
   bool infermtt;
   bool inferlambda;
@@ -145,5 +161,6 @@ protected:
   bool imageprior;
 
   string convmtx;
+  bool voltera; // else simple
 
 };
@@ -143,6 +143,16 @@ void FlobsFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) c
   return; // answer is in the "result" vector
 }
 
+void FlobsFwdModel::LinearParams(vector<bool>& linear) const
+{
+  // The shape/scale parameters multiply each other, but the nuisance
+  // regressors just add on
+  linear.assign(NumParams(), false);
+  if (!usePolarCoordinates)
+    for (int i = basis.Ncols()+1; i <= NumParams(); i++)
+      linear[i-1] = true;
+}
+
 void FlobsFwdModel::ModelUsage()
 {
   //  if (useSeparateScale)
@@ -85,6 +85,7 @@ public:
                                 const string& indents = "") const;
                                 
   virtual void NameParams(vector<string>& names) const;     
+  virtual void LinearParams(vector<bool>& linear) const;
   virtual int NumParams() const
   { assert(basis.Ncols()>0); 
     return basis.Ncols() + nuisanceBasis.Ncols(); }
@@ -100,6 +100,7 @@ LinearFwdModel::LinearFwdModel(ArgsType& args)
   LOG_ERR("      Loaded " << jacobian.Ncols() 
 	  << " basis functions of length " << Ntimes << endl);
 
+  jacobianId = NewJacobianId();
   centre.ReSize(Nbasis); 
   centre = 0;
   offset.ReSize(Ntimes);
@@ -133,6 +134,14 @@ void LinearFwdModel::Evaluate(const ColumnVector& params,
   result = jacobian * (params - centre) + offset;
 }
 
+unsigned long LinearFwdModel::NewJacobianId()
+{
+  // Atomic, so that models in fabber_library runs on different threads
+  // never get the same id
+  static unsigned long lastId = 0;
+  return __sync_add_and_fetch(&lastId, 1);
+}
+
 void LinearizedFwdModel::ReCentre(const ColumnVector& about)
 {
   Tracer_Plus tr("LinearizedFwdModel::ReCentre");
@@ -148,9 +157,20 @@ void LinearizedFwdModel::ReCentre(const ColumnVector& about)
       throw overflow_error("ReCentre: Non-finite values found in offset");
     }
 
+  // Columns for parameters that the model is linear in never change, so 
+  // only calculate those the first time round.  If that's all of them 
+  // there is nothing more to do (and the JacobianId stays the same).
+  const bool haveFixed = jacobian.Nrows() == offset.Nrows()
+    && jacobian.Ncols() == centre.Nrows()
+    && (int)fixedColumns.size() == centre.Nrows();
+  if (haveFixed && fcn->IsLinear())
+    return;
+
   // Calculate the Jacobian numerically.  jacobian is len(y)-by-len(m)
-  jacobian.ReSize(offset.Nrows(), centre.Nrows());
+  if (!haveFixed)
+    jacobian.ReSize(offset.Nrows(), centre.Nrows());
   // jacobian = 0.0/0.0; // fill with NaNs to check
+  jacobianId = NewJacobianId();
   
   // try and get the gradient from the model first
   int gradfrommodel=false;
@@ -161,6 +181,8 @@ void LinearizedFwdModel::ReCentre(const ColumnVector& about)
   ColumnVector offset2, offset3;
   for (int i = 1; i <= centre.Nrows(); i++)
     {
+      if (haveFixed && fixedColumns[i-1]) continue;
+
       double delta = centre(i) * 1e-5;
       if (delta<0) delta = -delta;
       if (delta<1e-10) delta = 1e-10;
@@ -79,15 +79,20 @@ class LinearFwdModel : public FwdModel {
   virtual void DumpParameters(const ColumnVector& vec,
                               const string& indent = "") const;                            
   virtual void NameParams(vector<string>& names) const;
+  virtual void LinearParams(vector<bool>& linear) const
+    { linear.assign(NumParams(), true); }
 
   ReturnMatrix Jacobian() const { return jacobian; }
   ReturnMatrix Centre() const { return centre; }
   ReturnMatrix Offset() const { return offset; }
+  unsigned long JacobianId() const { return jacobianId; }
+  // Changes whenever the Jacobian does, so anything derived from it 
+  // (e.g. J'*J in the noise models) can be cached against this
 
   LinearFwdModel(const Matrix& jac, 
 		 const ColumnVector& ctr, 
 		 const ColumnVector& off) 
-    : jacobian(jac), centre(ctr), offset(off) 
+    : jacobian(jac), centre(ctr), offset(off), jacobianId(NewJacobianId()) 
     { assert(jac.Nrows() == ctr.Ncols()); assert(jac.Ncols() == off.Ncols()); }
     
   // Upgrading to a full externally-accessible model type
@@ -97,12 +102,14 @@ class LinearFwdModel : public FwdModel {
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const;
 
  protected:
-  LinearFwdModel() { return; } // Leave uninitialized; derived classes only
+  LinearFwdModel() : jacobianId(0) { return; } // Leave uninitialized; derived classes only
 
   Matrix jacobian;     // J (tranposed?)
   ColumnVector centre; // m
   ColumnVector offset; // g(m)
     // The amount to effectively subtract from Y is g(m)-J*m
+  unsigned long jacobianId;
+  static unsigned long NewJacobianId();
 };
 
 class LinearizedFwdModel : public LinearFwdModel {
@@ -112,21 +119,26 @@ public:
                               const string& indent = "") const;
   virtual void NameParams(vector<string>& names) const
     { assert(fcn); fcn->NameParams(names); }
+  virtual void LinearParams(vector<bool>& linear) const
+    { assert(fcn); fcn->LinearParams(linear); }
   using FwdModel::ModelVersion; // Tell the compiler we want both ours and the base version
   string ModelVersion() { assert(fcn != NULL); return fcn->ModelVersion(); }
 
   // Constructor (leaves centre, offset and jacobian empty)
-  LinearizedFwdModel(const FwdModel* model) : fcn(model) { return; }
+  LinearizedFwdModel(const FwdModel* model) : fcn(model) 
+    { fcn->LinearParams(fixedColumns); }
   
   // Copy constructor (needed for using vector<LinearizedFwdModel>)
   // NOTE: This is a reference, not a pointer... and it *copies* the
   // given LinearizedFwdModel, rather than using it as its nonlinear model!
   LinearizedFwdModel(const LinearizedFwdModel& from) 
-    : LinearFwdModel(from), fcn(from.fcn) { return; }
+    : LinearFwdModel(from), fcn(from.fcn), fixedColumns(from.fixedColumns) 
+    { return; }
 
   void ReCentre(const ColumnVector& about);
   // centre=about; offset=fcn(about); 
   // jacobian = numerical differentiation about centre
+  // (columns for parameters the model is linear in are kept from last time)
 
   virtual void HardcodedInitialDists(MVNDist& prior, MVNDist& posterior) const
     { assert(fcn); fcn->HardcodedInitialDists(prior, posterior); }
@@ -134,5 +146,6 @@ public:
   
 private:
   const FwdModel* fcn;  
+  vector<bool> fixedColumns; // from fcn->LinearParams()
 };
 
@@ -151,6 +151,24 @@ void pcASLFwdModel::HardcodedInitialDists(MVNDist& prior,
 //    assert(id.R0(posterior.means) == 25);
 }    
 
+void pcASLFwdModel::TimingTerms(double T1b, double invEff, double dt,
+    double& K0, double& K1, double dK0[3], double dK1[3]) const
+{
+    // pretag*dt + bolus*Tau + posttag*(TI-Tau-dt), with posttag = 1 and
+    // bolus = 1 - (1-rho)*invEff*T1b*exp(-TI/T1b)*exp(-dt/T1b)*(exp(-Tau/T1b)-1)
+    const double eTI = exp(-TI/T1b);
+    const double ed = exp(-dt/T1b);
+    const double eTau = exp(-Tau/T1b);
+    const double P = T1b*eTI*ed*(eTau-1);
+    K0 = dt + Tau + (TI-Tau-dt);
+    K1 = -Tau*invEff*P;
+
+    dK0[0] = dK0[1] = dK0[2] = 0;
+    dK1[0] = -Tau*invEff*eTI*ed*( (eTau-1)*(1 + (TI+dt)/T1b) + eTau*Tau/T1b );
+    dK1[1] = -Tau*P;
+    dK1[2] = -K1/T1b;
+}
+
 void pcASLFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
     Tracer_Plus tr("pcASLFwdModel::Evaluate");
@@ -162,42 +180,111 @@ void pcASLFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) c
     // Absolute M and Q change (same units as M0 or Q0):
     ColumnVector StatMag = params(M0index()) - Mbasis * MnOf(params);
     ColumnVector CBF = params(Q0index()) + Qbasis * QnOf(params);
-    // Fractional change in BOLD effect (at TE_2), rather than using % R2* change 
-    ColumnVector R2s = -1/echoTime(2) * log( 
-        Rbasis * RnOf(params) + exp(-echoTime(2)*R0));
+    // Fractional change in BOLD effect (at TE_2), rather than using % R2* change.
+    // R2s = -1/TE_2 * log(u), so the decay at each TE is u^(TE/TE_2)
+    ColumnVector u = Rbasis * RnOf(params) + exp(-echoTime(2)*R0);
 
     // The following are relative magnetizations    
-    double pretag = 1; // untagged
     double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
     double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
     double dt = (stdevDt>0? params(dtIndex()) : fixedDt);
-    ColumnVector bolus = 1 - (1-rho)*invEfficiency*T1b*exp(-TI/T1b)*exp(-dt/T1b)*( exp(-Tau/T1b)-1 ); // tag or control
-    double posttag = 1;
-    ColumnVector Sb = SP( CBF,  // SP(a,b) means a.*b 
-        pretag*dt + bolus*Tau + posttag*(TI-Tau-dt) );
-    ColumnVector S = StatMag + Sb;
+    double K0, K1, dK0[3], dK1[3];
+    TimingTerms(T1b, invEfficiency, dt, K0, K1, dK0, dK1);
       
-  int Ntimes = R2s.Nrows();
+  int Ntimes = u.Nrows();
   int Nte = echoTime.Nrows();
   if (result.Nrows() != Nte*Ntimes)
     result.ReSize(Nte*Ntimes);
-    
-//  result = 0.0/0.0; // pre-fill with nans to check all overwritten
-  
+
+  Matrix nuisance(Ntimes, Nte);
   for (int te = 1; te <= Nte; te++)
+    nuisance.Column(te) = Nbasis * NnOf(te, params);
+  // Will be all-zero if there are no nuisance regressors
+    
+  // All the TEs for a time point together
+  // Fill order: te1 te2 te1 te2 te1 te2 te1 te2 ...
+  Real* out = result.Store();
+  for (int i = 1; i <= Ntimes; i++)
     {
-      ColumnVector nuisance = Nbasis * NnOf(te, params);
-      // Will be all-zero if there are no nuisance regressors
-        
-      for (int i = 1; i <= Ntimes; i++)
-        result( Nte*(i-1) + te ) = 
-            S(i) * exp(-echoTime(te) * R2s(i)) + nuisance(i);
-      // Fill order: te1 te2 te1 te2 te1 te2 te1 te2 ...
+      const double S = StatMag(i) + CBF(i) * (K0 + tagged(i)*K1);
+      const double logu = log(u(i));
+      for (int te = 1; te <= Nte; te++)
+        *out++ = S * exp(teRatio(te) * logu) + nuisance(i,te);
     }
 
   return; // answer is in the "result" vector
 }
 
+int pcASLFwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+    Tracer_Plus tr("pcASLFwdModel::Gradient");
+
+    // As Evaluate; R0 has no effect while it is clamped
+    const bool R0clamped = params(R0index()) < 1;
+    const double R0 = R0clamped ? 1 : params(R0index());
+    ColumnVector StatMag = params(M0index()) - Mbasis * MnOf(params);
+    ColumnVector CBF = params(Q0index()) + Qbasis * QnOf(params);
+    const double eR0 = exp(-echoTime(2)*R0);
+    ColumnVector u = Rbasis * RnOf(params) + eR0;
+
+    double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
+    double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
+    double dt = (stdevDt>0? params(dtIndex()) : fixedDt);
+    double K0, K1, dK0[3], dK1[3];
+    TimingTerms(T1b, invEfficiency, dt, K0, K1, dK0, dK1);
+
+  const int Ntimes = u.Nrows();
+  const int Nte = echoTime.Nrows();
+  const int Nparams = NumParams();
+  grad.ReSize(Nte*Ntimes, Nparams);
+  grad = 0;
+
+  Real* g = grad.Store(); // one row per output, in the same order
+  for (int i = 1; i <= Ntimes; i++)
+    {
+      const double K = K0 + tagged(i)*K1;
+      const double S = StatMag(i) + CBF(i) * K;
+      const double logu = log(u(i));
+      for (int te = 1; te <= Nte; te++, g += Nparams)
+        {
+          const double E = exp(teRatio(te) * logu);
+          const double dEdu = teRatio(te) * E / u(i);
+
+          g[Q0index()-1] = K * E;
+          for (int k = 1; k <= Qbasis.Ncols(); k++)
+            g[Q0index()+k-1] = Qbasis(i,k) * K * E;
+          g[M0index()-1] = E;
+          for (int k = 1; k <= Mbasis.Ncols(); k++)
+            g[M0index()+k-1] = -Mbasis(i,k) * E;
+          g[R0index()-1] = R0clamped ? 0 : -S * dEdu * echoTime(2) * eR0;
+          for (int k = 1; k <= Rbasis.Ncols(); k++)
+            g[R0index()+k-1] = S * dEdu * Rbasis(i,k);
+          for (int k = 1; k <= Nbasis.Ncols(); k++)
+            g[NnStart(te)+k-2] += Nbasis(i,k);
+
+          if (stdevT1b>0)
+            g[T1bIndex()-1] += CBF(i) * (dK0[0] + tagged(i)*dK1[0]) * E;
+          if (stdevInvEff>0)
+            g[InvEffIndex()-1] += CBF(i) * (dK0[1] + tagged(i)*dK1[1]) * E;
+          if (stdevDt>0)
+            g[dtIndex()-1] += CBF(i) * (dK0[2] + tagged(i)*dK1[2]) * E;
+        }
+    }
+
+  return true;
+}
+
+void pcASLFwdModel::LinearParams(vector<bool>& linear) const
+{
+  // Only the nuisance regressors just add on
+  linear.assign(NumParams(), false);
+  for (int i = NnStart(1); i < NnStart(echoTime.Nrows()+1) && i <= NumParams(); i++)
+    linear[i-1] = true;
+  if (stdevInvEff>0) linear[InvEffIndex()-1] = false;
+  if (stdevT1b>0) linear[T1bIndex()-1] = false;
+  if (stdevDt>0) linear[dtIndex()-1] = false;
+}
+
 void pcASLFwdModel::ModelUsage()
 {
     cout << "\nUsage info for --model=pcasl-dualecho:\n"
@@ -347,6 +434,9 @@ pcASLFwdModel::pcASLFwdModel(ArgsType& args)
     for (int i = 1; i <= rho.Nrows(); i++)
 	LOG << (rho(i)>0 ? "C" : "T");
     LOG << endl;
+
+    tagged = 1 - rho;
+    teRatio = echoTime / echoTime(2);
 }
 
 void pcASLFwdModel::DumpParameters(const ColumnVector& vec,
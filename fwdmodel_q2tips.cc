@@ -84,52 +84,21 @@ string Q2tipsFwdModel::ModelVersion() const
 }
 
 
-void Q2tipsFwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
+void Q2tipsFwdModel::TimingTerms(double T1b, double invEff, double dt,
+    double& K0, double& K1, double dK0[3], double dK1[3]) const
 {
-    Tracer_Plus tr("Q2tipsFwdModel::Evaluate");
-    // Adapted from original_fwdmodel.m
-    
-    // Parameterization used in most recent results:
-    // Absolute M and Q change (same units as M0 or Q0):
-    ColumnVector StatMag = params(M0index()) - Mbasis * MnOf(params);
-    ColumnVector CBF = params(Q0index()) + Qbasis * QnOf(params);
-    // Fractional change in BOLD effect (at TE_2), rather than using % R2* change 
-    ColumnVector R2s = -1/echoTime(2) * log( 
-        Rbasis * RnOf(params) + exp(-echoTime(2)*params(R0index())));
-
-    // The following are relative magnetizations    
-    double pretag = 1; // untagged
-    double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
-    double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
-    ColumnVector bolus = 1 - (1-rho)*invEfficiency*exp(-TI2/T1b); // tag or control
-    //    double posttag = 1 - exp(-(TI2-TI1)/T1b); // saturated
-    double dt = (stdevDt>0? params(dtIndex()) : fixedDt);
-    //    ColumnVector Sb = SP( CBF,  // SP(a,b) means a.*b 
-    //        pretag*dt + bolus*TI1 + posttag*(TI2-TI1-dt) );
-    double posttagQ2 = ((TI2-TI1-dt) 
-			+ T1b*exp(-(TI2-TI1)/T1b)
-			- T1b*exp(-dt/T1b));
-    ColumnVector Sb = SP( CBF,  // SP(a,b) means a.*b 
-        pretag*dt + bolus*TI1 + posttagQ2 );
-    ColumnVector S = StatMag + Sb;
-      
-  int Ntimes = R2s.Nrows();
-  int Nte = echoTime.Nrows();
-  if (result.Nrows() != Nte*Ntimes)
-    result.ReSize(Nte*Ntimes);
-    
-//  result = 0.0/0.0; // pre-fill with nans to check all overwritten
-  
-  for (int te = 1; te <= Nte; te++)
-    {
-      ColumnVector nuisance = Nbasis * NnOf(te, params);
-      // Will be all-zero if there are no nuisance regressors
-        
-      for (int i = 1; i <= Ntimes; i++)
-        result( Nte*(i-1) + te ) = 
-            S(i) * exp(-echoTime(te) * R2s(i)) + nuisance(i);
-      // Fill order: te1 te2 te1 te2 te1 te2 te1 te2 ...
-    }
+    // As QUIPSS II, but with posttag*(TI2-TI1-dt) replaced by
+    // (TI2-TI1-dt) + T1b*exp(-(TI2-TI1)/T1b) - T1b*exp(-dt/T1b)
+    const double e2 = exp(-TI2/T1b);
+    const double e21 = exp(-(TI2-TI1)/T1b);
+    const double ed = exp(-dt/T1b);
+    K0 = dt + TI1 + (TI2-TI1-dt) + T1b*e21 - T1b*ed;
+    K1 = -invEff*e2*TI1;
 
-  return; // answer is in the "result" vector
+    dK0[0] = e21*(1 + (TI2-TI1)/T1b) - ed*(1 + dt/T1b);
+    dK0[1] = 0;
+    dK0[2] = ed;
+    dK1[0] = K1*TI2/(T1b*T1b);
+    dK1[1] = -e2*TI1;
+    dK1[2] = 0;
 }
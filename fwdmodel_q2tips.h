@@ -69,15 +69,12 @@
 #include "fwdmodel_quipss2.h"
 
 // The Q2TIPS model is almost identical to QUIPSS II model.
-// Only the Evaluate() function needs to change (and only slightly)
+// Only the bolus timing term needs to change (and only slightly)
 
 class Q2tipsFwdModel : public Quipss2FwdModel {
 
 public: 
   // Virtual function overrides
-  virtual void Evaluate(const ColumnVector& params, 
-			      ColumnVector& result) const;
-
   virtual string ModelVersion() const;
 
   virtual ~Q2tipsFwdModel() { return; }
@@ -85,4 +82,8 @@ public:
   // Constructor
   Q2tipsFwdModel(ArgsType& args) : Quipss2FwdModel(args) { }
 
+protected:
+  virtual void TimingTerms(double T1b, double invEff, double dt,
+    double& K0, double& K1, double dK0[3], double dK1[3]) const;
+
 };
@@ -135,6 +135,25 @@ void Quipss2FwdModel::HardcodedInitialDists(MVNDist& prior,
 //    assert(id.R0(posterior.means) == 25);
 }    
 
+void Quipss2FwdModel::TimingTerms(double T1b, double invEff, double dt,
+    double& K0, double& K1, double dK0[3], double dK1[3]) const
+{
+    // pretag*dt + bolus*TI1 + posttag*(TI2-TI1-dt), with
+    // bolus = 1 - (1-rho)*invEff*exp(-TI2/T1b) (tag or control)
+    // posttag = 1 - exp(-(TI2-TI1)/T1b) (saturated)
+    const double e2 = exp(-TI2/T1b);
+    const double e21 = exp(-(TI2-TI1)/T1b);
+    K0 = dt + TI1 + (1-e21)*(TI2-TI1-dt);
+    K1 = -invEff*e2*TI1;
+
+    dK0[0] = -e21*(TI2-TI1)/(T1b*T1b)*(TI2-TI1-dt);
+    dK0[1] = 0;
+    dK0[2] = e21;
+    dK1[0] = K1*TI2/(T1b*T1b);
+    dK1[1] = -e2*TI1;
+    dK1[2] = 0;
+}
+
 void Quipss2FwdModel::Evaluate(const ColumnVector& params, ColumnVector& result) const
 {
     Tracer_Plus tr("Quipss2FwdModel::Evaluate");
@@ -144,42 +163,109 @@ void Quipss2FwdModel::Evaluate(const ColumnVector& params, ColumnVector& result)
     // Absolute M and Q change (same units as M0 or Q0):
     ColumnVector StatMag = params(M0index()) - Mbasis * MnOf(params);
     ColumnVector CBF = params(Q0index()) + Qbasis * QnOf(params);
-    // Fractional change in BOLD effect (at TE_2), rather than using % R2* change 
-    ColumnVector R2s = -1/echoTime(2) * log( 
-        Rbasis * RnOf(params) + exp(-echoTime(2)*params(R0index())));
+    // Fractional change in BOLD effect (at TE_2), rather than using % R2* change.
+    // R2s = -1/TE_2 * log(u), so the decay at each TE is u^(TE/TE_2)
+    ColumnVector u = Rbasis * RnOf(params) + exp(-echoTime(2)*params(R0index()));
 
     // The following are relative magnetizations    
-    double pretag = 1; // untagged
     double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
     double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
-    ColumnVector bolus = 1 - (1-rho)*invEfficiency*exp(-TI2/T1b); // tag or control
-    double posttag = 1 - exp(-(TI2-TI1)/T1b); // saturated
     double dt = (stdevDt>0? params(dtIndex()) : fixedDt);
-    ColumnVector Sb = SP( CBF,  // SP(a,b) means a.*b 
-        pretag*dt + bolus*TI1 + posttag*(TI2-TI1-dt) );
-    ColumnVector S = StatMag + Sb;
+    double K0, K1, dK0[3], dK1[3];
+    TimingTerms(T1b, invEfficiency, dt, K0, K1, dK0, dK1);
       
-  int Ntimes = R2s.Nrows();
+  int Ntimes = u.Nrows();
   int Nte = echoTime.Nrows();
   if (result.Nrows() != Nte*Ntimes)
     result.ReSize(Nte*Ntimes);
-    
-//  result = 0.0/0.0; // pre-fill with nans to check all overwritten
-  
+
+  Matrix nuisance(Ntimes, Nte);
   for (int te = 1; te <= Nte; te++)
+    nuisance.Column(te) = Nbasis * NnOf(te, params);
+  // Will be all-zero if there are no nuisance regressors
+    
+  // All the TEs for a time point together
+  // Fill order: te1 te2 te1 te2 te1 te2 te1 te2 ...
+  Real* out = result.Store();
+  for (int i = 1; i <= Ntimes; i++)
     {
-      ColumnVector nuisance = Nbasis * NnOf(te, params);
-      // Will be all-zero if there are no nuisance regressors
-        
-      for (int i = 1; i <= Ntimes; i++)
-        result( Nte*(i-1) + te ) = 
-            S(i) * exp(-echoTime(te) * R2s(i)) + nuisance(i);
-      // Fill order: te1 te2 te1 te2 te1 te2 te1 te2 ...
+      const double S = StatMag(i) + CBF(i) * (K0 + tagged(i)*K1);
+      const double logu = log(u(i));
+      for (int te = 1; te <= Nte; te++)
+        *out++ = S * exp(teRatio(te) * logu) + nuisance(i,te);
     }
 
   return; // answer is in the "result" vector
 }
 
+int Quipss2FwdModel::Gradient(const ColumnVector& params, Matrix& grad) const
+{
+    Tracer_Plus tr("Quipss2FwdModel::Gradient");
+
+    // As Evaluate
+    ColumnVector StatMag = params(M0index()) - Mbasis * MnOf(params);
+    ColumnVector CBF = params(Q0index()) + Qbasis * QnOf(params);
+    const double eR0 = exp(-echoTime(2)*params(R0index()));
+    ColumnVector u = Rbasis * RnOf(params) + eR0;
+
+    double T1b = (stdevT1b>0 ? params(T1bIndex()) : fixedT1b);
+    double invEfficiency = (stdevInvEff>0 ? params(InvEffIndex()) : fixedInvEff);
+    double dt = (stdevDt>0? params(dtIndex()) : fixedDt);
+    double K0, K1, dK0[3], dK1[3];
+    TimingTerms(T1b, invEfficiency, dt, K0, K1, dK0, dK1);
+
+  const int Ntimes = u.Nrows();
+  const int Nte = echoTime.Nrows();
+  const int Nparams = NumParams();
+  grad.ReSize(Nte*Ntimes, Nparams);
+  grad = 0;
+
+  Real* g = grad.Store(); // one row per output, in the same order
+  for (int i = 1; i <= Ntimes; i++)
+    {
+      const double K = K0 + tagged(i)*K1;
+      const double S = StatMag(i) + CBF(i) * K;
+      const double logu = log(u(i));
+      for (int te = 1; te <= Nte; te++, g += Nparams)
+        {
+          const double E = exp(teRatio(te) * logu);
+          const double dEdu = teRatio(te) * E / u(i);
+
+          g[Q0index()-1] = K * E;
+          for (int k = 1; k <= Qbasis.Ncols(); k++)
+            g[Q0index()+k-1] = Qbasis(i,k) * K * E;
+          g[M0index()-1] = E;
+          for (int k = 1; k <= Mbasis.Ncols(); k++)
+            g[M0index()+k-1] = -Mbasis(i,k) * E;
+          g[R0index()-1] = -S * dEdu * echoTime(2) * eR0;
+          for (int k = 1; k <= Rbasis.Ncols(); k++)
+            g[R0index()+k-1] = S * dEdu * Rbasis(i,k);
+          for (int k = 1; k <= Nbasis.Ncols(); k++)
+            g[NnStart(te)+k-2] += Nbasis(i,k);
+
+          if (stdevT1b>0)
+            g[T1bIndex()-1] += CBF(i) * (dK0[0] + tagged(i)*dK1[0]) * E;
+          if (stdevInvEff>0)
+            g[InvEffIndex()-1] += CBF(i) * (dK0[1] + tagged(i)*dK1[1]) * E;
+          if (stdevDt>0)
+            g[dtIndex()-1] += CBF(i) * (dK0[2] + tagged(i)*dK1[2]) * E;
+        }
+    }
+
+  return true;
+}
+
+void Quipss2FwdModel::LinearParams(vector<bool>& linear) const
+{
+  // Only the nuisance regressors just add on
+  linear.assign(NumParams(), false);
+  for (int i = NnStart(1); i < NnStart(echoTime.Nrows()+1) && i <= NumParams(); i++)
+    linear[i-1] = true;
+  if (stdevInvEff>0) linear[InvEffIndex()-1] = false;
+  if (stdevT1b>0) linear[T1bIndex()-1] = false;
+  if (stdevDt>0) linear[dtIndex()-1] = false;
+}
+
 void Quipss2FwdModel::ModelUsage()
 {
     cout << "\nUsage info for --model=quipss2:\n"
@@ -329,6 +415,9 @@ Quipss2FwdModel::Quipss2FwdModel(ArgsType& args)
     for (int i = 1; i <= rho.Nrows(); i++)
 	LOG << (rho(i)>0 ? "C" : "T");
     LOG << endl;
+
+    tagged = 1 - rho;
+    teRatio = echoTime / echoTime(2);
 }
 
 void Quipss2FwdModel::DumpParameters(const ColumnVector& vec,
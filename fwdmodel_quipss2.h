@@ -88,11 +88,13 @@ public:
   // Virtual function overrides
   virtual void Evaluate(const ColumnVector& params, 
 			      ColumnVector& result) const;
+  virtual int Gradient(const ColumnVector& params, Matrix& grad) const;
                   
   virtual void DumpParameters(const ColumnVector& vec,
                                 const string& indents = "") const;
                                 
   virtual void NameParams(vector<string>& names) const;     
+  virtual void LinearParams(vector<bool>& linear) const;
   virtual int NumParams() const
     { return NnStart(echoTime.Ncols()+1) + (stdevT1b>0?1:0) 
         + (stdevInvEff>0?1:0) + (stdevDt>0?1:0) - 1; }
@@ -141,8 +143,15 @@ protected: // Constants
   ReturnMatrix NnOf(int te, const ColumnVector& params) const
     { return params.Rows(NnStart(te),NnStart(te+1)-1).Evaluate(); }
 
+  // The CBF signal is CBF .* (K0 + (1-rho)*K1).  Returns K0 and K1 and their
+  // derivatives wrt T1b, inv-eff and dt (in that order).
+  virtual void TimingTerms(double T1b, double invEff, double dt,
+    double& K0, double& K1, double dK0[3], double dK1[3]) const;
+
   // scan parameters
   ColumnVector rho;
+  ColumnVector tagged; // 1-rho
+  ColumnVector teRatio; // TE/TE_2
   ColumnVector echoTime;
   double TI1, TI2;
   
@@ -67,28 +67,218 @@
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include "inference.h"
+#include "fwdmodel_linear.h"
+#include "tools.h"
+#include "voxeltable.h"
 #include "newimage/newimageall.h"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <zlib.h>
  
 using namespace NEWIMAGE;
 using namespace std;
 using namespace MISCMATHS;
 
+#ifndef __FABBER_LIBRARYONLY
+// Writes one result image (a row of values per volume, a column per voxel):
+// as a NIFTI covering the mask's whole FOV, or with --sparse-output as a 
+// VoxelTable (.fvt) of just the voxels in the mask.
+static void SaveResultImage(const Matrix& values, const volume<float>& mask,
+			    int intent, const string& filename, bool sparse)
+{
+  if (sparse)
+    {
+      VoxelTable::Save(filename + ".fvt", mask, values, intent);
+      return;
+    }
+  volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),values.Nrows());
+  output.setmatrix(values,mask);
+  output.set_intent(intent,0,0,0);
+  output.setDisplayMaximumMinimum(output.max(),output.min());
+  save_volume4D(output,filename);
+}
+
+// Saves the per-parameter images for SaveResults (mean_, std_, zstat_...),
+// one file per task, so that the compression and writing can be shared 
+// out between --processes.  Each Add()ed image type is a matrix with a 
+// row per parameter; task t is type t/nParams, parameter t%nParams+1.
+class ParamImageWriter : public ParallelTasks
+{
+public:
+    ParamImageWriter(int maxProcesses, const volume<float>& mask, 
+		     const string& outputDir, const vector<string>& paramNames,
+		     bool sparse)
+      : ParallelTasks(maxProcesses), mask(mask), outputDir(outputDir),
+	paramNames(paramNames), sparse(sparse)
+    { return; }
+
+    void Add(const string& prefix, const Matrix& values, int intent)
+    { 
+      prefixes.push_back(prefix); 
+      images.push_back(&values); 
+      intents.push_back(intent); 
+    }
+    int NumTasks() const { return images.size() * paramNames.size(); }
+    string Filename(int task) const
+    { return outputDir + "/" + prefixes.at(task/paramNames.size()) 
+	+ paramNames.at(task%paramNames.size()); }
+
+    virtual void RunTask(int task, vector<double>& results) const
+    {
+      const int type = task/paramNames.size();
+      const int i = task%paramNames.size() + 1;
+
+      SaveResultImage(images.at(type)->Row(i), mask, intents.at(type), 
+		      Filename(task), sparse);
+    }
+
+private:
+    const volume<float>& mask;
+    const string& outputDir;
+    const vector<string>& paramNames;
+    const bool sparse;
+    vector<string> prefixes;
+    vector<const Matrix*> images;
+    vector<int> intents;
+};
+
+// --compression=fast|parallel: the images are written uncompressed and then
+// gzipped here.  Each file is cut into blocks, each compressed as a 
+// separate gzip member by one task (which gunzip and zlib read as one 
+// stream), and the members are joined up by Finish().  With blockBytes = 0
+// each file is a single block.
+class ImageCompressor : public ParallelTasks
+{
+public:
+    ImageCompressor(int maxProcesses, const vector<string>& files, 
+		    int level, long blockBytes);
+    int NumTasks() const { return tasks.size(); }
+    virtual void RunTask(int task, vector<double>& results) const;
+    void Finish() const;
+
+private:
+    struct Block { int file; int part; long offset; long bytes; };
+    const vector<string>& files; // without the .nii
+    int level;
+    vector<Block> tasks;
+    vector<int> nParts;
+    string PartName(int file, int part) const
+    { return files.at(file) + ".nii.gz.part" + stringify(part); }
+};
+
+ImageCompressor::ImageCompressor(int maxProcesses, const vector<string>& files, 
+				 int level, long blockBytes)
+  : ParallelTasks(maxProcesses), files(files), level(level), nParts(files.size(), 0)
+{
+  for (unsigned f = 0; f < files.size(); f++)
+    {
+      struct stat st;
+      if (stat((files[f] + ".nii").c_str(), &st) != 0)
+	throw Runtime_error(("Couldn't find " + files[f] + ".nii to compress").c_str());
+      const long size = st.st_size;
+      const long step = (blockBytes > 0 && blockBytes < size) ? blockBytes : max(size, 1L);
+      for (long offset = 0; offset < size || offset == 0; offset += step)
+	{
+	  Block b = { int(f), nParts[f]++, offset, min(step, size - offset) };
+	  tasks.push_back(b);
+	}
+    }
+}
+
+void ImageCompressor::RunTask(int task, vector<double>& results) const
+{
+  const Block& b = tasks.at(task);
+  vector<char> in(b.bytes);
+  FILE* fin = fopen((files.at(b.file) + ".nii").c_str(), "rb");
+  bool ok = (fin != NULL && fseek(fin, b.offset, SEEK_SET) == 0
+	     && (b.bytes == 0 || fread(&in[0], 1, b.bytes, fin) == (size_t)b.bytes));
+  if (fin != NULL) fclose(fin);
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  vector<char> out(deflateBound(&z, b.bytes) + 64); // plus the gzip wrapper
+  ok = ok && deflateInit2(&z, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  if (ok)
+    {
+      z.next_in = reinterpret_cast<Bytef*>(b.bytes ? &in[0] : NULL);
+      z.avail_in = b.bytes;
+      z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+      z.avail_out = out.size();
+      ok = (deflate(&z, Z_FINISH) == Z_STREAM_END);
+      deflateEnd(&z);
+    }
+
+  FILE* fout = ok ? fopen(PartName(b.file, b.part).c_str(), "wb") : NULL;
+  ok = (fout != NULL && fwrite(&out[0], 1, z.total_out, fout) == z.total_out);
+  if (fout != NULL && fclose(fout) != 0) 
+    ok = false;
+  if (!ok)
+    throw Runtime_error(("Couldn't compress " + files.at(b.file) + ".nii").c_str());
+}
+
+void ImageCompressor::Finish() const
+{
+  for (unsigned f = 0; f < files.size(); f++)
+    {
+      const string gzName = files[f] + ".nii.gz";
+      bool ok = true;
+      if (nParts[f] == 1)
+	ok = (rename(PartName(f, 0).c_str(), gzName.c_str()) == 0);
+      else
+	{
+	  FILE* out = fopen(gzName.c_str(), "wb");
+	  ok = (out != NULL);
+	  vector<char> buf(1<<20);
+	  for (int p = 0; p < nParts[f] && ok; p++)
+	    {
+	      FILE* in = fopen(PartName(f, p).c_str(), "rb");
+	      ok = (in != NULL);
+	      size_t n;
+	      while (ok && (n = fread(&buf[0], 1, buf.size(), in)) > 0)
+		ok = (fwrite(&buf[0], 1, n, out) == n);
+	      if (in != NULL) fclose(in);
+	      remove(PartName(f, p).c_str());
+	    }
+	  if (out != NULL && fclose(out) != 0) 
+	    ok = false;
+	}
+      if (!ok)
+	throw Runtime_error(("Couldn't write " + gzName).c_str());
+      remove((files[f] + ".nii").c_str());
+    }
+}
+
+// Overrides newimage's output file type for as long as it's in scope, 
+// and puts the old one back afterwards even if a save throws
+class OutputTypeOverride
+{
+public:
+    OutputTypeOverride(bool active, int type) 
+      : oldType(FslGetOverrideOutputType()) 
+    { if (active) FslSetOverrideOutputType(type); }
+    ~OutputTypeOverride() { FslSetOverrideOutputType(oldType); }
+
+private:
+    const int oldType;
+
+    OutputTypeOverride(const OutputTypeOverride&);
+    const OutputTypeOverride& operator=(const OutputTypeOverride&);
+};
+#endif //__FABBER_LIBRARYONLY
+
 void InferenceTechnique::Setup(ArgsType& args)
 {
   Tracer_Plus tr("InferenceTechnique::Setup");
 
   // Pick models
-  model = FwdModel::NewFromName(args.Read("model"), args);
-  assert( model->NumParams() > 0 );
-  LOG_ERR("    Forward Model version:\n      " 
-	  << model->ModelVersion() << endl);
+  SetupModel(args);
 
   noise = NoiseModel::NewFromName(args.Read("noise"), args);
 //  noise->LoadPrior(args.ReadWithDefault("noise-prior","hardcoded"));
 //  noise->Dump("  ");
 
-  saveModelFit = args.ReadBool("save-model-fit");
-  saveResiduals = args.ReadBool("save-residuals");
+  SetupOutputs(args);
 
   // Motion correction related setup
   Nmcstep = convertTo<int>(args.ReadWithDefault("mcsteps","0")); //by default no motion correction
@@ -96,14 +286,122 @@ void InferenceTechnique::Setup(ArgsType& args)
 
 
 
+void InferenceTechnique::SetupModel(ArgsType& args)
+{
+  model = modelCache ? modelCache->Get(args) 
+    : FwdModel::NewFromName(args.Read("model"), args);
+  assert( model->NumParams() > 0 );
+  LOG_ERR("    Forward Model version:\n      " 
+	  << model->ModelVersion() << endl);
+}
+
+void InferenceTechnique::SetupOutputs(ArgsType& args)
+{
+  Tracer_Plus tr("InferenceTechnique::SetupOutputs");
+
+  nProcesses = convertTo<int>(args.ReadWithDefault("processes","1"));
+  if (nProcesses < 1)
+    throw Invalid_option("--processes must be at least 1");
+
+  // Which result files to write.  The default is what's always been 
+  // written; --save-model-fit and --save-residuals still add to it.
+  saveModelFit = args.ReadBool("save-model-fit");
+  saveResiduals = args.ReadBool("save-residuals");
+  saveMeans = saveStds = saveZstats = saveMVN = saveFreeEnergy = false;
+  const string saveList = args.ReadWithDefault("save","mean,zstat,mvn,F");
+  string::size_type start = 0;
+  while (start <= saveList.size())
+    {
+      string::size_type end = saveList.find(',', start);
+      if (end == string::npos) end = saveList.size();
+      const string item = saveList.substr(start, end - start);
+      start = end + 1;
+
+      if (item == "mean") saveMeans = true;
+      else if (item == "std") saveStds = true;
+      else if (item == "zstat") saveZstats = true;
+      else if (item == "mvn") saveMVN = true;
+      else if (item == "F") saveFreeEnergy = true;
+      else if (item == "fit") saveModelFit = true;
+      else if (item == "residuals") saveResiduals = true;
+      else if (item != "") 
+	throw Invalid_option("Unknown --save output: '" + item 
+	  + "' (choose from mean, std, zstat, mvn, F, fit and residuals)");
+    }
+
+  // Sparse output: tables of the masked voxels rather than NIFTI images,
+  // and the (already masked) packed MVN format unless told otherwise
+  sparseOutput = args.ReadBool("sparse-output");
+  mvnFormat = args.ReadWithDefault("mvn-format", sparseOutput ? "packed" : "nifti");
+  if (mvnFormat != "nifti" && mvnFormat != "packed" && mvnFormat != "packed-double")
+    throw Invalid_option("--mvn-format must be nifti, packed or packed-double");
+
+  compression = args.ReadWithDefault("compression","gzip");
+  if (compression != "gzip" && compression != "none" 
+      && compression != "fast" && compression != "parallel")
+    throw Invalid_option("--compression must be gzip, none, fast or parallel");
+
+  checkpointEvery = convertTo<int>(args.ReadWithDefault("checkpoint-every","0"));
+  if (checkpointEvery < 0)
+    throw Invalid_option("--checkpoint-every must not be negative");
+}
+
+// Recorded in the checkpoint so that --resume won't restore voxels that
+// a different model or noise model fitted
+string InferenceTechnique::CheckpointLayout() const
+{
+  vector<string> names;
+  model->NameParams(names);
+  string layout = "params=";
+  for (unsigned i = 0; i < names.size(); i++)
+    layout += (i > 0 ? "," : "") + names[i];
+
+  int nNoise = 0;
+  if (noise != NULL)
+    {
+      NoiseParams* params = noise->NewParams();
+      nNoise = params->OutputAsMVN().means.Nrows();
+      delete params;
+    }
+  return layout + " noise=" + stringify(nNoise);
+}
+
+void InferenceTechnique::KeepModelFit(int voxel, const LinearFwdModel& linear,
+				      const ColumnVector& fwdMeans)
+{
+  if (!saveModelFit && !saveResiduals)
+    return;
+
+  // Only any use if it was linearized about the final means (it won't have 
+  // been if this voxel failed, for example)
+  const ColumnVector centre = linear.Centre();
+  const bool valid = (centre.Nrows() == fwdMeans.Nrows() && centre == fwdMeans);
+  resultModelFitValid.at(voxel-1) = valid;
+  if (!valid)
+    return;
+
+  const ColumnVector offset = linear.Offset();
+  if (resultModelFit.Nrows() != offset.Nrows() 
+      || resultModelFit.Ncols() != (int)resultModelFitValid.size())
+    resultModelFit.ReSize(offset.Nrows(), resultModelFitValid.size());
+  resultModelFit.Column(voxel) = offset;
+}
+
 void InferenceTechnique::SaveResults(const DataSet& data) const
 {
   Tracer_Plus tr("InferenceTechnique::SaveResults");
     LOG << "    Preparing to save results..." << endl;
 
+    if (data.GetMatrixIO() != NULL)
+      {
+	// fabber_library: results go to the caller, not into files
+	SaveResultMatrices(data, *data.GetMatrixIO());
+	LOG << "    Done writing results." << endl;
+	return;
+      }
   
 #ifdef __FABBER_LIBRARYONLY
-    throw Logic_error("SaveResults shouldn't be called in fabber_library mode");
+    throw Logic_error("SaveResults needs the data to have come from a MatrixIO in fabber_library mode");
 #else // __FABBER_LIBRARYONLY
 
     // Save the resultMVNs as two NIFTI files
@@ -114,13 +412,25 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
     const volume<float>& mask  = data.GetMask();
     int nVoxels = resultMVNs.size();
 
-    cout << "Saving!\n";
-    MVNDist::Save(resultMVNs, outputDir + "/finalMVN", mask);
+    // Unless it's --compression=gzip (newimage's default), write plain .nii
+    // files; all but "none" get compressed by us at the end
+    OutputTypeOverride outputType(compression != "gzip", FSL_TYPE_NIFTI);
+    vector<string> written;
 
-    if (resultMVNsWithoutPrior.size() > 0)
+    cout << "Saving!\n";
+    if (saveMVN)
       {
-	assert(resultMVNsWithoutPrior.size() == (unsigned)nVoxels);
-	MVNDist::Save(resultMVNsWithoutPrior, outputDir + "/finalMVNwithoutPrior", mask);
+	SaveMVNs(resultMVNs, outputDir + "/finalMVN", data);
+	if (mvnFormat == "nifti")
+	  written.push_back(outputDir + "/finalMVN");
+
+	if (resultMVNsWithoutPrior.size() > 0)
+	  {
+	    assert(resultMVNsWithoutPrior.size() == (unsigned)nVoxels);
+	    SaveMVNs(resultMVNsWithoutPrior, outputDir + "/finalMVNwithoutPrior", data);
+	    if (mvnFormat == "nifti")
+	      written.push_back(outputDir + "/finalMVNwithoutPrior");
+	  }
       }
 
     /* Some validation code -- checked, Save then Load 
@@ -170,72 +480,48 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
         indices(i) = i;
     model->DumpParameters(indices, "      ");
 
-    // Create individual files for each parameter's mean and Z-stat
+    // Create individual files for each parameter's mean, std and Z-stat.
+    // Every voxel's marginal variances are worked out just once, here.
 
-    if (!EasyOptions::UsingMatrixIO())
-    {
-      for (unsigned i = 1; i <= paramNames.size(); i++)
+    const int nParams = paramNames.size();
+    const bool paramImages = (saveMeans || saveStds || saveZstats);
+    Matrix allMeans, allStds;
+    if (paramImages)
       {
-        Matrix paramMean, paramZstat;
-    	paramMean.ReSize(1, nVoxels);
-	paramZstat.ReSize(1, nVoxels);
-
-        for (int vox = 1; vox <= nVoxels; vox++)
-        {
-	    paramMean(1,vox) = resultMVNs[vox-1]->means(i);
-            paramZstat(1,vox) =
-              paramMean(1,vox) / 
-              sqrt(resultMVNs[vox-1]->GetCovariance()(i,i));
-        }
-    	LOG << "    Writing means..." << endl;
-
-	volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),1);
-	output.setmatrix(paramMean,mask);
-	output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	output.setDisplayMaximumMinimum(output.max(),output.min());
-	save_volume4D(output,outputDir + "/mean_" + paramNames.at(i-1));
-
-	output.setmatrix(paramZstat,mask);
-        output.set_intent(NIFTI_INTENT_ZSCORE,0,0,0);
-	output.setDisplayMaximumMinimum(output.max(),output.min());
-	save_volume4D(output,outputDir + "/zstat_" + paramNames.at(i-1));
+	MVNDist::GetMarginals(resultMVNs, allMeans, allStds);
+	Real* sd = allStds.Store();
+	for (int i = 0; i < allStds.Storage(); i++)
+	  sd[i] = sqrt(sd[i]);
       }
-    }        
-    else
-    {
-	Matrix& paramMean = EasyOptions::OutMatrix("<means>"); // Creates matrix
-	Matrix& paramStd = EasyOptions::OutMatrix("<stdevs>");
-	const int nParams = paramNames.size();
-	paramMean.ReSize(nParams, nVoxels);
-	paramStd.ReSize(nParams, nVoxels);
-	for (int vox = 1; vox <= nVoxels; vox++)
+
+    if (paramImages)
+     {
+      const Matrix paramMean = allMeans.Rows(1, nParams);
+      const Matrix paramStd = allStds.Rows(1, nParams);
+      Matrix paramZstat;
+      if (saveZstats)
 	{
-            for (int i = 1; i <= nParams; i++)
-	    {
-              	paramStd(i,vox) = sqrt(resultMVNs[vox-1]->GetCovariance()(i,i));
-	    	paramMean(i,vox) = resultMVNs[vox-1]->means(i);
-	    }
+	  paramZstat.ReSize(nParams, nVoxels);
+	  const Real* m = paramMean.Store();
+	  const Real* sd = paramStd.Store();
+	  Real* z = paramZstat.Store();
+	  for (int i = 0; i < paramZstat.Storage(); i++)
+	    z[i] = m[i] / sd[i];
 	}
-	// That's it! We've written our outputs to the "means" and "stdevs" output matrices.
-	// Also save the noise parameters, just 'cuz.
-
-	Matrix& noiseMean = EasyOptions::OutMatrix("<noise_means>"); // Creates matrix
-	Matrix& noiseStd = EasyOptions::OutMatrix("<noise_stdevs>");
-	const int nNoise = resultMVNs[0]->means.Nrows() - paramNames.size();
-	noiseMean.ReSize(nNoise, nVoxels);
-	noiseStd.ReSize(nNoise, nVoxels);
-	for (int vox = 1; vox <= nVoxels; vox++)
-	{
-            for (int i = 1; i <= nNoise; i++)
-	    {
-              	noiseStd(i,vox) = sqrt(resultMVNs[vox-1]->GetCovariance()(i+nParams,i+nParams));
-	    	noiseMean(i,vox) = resultMVNs[vox-1]->means(i+nParams);
-	    }
-	}
-    }
+
+      LOG << "    Writing means..." << endl;
+      ParamImageWriter writer(nProcesses, mask, outputDir, paramNames, sparseOutput);
+      if (saveMeans) writer.Add("mean_", paramMean, NIFTI_INTENT_NONE);
+      if (saveStds) writer.Add("std_", paramStd, NIFTI_INTENT_NONE);
+      if (saveZstats) writer.Add("zstat_", paramZstat, NIFTI_INTENT_ZSCORE);
+      vector<vector<double> > unused;
+      writer.RunAll(writer.NumTasks(), unused);
+      for (int t = 0; t < writer.NumTasks() && !sparseOutput; t++)
+	written.push_back(writer.Filename(t));
+     }
 
     // Save the Free Energy estimates
-    if (!resultFs.empty())
+    if (saveFreeEnergy && !resultFs.empty())
       {
 	assert((int)resultFs.size() == nVoxels);
 	Matrix freeEnergy;
@@ -245,20 +531,11 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
 	    freeEnergy(1,vox) = resultFs.at(vox-1);
 	  }
 	
-	if (EasyOptions::UsingMatrixIO())
-	{
-	  EasyOptions::OutMatrix("<freeEnergy>") = freeEnergy;
-        }
-        else
-        {
-	volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),1);
-	output.setmatrix(freeEnergy,mask);
-	output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	output.setDisplayMaximumMinimum(output.max(),output.min());
-	save_volume4D(output,outputDir + "/freeEnergy");
-        }
+	SaveResultImage(freeEnergy, mask, NIFTI_INTENT_NONE, 
+			outputDir + "/freeEnergy", sparseOutput);
+	if (!sparseOutput) written.push_back(outputDir + "/freeEnergy");
       }
-    else
+    else if (saveFreeEnergy)
       {
 	LOG_ERR("Free energy wasn't recorded, so no freeEnergy.nii.gz created.\n");
       }
@@ -267,64 +544,149 @@ void InferenceTechnique::SaveResults(const DataSet& data) const
       {
         LOG << "    Writing model fit/residuals..." << endl;
         // Produce the model fit and residual volumeserieses
-	
-        Matrix modelFit, residuals, datamtx, coords;
-        modelFit.ReSize(model->NumOutputs(), nVoxels);
-	datamtx = data.GetVoxelData(); // it is just possible that the model needs the data in its calculations
-	coords = data.GetVoxelCoords();
-	ColumnVector tmp;
-        for (int vox = 1; vox <= nVoxels; vox++)
-        {
-	  // pass in stuff that the model might need
-	  ColumnVector y = datamtx.Column(vox);
-	  ColumnVector vcoords = coords.Column(vox);
-	  model->pass_in_data( y );
-	  model->pass_in_coords(vcoords);
-
-	  // do the evaluation
-	  model->Evaluate(resultMVNs.at(vox-1)->means.Rows(1,model->NumParams()), tmp);
-	  modelFit.Column(vox) = tmp;
-        }
+        Matrix modelFit;
+	CalcModelFit(data, modelFit);
 
-	volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),model->NumOutputs());
-	
         if (saveResiduals)
         {
-	  residuals = datamtx - modelFit;
-
-         if (EasyOptions::UsingMatrixIO())
-         {
-          EasyOptions::OutMatrix("<residuals>") = residuals;
-         }
-	 else
-	 { 
-	  output.setmatrix(residuals,mask);
-	  output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	  output.setDisplayMaximumMinimum(output.max(),output.min());
-	  save_volume4D(output,outputDir + "/residuals");
-	 }
+	  SaveResultImage(data.GetVoxelData() - modelFit, mask, NIFTI_INTENT_NONE, 
+			  outputDir + "/residuals", sparseOutput);
+	  if (!sparseOutput) written.push_back(outputDir + "/residuals");
         }
         if (saveModelFit)
         {
-	 if (EasyOptions::UsingMatrixIO())
-	 {
-	  EasyOptions::OutMatrix("<modelfit>") = modelFit;
-	 }
-	 else
-	 {
- 	  output.setmatrix(modelFit,mask);
-	  output.set_intent(NIFTI_INTENT_NONE,0,0,0);
-	  output.setDisplayMaximumMinimum(output.max(),output.min());
-	  save_volume4D(output,outputDir + "/modelfit");
-	 }
+	  SaveResultImage(modelFit, mask, NIFTI_INTENT_NONE, 
+			  outputDir + "/modelfit", sparseOutput);
+	  if (!sparseOutput) written.push_back(outputDir + "/modelfit");
         }
+      }
 
-    }
+    if (compression == "fast" || compression == "parallel")
+      {
+	// "fast": one file per process at the lowest level; "parallel": 
+	// 4MB blocks of every file shared out at the usual level
+	LOG << "    Compressing..." << endl;
+	const bool fast = (compression == "fast");
+	ImageCompressor compressor(nProcesses, written, fast ? 1 : 6, 
+				   fast ? 0 : 4L<<20);
+	vector<vector<double> > unused;
+	compressor.RunAll(compressor.NumTasks(), unused);
+	compressor.Finish();
+      }
+    else if (compression == "none")
+      {
+	// Don't leave any .nii.gz from an earlier run next to the new .nii
+	for (unsigned f = 0; f < written.size(); f++)
+	  remove((written[f] + ".nii.gz").c_str());
+      }
 
 #endif // __FABBER_LIBRARYONLY
     LOG << "    Done writing results." << endl;
 }
 
+// Used by fabber_library instead of writing files: the same results as
+// SaveResults, as matrices with one column per voxel.
+void InferenceTechnique::SaveResultMatrices(const DataSet& data, MatrixIO& io) const
+{
+  Tracer_Plus tr("InferenceTechnique::SaveResultMatrices");
+
+  const int nVoxels = resultMVNs.size();
+  const int nParams = model->NumParams();
+
+  Matrix allMeans, allStds;
+  MVNDist::GetMarginals(resultMVNs, allMeans, allStds);
+  Real* sd = allStds.Store();
+  for (int i = 0; i < allStds.Storage(); i++)
+    sd[i] = sqrt(sd[i]);
+
+  io.Out("<means>", allMeans.Rows(1, nParams));
+  io.Out("<stdevs>", allStds.Rows(1, nParams));
+
+  // Also save the noise parameters, just 'cuz.
+  const int nNoise = allMeans.Nrows() - nParams;
+  Matrix noiseMean(nNoise, nVoxels), noiseStd(nNoise, nVoxels);
+  if (nNoise > 0)
+    {
+      noiseMean = allMeans.Rows(nParams+1, nParams+nNoise);
+      noiseStd = allStds.Rows(nParams+1, nParams+nNoise);
+    }
+  io.Out("<noise_means>", noiseMean);
+  io.Out("<noise_stdevs>", noiseStd);
+
+  if (saveFreeEnergy && !resultFs.empty())
+    {
+      assert((int)resultFs.size() == nVoxels);
+      Matrix freeEnergy(1, nVoxels);
+      for (int vox = 1; vox <= nVoxels; vox++)
+	freeEnergy(1,vox) = resultFs.at(vox-1);
+      io.Out("<freeEnergy>", freeEnergy);
+    }
+
+  if (saveModelFit || saveResiduals)
+    {
+      Matrix modelFit;
+      CalcModelFit(data, modelFit);
+      if (saveResiduals)
+	io.Out("<residuals>", data.GetVoxelData() - modelFit);
+      if (saveModelFit)
+	io.Out("<modelfit>", modelFit);
+    }
+}
+
+void InferenceTechnique::CalcModelFit(const DataSet& data, Matrix& modelFit) const
+{
+  Tracer_Plus tr("InferenceTechnique::CalcModelFit");
+
+  const int nVoxels = resultMVNs.size();
+  modelFit.ReSize(model->NumOutputs(), nVoxels);
+  const Matrix& datamtx = data.GetVoxelData(); // it is just possible that the model needs the data in its calculations
+  const Matrix& coords = data.GetVoxelCoords();
+  ColumnVector tmp;
+  int nEvaluated = 0;
+  for (int vox = 1; vox <= nVoxels; vox++)
+    {
+      // use the prediction the inference kept, if there is one
+      if ((int)resultModelFitValid.size() == nVoxels && resultModelFitValid[vox-1])
+	{
+	  modelFit.Column(vox) = resultModelFit.Column(vox);
+	  continue;
+	}
+
+      // pass in stuff that the model might need
+      ColumnVector y = datamtx.Column(vox);
+      ColumnVector vcoords = coords.Column(vox);
+      model->pass_in_data( y );
+      model->pass_in_coords(vcoords);
+
+      // do the evaluation
+      model->Evaluate(resultMVNs.at(vox-1)->means.Rows(1,model->NumParams()), tmp);
+      modelFit.Column(vox) = tmp;
+      nEvaluated++;
+    }
+  LOG << "      (model evaluated again for " << nEvaluated << " of " 
+      << nVoxels << " voxels)" << endl;
+}
+
+void InferenceTechnique::SaveMVNs(const vector<MVNDist*>& mvns, const string& filename, const DataSet& data) const
+{
+#ifdef __FABBER_LIBRARYONLY
+  throw Logic_error("Should not be called when compiled without NEWIMAGE support");
+#else
+  Tracer_Plus tr("InferenceTechnique::SaveMVNs");
+
+  if (mvnFormat == "packed" || mvnFormat == "packed-double")
+    {
+      vector<string> paramNames;
+      model->NameParams(paramNames);
+      PackedMVNFile::Save(mvns, filename + ".fmvn", paramNames, 
+			  PackedMVNFile::HashMask(data.GetMask()), 
+			  mvnFormat == "packed-double");
+    }
+  else
+    MVNDist::Save(mvns, filename, data.GetMask());
+#endif //__FABBER_LIBRARYONLY
+}
+
 void InferenceTechnique::InitMVNFromFile(vector<MVNDist*>& continueFromDists,string continueFromFile, const DataSet& allData, string paramFilename="") {
 #ifdef __FABBER_LIBRARYONLY
   throw Logic_error("Should not be called when compiled without NEWIMAGE support");
@@ -335,6 +697,13 @@ void InferenceTechnique::InitMVNFromFile(vector<MVNDist*>& continueFromDists,str
 
   LOG << "Merging supplied MVN with model intialization." << endl;
 
+  // Packed files are read in place, and carry their own parameter names
+  const string packedName = PackedMVNFile::Find(continueFromFile);
+  if (packedName != "") {
+    InitMVNFromPackedFile(continueFromDists, packedName, allData, paramFilename);
+    return;
+  }
+
   if (paramFilename == "") {
     MVNDist::Load(continueFromDists, continueFromFile, allData.GetMask());
   }
@@ -467,9 +836,84 @@ void InferenceTechnique::InitMVNFromFile(vector<MVNDist*>& continueFromDists,str
 #endif //__FABBER_LIBRARYONLY
 }
 
+void InferenceTechnique::InitMVNFromPackedFile(vector<MVNDist*>& continueFromDists, const string& packedName, const DataSet& allData, const string& paramFilename) {
+#ifndef __FABBER_LIBRARYONLY
+  Tracer_Plus tr("InferenceTechnique::InitMVNFromPackedFile");
+
+  LOG_ERR("Reading packed MVNs from " << packedName << endl);
+  PackedMVNFile in(packedName);
+  in.CheckMask(allData.GetMask());
+  const int nvox = in.NumVoxels();
+  continueFromDists.reserve(nvox);
+
+  // A parameter name file takes precedence over the names in the header
+  vector<string> paramNames = in.ParamNames();
+  if (paramFilename != "") {
+    ifstream paramFile(paramFilename.c_str());
+    if (!paramFile.good())
+      throw Invalid_option("Check filename of the parameter name file. ");
+    paramNames.clear();
+    string currparam;
+    while (getline(paramFile, currparam))
+      if (currparam != "") paramNames.push_back(currparam);
+  }
+
+  vector<string> ModelparamNames;
+  model->NameParams(ModelparamNames);
+
+  if (paramNames.empty() || paramNames == ModelparamNames) {
+    // Same parameters in the same order: a straight copy
+    for (int v = 1; v <= nvox; v++)
+      continueFromDists.push_back(in.NewMVN(v));
+    return;
+  }
+
+  // Otherwise build a remap table once: model parameters come from the 
+  // file where the names match and the model defaults where they don't;
+  // the noise parameters follow the named ones in both.
+  const int nmodparams = model->NumParams();
+  const int nfwdparams = paramNames.size();
+  const int nnoiseparams = in.NumParams() - nfwdparams;
+  if (nnoiseparams < 0)
+    throw Invalid_option("More parameter names than parameters in " + packedName);
+
+  MVNDist tempprior(nmodparams);
+  MVNDist tempposterior(nmodparams);
+  model->HardcodedInitialDists(tempprior,tempposterior);
+
+  vector<int> remap(nmodparams + nnoiseparams, 0);
+  vector<bool> hasmatched(nfwdparams, false);
+  for (int p = 0; p < nmodparams; p++) {
+    for (int q = 0; q < nfwdparams; q++)
+      if (ModelparamNames[p] == paramNames[q]) {
+	remap[p] = q+1;
+	hasmatched[q] = true;
+      }
+    LOG << ModelparamNames[p] << (remap[p] ? ": Matched with file" 
+				  : ": Not matched, set from model default") << endl;
+  }
+  for (int q = 0; q < nfwdparams; q++)
+    if (!hasmatched[q])
+      LOG_ERR(paramNames[q] + ": Not matched!");
+  for (int j = 1; j <= nnoiseparams; j++)
+    remap[nmodparams + j-1] = nfwdparams + j;
+
+  ColumnVector defaultMeans(nmodparams + nnoiseparams);
+  defaultMeans = 0;
+  defaultMeans.Rows(1, nmodparams) = tempposterior.means;
+  SymmetricMatrix defaultCovariance(nmodparams + nnoiseparams);
+  defaultCovariance = 0;
+  defaultCovariance.SymSubMatrix(1, nmodparams) = tempposterior.GetCovariance();
+
+  for (int v = 1; v <= nvox; v++)
+    continueFromDists.push_back(in.NewMVN(v, remap, defaultMeans, defaultCovariance));
+#endif //__FABBER_LIBRARYONLY
+}
+
 InferenceTechnique::~InferenceTechnique() 
 { 
-  delete model;
+  if (modelCache == NULL || !modelCache->Owns(model))
+    delete model;
   delete noise;
   while (!resultMVNs.empty())
     {
@@ -84,6 +84,8 @@
  #include "Update_deformation.h"
 #endif //__FABBER_MOTION
 
+class LinearFwdModel;
+
 class InferenceTechnique {
     
  public:
@@ -92,10 +94,15 @@ class InferenceTechnique {
     // as determined by the name given in "method".
     
  public:
-  InferenceTechnique() : model(NULL), noise(NULL) { return; }
+  InferenceTechnique() : model(NULL), noise(NULL), 
+    checkpointEvery(0), resume(false), modelCache(NULL) { return; }
   virtual void Setup(ArgsType& args);
   virtual void SetOutputFilenames(const string& output)
     { outputDir = output; }
+  void SetResume(bool r) { resume = r; }
+  // Carry on from the checkpoint in the output directory (--resume)
+  void SetModelCache(FwdModelCache* cache) { modelCache = cache; }
+  // Take the forward model from (and leave it in) cache; call before Setup
   virtual void DoCalculations(const DataSet& data) = 0;
   virtual void SaveResults(const DataSet& data) const;
   virtual ~InferenceTechnique();
@@ -106,12 +113,41 @@ class InferenceTechnique {
   string outputDir;
   bool saveModelFit;
   bool saveResiduals;
+  bool saveMeans, saveStds, saveZstats, saveMVN, saveFreeEnergy; // --save=
+  int nProcesses; // worker processes for parallelizable steps (1 = serial)
+  string mvnFormat; // finalMVN as "nifti", "packed" or "packed-double"
+  string compression; // of result images: "gzip", "none", "fast" or "parallel"
+  bool sparseOutput; // result images as VoxelTables (.fvt) of the masked voxels
+  void SetupOutputs(ArgsType& args); // reads all the above, and checkpointEvery
+
+  // --checkpoint-every=N: journal the finished voxels every N voxels (for 
+  // spatialvb, the whole state every N iterations) so --resume can carry on
+  int checkpointEvery; // 0 = off
+  bool resume;
+  string CheckpointFilename() const { return outputDir + "/checkpoint"; }
+  string CheckpointLayout() const; // the model's parameters and the noise size
+
+  FwdModelCache* modelCache; // only with fabber --serve
+  void SetupModel(ArgsType& args); // sets model
   
   vector<MVNDist*> resultMVNs;
   vector<MVNDist*> resultMVNsWithoutPrior; // optional; used by Adrian's spatial priors research
   vector<double> resultFs;
 
+  // The model prediction at each voxel's final means, kept while the
+  // inference has it anyway (in the linearized model) so SaveResults
+  // needn't evaluate the model again for --save-model-fit/--save-residuals.
+  // Voxels not flagged in resultModelFitValid are evaluated as before.
+  Matrix resultModelFit;
+  vector<bool> resultModelFitValid;
+  void KeepModelFit(int voxel, const LinearFwdModel& linear, 
+		    const ColumnVector& fwdMeans);
+
   void InitMVNFromFile(vector<MVNDist*>& continueFromDists,string continueFromFile, const DataSet& allData, string paramFilename);
+  void InitMVNFromPackedFile(vector<MVNDist*>& continueFromDists, const string& packedName, const DataSet& allData, const string& paramFilename);
+  void SaveMVNs(const vector<MVNDist*>& mvns, const string& filename, const DataSet& data) const;
+  void SaveResultMatrices(const DataSet& data, MatrixIO& io) const;
+  void CalcModelFit(const DataSet& data, Matrix& modelFit) const;
   
   // Motion related stuff
   int Nmcstep; // number of motion correction steps to run
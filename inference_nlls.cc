@@ -65,14 +65,12 @@
     University, to negotiate a licence. Contact details are:
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 #include "inference_nlls.h"
+#include "checkpoint.h"
 
 void NLLSInferenceTechnique::Setup(ArgsType& args)
 {
   Tracer_Plus tr("NLLSInferenceTechnique::Setup");
-  model = FwdModel::NewFromName(args.Read("model"), args);
-  assert( model->NumParams() > 0 );
-  LOG_ERR("    Forward Model version:\n      " 
-	  << model->ModelVersion() << endl);
+  SetupModel(args);
 
   //determine whether NLLS is being run in isolation or as a pre-step for VB (alters what we do if result is ill conditioned)
   vbinit = args.ReadBool("vb-init");
@@ -90,6 +88,8 @@ void NLLSInferenceTechnique::Setup(ArgsType& args)
 
   lm = args.ReadBool("lm"); //determine whether we use L (default) or LM converengce
 
+  SetupOutputs(args);
+
 }
 
 void NLLSInferenceTechnique::DoCalculations(const DataSet& allData)
@@ -107,8 +107,26 @@ void NLLSInferenceTechnique::DoCalculations(const DataSet& allData)
       + stringify(model->NumOutputs())
       + ")!");
 
+  // Pick up whatever a previous run finished, and journal as we go
+  resultMVNs.resize(Nvoxels, NULL);
+  Checkpoint journal;
+  long journalBytes = 0;
+  if (resume)
+    {
+      vector<double> noFs;
+      const int nDone = Checkpoint::Load(CheckpointFilename(), Nvoxels, CheckpointLayout(),
+        resultMVNs, noFs, resultModelFit, resultModelFitValid, NULL, &journalBytes);
+      LOG_ERR("Resuming: " << nDone << " of " << Nvoxels 
+	      << " voxels were already done" << endl);
+    }
+  if (checkpointEvery > 0)
+    journal.Start(CheckpointFilename(), Nvoxels, CheckpointLayout(), checkpointEvery, journalBytes);
+
   for (unsigned int voxel = 1; voxel <= Nvoxels; voxel++)
     {
+      if (resultMVNs[voxel-1] != NULL)
+	continue;
+
       ColumnVector y = data.Column(voxel);
       ColumnVector vcoords = coords.Column(voxel);
       // some models might want more information about the data
@@ -208,9 +226,11 @@ catch (Exception)
 	 
 	}
 
-      resultMVNs.push_back(new MVNDist(fwdPosterior));
-      assert(resultMVNs.size() == voxel);
+      resultMVNs[voxel-1] = new MVNDist(fwdPosterior);
+      if (journal.IsOpen())
+	journal.AddVoxel(voxel, fwdPosterior, 9999);
     }
+  journal.Close();
 }
 
 NLLSInferenceTechnique::~NLLSInferenceTechnique()
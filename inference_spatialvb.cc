@@ -70,13 +70,42 @@ Copyright (C) 2007-2010 University of Oxford  */
 using namespace Utilities;
 #include "inference_spatialvb.h"
 #include "convergence.h"
-
-#define NOCACHE 1
+#include "checkpoint.h"
+#include "tools.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #ifndef __FABBER_LIBRARYONLY
 using namespace NEWIMAGE;
 #endif
 
+// Delta/rho searches for a set of parameters (one task each), for running 
+// in parallel.  Each result is (delta, rho), followed by the lower triangle 
+// of C^-1 at the new delta (if delta >= 0) so the parent doesn't have to 
+// factorise it again.
+class SmoothingScaleTasks : public ParallelTasks
+{
+ public:
+  SmoothingScaleTasks(const SpatialVariationalBayes& s, const vector<int>& k,
+		      const vector<MVNDist>& post, 
+		      const vector<MVNDist*>& postWithoutPrior,
+		      const DiagonalMatrix& d, const DiagonalMatrix& r)
+    : ParallelTasks(s.nProcesses), svb(s), ks(k), fwdPosteriorVox(post), 
+      fwdPosteriorWithoutPrior(postWithoutPrior), delta(d), rho(r) { return; }
+  virtual void RunTask(int task, vector<double>& results) const;
+ private:
+  const SpatialVariationalBayes& svb;
+  const vector<int>& ks;
+  const vector<MVNDist>& fwdPosteriorVox;
+  const vector<MVNDist*>& fwdPosteriorWithoutPrior;
+  const DiagonalMatrix& delta;
+  const DiagonalMatrix& rho;
+};
+
 void SpatialVariationalBayes::Setup(ArgsType& args)
 {
   Tracer_Plus tr("SpatialVariationalBayes::Setup");
@@ -113,6 +142,12 @@ void SpatialVariationalBayes::Setup(ArgsType& args)
 
   
   distanceMeasure = args.ReadWithDefault("distance-measure","dist1");
+
+  // Memory budget for cached C^-1 matrices (0 == only keep the current delta)
+  // and optional on-disk store so repeated runs on the same mask can reuse them
+  covar.SetCachePolicy(
+    convertTo<double>(args.ReadWithDefault("covariance-cache-mb","0")),
+    args.ReadWithDefault("covariance-cache-dir",""));
   spatialPriorsTypes = args.ReadWithDefault("param-spatial-priors","S+");
 
 //  if (spatialPriorsTypes == "N+")
@@ -145,6 +180,14 @@ void SpatialVariationalBayes::Setup(ArgsType& args)
   assert(!(updateSpatialPriorOnFirstIteration && !useEvidenceOptimization)); // currently doesn't work, but fixable
   bruteForceDeltaSearch = args.ReadBool("brute-force-delta-search");
 
+  multiresLevels = convertTo<int>(args.ReadWithDefault("multires","1"));
+  if (multiresLevels < 1)
+    throw Invalid_option("--multires must be at least 1 (the number of resolution levels)");
+
+  spatialBlocks = convertTo<int>(args.ReadWithDefault("spatial-blocks","1"));
+  if (spatialBlocks < 1)
+    throw Invalid_option("--spatial-blocks must be at least 1");
+
   // Preferred way of using these options
   if (!useFullEvidenceOptimization && 
       !args.ReadBool("no-eo") &&
@@ -308,6 +351,50 @@ assert(resultMVNs.empty()); // Only call DoCalculations once
 assert(resultMVNsWithoutPrior.empty());;
 assert(resultFs.empty());
 
+if ((resume || checkpointEvery > 0) && (spatialBlocks > 1 || multiresLevels > 1))
+  throw Invalid_option("--checkpoint-every and --resume can't be used with --spatial-blocks or --multires");
+
+// Split into slabs, each solved by a separate process, if requested
+if (spatialBlocks > 1 && blockOwned.empty() && DoBlockCalculations(allData))
+  return;
+
+// Coarse-to-fine: solve on a half-resolution grid first, and start this 
+// level from the results.  This recurses down to the coarsest level.
+vector<MVNDist*> coarseResults;
+vector<int> fineToCoarse;
+if (multiresLevels > 1)
+{
+  Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - coarser level");
+  if (continueFromFile != "" || lockedLinearFile != "" 
+      || spatialPriorsTypes.find('I') != string::npos)
+    throw Invalid_option("--multires can't be used with --continue-from-mvn, --locked-linear-from-mvn or 'I' priors");
+
+  DataSet coarseData;
+  allData.Downsample(coarseData, fineToCoarse);
+  const int Ncoarse = coarseData.GetVoxelData().Ncols();
+
+  if (Ncoarse < 2)
+    {
+      Warning::IssueOnce("--multires: mask is too small for any more levels");
+      fineToCoarse.clear();
+    }
+  else
+    {
+      LOG_ERR("Multiresolution: solving " << Ncoarse << " coarse voxels first (" 
+	      << Nvoxels << " at this level)" << endl);
+      multiresLevels--;
+      DoCalculations(coarseData);
+      multiresLevels++;
+
+      coarseResults.swap(resultMVNs);
+      for (unsigned v = 0; v < resultMVNsWithoutPrior.size(); v++)
+	delete resultMVNsWithoutPrior[v];
+      resultMVNsWithoutPrior.clear();
+      resultFs.clear();
+      LOG_ERR("Multiresolution: back to " << Nvoxels << " voxels" << endl);
+    }
+}
+
 // Initialization:
 
 // Make the neighbours[] lists if required
@@ -356,17 +443,51 @@ vector<LinearizedFwdModel> linearVox;
 bool lockedLinearEnabled = (lockedLinearFile != "");
 Matrix lockedLinearCentres;  // empty by default
 
+// State saved by the last --checkpoint-every snapshot, if we're resuming
+bool resuming = false;
+vector<double> resumeState;
+
 { Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - initialization");
 
 // If we're continuing from previous saved results, load them here:
 continuingFromFile = (continueFromFile != "");
 
 vector<MVNDist*> continueFromDists;
-if (continuingFromFile)
+if (resume)
+{
+  // The snapshot is a whole iteration, so it's all or nothing
+  vector<double> noFs;
+  Matrix noFits;
+  vector<bool> noFitsValid;
+  const int nDone = Checkpoint::Load(CheckpointFilename(), Nvoxels, CheckpointLayout(),
+    continueFromDists, noFs, noFits, noFitsValid, &resumeState);
+  if (nDone > 0 && nDone < Nvoxels)
+    throw Invalid_option("--resume: checkpoint only has " + stringify(nDone)
+      + " of " + stringify(Nvoxels) + " voxels");
+  resuming = (nDone > 0);
+  if (!resuming)
+    LOG_ERR("Resuming: no checkpoint found, starting from scratch" << endl);
+}
+
+if (resuming)
+{
+  // Treat it like --continue-from-mvn, noise included
+  continuingFromFile = true;
+}
+else if (continuingFromFile)
 {
   InitMVNFromFile(continueFromDists,continueFromFile, allData, paramFilename);
   //MVNDist::Load(continueFromDists, continueFromFile, allData.GetMask());
 }
+else if (!coarseResults.empty())
+{
+  // Start from the coarse-level posterior of the enclosing voxel.  Treat 
+  // it like a continued run, so model->Initialise doesn't overwrite it.
+  continuingFromFile = true;
+  continueFromDists.resize(Nvoxels);
+  for (int v = 1; v <= Nvoxels; v++)
+    continueFromDists[v-1] = coarseResults.at(fineToCoarse[v-1]-1);
+}
 
 // Locked linearizations, if requested
 if (lockedLinearEnabled)
@@ -411,20 +532,27 @@ else
 
 linearVox.resize(Nvoxels, LinearizedFwdModel(model) );
 resultMVNs.resize(Nvoxels, NULL);
+resultModelFitValid.assign(Nvoxels, false);
 
 if (alsoSaveWithoutPrior)
   resultMVNsWithoutPrior.resize(Nvoxels, NULL);
 
 resultFs.resize(Nvoxels, 9999); // 9999 is a garbage default value
 
+// A linear model's Jacobian is the same everywhere: take it from voxel 1
+// rather than working it out again (this also shares its JacobianId)
+const bool modelIsLinear = model->IsLinear();
+
 for (int v = 1; v <= Nvoxels; v++)
 {
+if (v > 1 && modelIsLinear)
+  linearVox[v-1] = linearVox[0];
 linearVox[v-1].ReCentre(lockedLinearEnabled
 		      ? lockedLinearCentres.Column(v)
 		      : fwdPosteriorVox[v-1].means 
 		      );
 
-if (initialNoisePosterior == NULL) // continuing Noise from file
+if (initialNoisePosterior == NULL || resuming) // continuing Noise from file
 {
 assert(nFwdParams + nNoiseParams == continueFromDists.at(v-1)->GetSize());
 noiseVox[v-1] = noise->NewParams();
@@ -438,6 +566,15 @@ noiseVox[v-1] = initialNoisePosterior->Clone();
 noiseVoxPrior[v-1] = initialNoisePrior->Clone();
 noise->Precalculate( *noiseVox[v-1], *noiseVoxPrior[v-1], data.Column(v) );
 }
+
+// Noise is not carried over from the coarse level, since averaging 
+// changes it; fwdPosteriorVox has its own copies of the rest.
+for (unsigned c = 0; c < coarseResults.size(); c++)
+  delete coarseResults[c];
+coarseResults.clear();
+if (resuming)
+  for (int v = 1; v <= Nvoxels; v++)
+    delete continueFromDists[v-1];
 } // end tracer  
 
 // Make the spatial normalization parameters
@@ -452,6 +589,44 @@ DiagonalMatrix rho(Nparams);
 delta = fixedDelta; // Hard-coded initial value (in mm!)
 rho = 0;
 LOG_ERR("Using initial value for all deltas: " << delta(1) << endl);
+
+if (!fineToCoarse.empty())
+{
+  // Learned smoothness from the coarse level.  Voxel distances are twice
+  // as large here, so scale delta to match; akmean is only a starting 
+  // point and gets re-estimated on the next iteration anyway.
+  const double deltaScale = (distanceMeasure == "dist2") ? 4 : 2;
+  for (int k = 1; k <= Nparams; k++)
+    {
+      const char type = spatialPriorsTypes[k-1];
+      if (type == 'D' || type == 'R')
+	{
+	  delta(k) = multiresDelta(k) * deltaScale;
+	  rho(k) = multiresRho(k);
+	}
+    }
+  akmean = multiresAkmean;
+  LOG_ERR("Initial deltas from coarser level: " << delta.AsColumn().t());
+}
+
+// Resuming: the snapshot's extra record is the iteration count followed by
+// delta, rho and akmean for each parameter
+int iterationsDone = 0;
+if (resuming)
+{
+  if ((int)resumeState.size() != 1 + 3*Nparams)
+    throw Invalid_option("--resume: checkpoint doesn't have the spatial prior state for "
+      + stringify(Nparams) + " parameters");
+  iterationsDone = int(resumeState[0]);
+  for (int k = 1; k <= Nparams; k++)
+    {
+      delta(k) = resumeState[k];
+      rho(k) = resumeState[Nparams + k];
+      akmean(k) = resumeState[2*Nparams + k];
+    }
+  LOG_ERR("Resuming after iteration " << iterationsDone 
+	  << ", deltas: " << delta.AsColumn().t());
+}
 //  delta(1) = delta(3) = .5;
 //  LOG_ERR("Except delta([1 3]) (Q0,M0) = " << delta(3) << endl);
 //  delta(3) = .5;
@@ -482,9 +657,9 @@ volume4D<float> imagevol;
 for (int k=1; k<=Nparams; k++) {
   if (spatialPriorsTypes[k-1] == 'I') {
     LOG_ERR("Reading Image prior ("<<k<<"): " << imagepriorstr[k-1] << endl);
-    if (EasyOptions::UsingMatrixIO())
+    if (allData.GetMatrixIO() != NULL)
       {
-        ImagePrior[k-1] = EasyOptions::InMatrix(imagepriorstr[k-1]);
+        ImagePrior[k-1] = allData.GetMatrixIO()->In(imagepriorstr[k-1]);
       }
     else
       {
@@ -524,10 +699,10 @@ default:
 }
 }
 
-if (StS.Nrows() == 0 && neighbours.size() > 0 && (shrinkageType == 'S' || shrinkageType == 'Z'))
+if (StS.Nrows() == 0 && neighbours.NumVoxels() > 0 && (shrinkageType == 'S' || shrinkageType == 'Z'))
   {
     Tracer_Plus tr("Creating StS matrix");
-    assert((int)neighbours.size() == Nvoxels);
+    assert((int)neighbours.NumVoxels() == Nvoxels);
 
     const double tiny = 1e-6;
     Warning::IssueOnce("Using 'S' prior with fast-calculation method and constant diagonal weight of " + stringify(tiny));
@@ -540,20 +715,20 @@ if (StS.Nrows() == 0 && neighbours.size() > 0 && (shrinkageType == 'S' || shrink
     StS = 0;
     for (int v = 1; v <= Nvoxels; v++)
       {
-        int Nv = neighbours[v-1].size(); // Number of neighbours v has
+        int Nv = neighbours.Count(v); // Number of neighbours v has
 
         // Diagonal value = N + (N+tiny)^2
         StS(v,v) = Nv + (Nv+tiny)*(Nv+tiny);
 
 	// Off-diagonal value = num 2nd-order neighbours (with duplicates) - Aij(Ni+Nj+2*tiny)
-	for (vector<int>::iterator nidIt = neighbours[v-1].begin();
-             nidIt != neighbours[v-1].end(); nidIt++)
+	for (const int* nidIt = neighbours.Begin(v);
+             nidIt != neighbours.End(v); nidIt++)
           {
             if (v < *nidIt)
-              StS(v,*nidIt) -= Nv + neighbours[*nidIt-1].size() + 2*tiny;
+              StS(v,*nidIt) -= Nv + neighbours.Count(*nidIt) + 2*tiny;
           }
-	for (vector<int>::iterator nidIt = neighbours2[v-1].begin();
-             nidIt != neighbours2[v-1].end(); nidIt++)
+	for (const int* nidIt = neighbours2.Begin(v);
+             nidIt != neighbours2.End(v); nidIt++)
           {
             if (v < *nidIt)
               StS(v,*nidIt) += 1;
@@ -570,8 +745,8 @@ if (StS.Nrows() == 0 && neighbours.size() > 0 && (shrinkageType == 'S' || shrink
     
     for (int v = 1; v <= Nvoxels; v++)
       {
-	for (vector<int>::iterator nidIt = neighbours[v-1].begin();
-	     nidIt != neighbours[v-1].end(); nidIt++) 
+	for (const int* nidIt = neighbours.Begin(v);
+	     nidIt != neighbours.End(v); nidIt++) 
 	  {
 	    int nid = *nidIt;
 	    connect(v, nid) = -1;
@@ -598,7 +773,7 @@ if (StS.Nrows() == 0 && neighbours.size() > 0 && (shrinkageType == 'S' || shrink
 
 
 conv->Reset();
-bool isFirstIteration = true; // slightly different behaviour in first iteratio
+bool isFirstIteration = !resuming; // slightly different behaviour in first iteratio
 
 //  if (!useShrinkageMethod) LOG_ERR("HACK: using --fixed-delta value on first iteration instead of automatically determining delta from priors\n");
 
@@ -672,7 +847,9 @@ conv->DumpTo(cout);
 		  double tmp1 = 0.0;	
 		  for (int v = 1; v <= Nvoxels; v++)
 		    {
-		      int nn = neighbours.at(v-1).size();
+		      if (!blockOwned.empty() && !blockOwned[v-1])
+			continue; // halo voxel -- counted by its own block
+		      int nn = neighbours.Count(v);
 		      //cout << v << ": " << nn << "," << wk(v) << "," << sigmak(v,v) << endl;
 		      if (shrinkageType == 'm') //useMRF)
 			tmp1 += sigmak(v,v) * spatialDims*2;
@@ -694,21 +871,42 @@ conv->DumpTo(cout);
 
 		  for (int v = 1; v <= Nvoxels; v++)
 		    {
-		      for (vector<int>::iterator v2It = neighbours[v-1].begin();
-			   v2It != neighbours.at(v-1).end(); v2It++)
+		      for (const int* v2It = neighbours.Begin(v);
+			   v2It != neighbours.End(v); v2It++)
 			{
 			  Swk(v) += wk(v) - wk(*v2It);
 			}
 		      //		if (useDirichletBC || useMRF) // but not useMRF2
 		      if (shrinkageType == 'p' || shrinkageType == 'm')
-			Swk(v) += wk(v)*(spatialDims*2 - neighbours.at(v-1).size());
+			Swk(v) += wk(v)*(spatialDims*2 - neighbours.Count(v));
 		      // Do nothing for 'S'
 		    }
+		  int NvoxelsTotal = Nvoxels;
+		  if (!blockOwned.empty())
+		    {
+		      NvoxelsTotal = 0;
+		      for (int v = 1; v <= Nvoxels; v++)
+			{
+			  if (blockOwned[v-1])
+			    NvoxelsTotal++;
+			  else
+			    Swk(v) = 0;
+			}
+		    }
+
 		  double tmp2 = Swk.SumSquare(); //(Swk.t() * Swk).AsScalar();
 		  
 		  //	    if (useMRF || useMRF2) // overwrite this for MRF
 		  if (shrinkageType == 'm' || shrinkageType == 'M')
 		    tmp2 = DotProduct(Swk, wk);
+
+		  if (!blockOwned.empty())
+		    {
+		      vector<double> sums(3);
+		      sums[0] = tmp1; sums[1] = tmp2; sums[2] = NvoxelsTotal;
+		      BlockSumAll(sums);
+		      tmp1 = sums[0]; tmp2 = sums[1]; NvoxelsTotal = int(sums[2]);
+		    }
 		  
 		  cout << "k=" << k << ", tmp1=" << tmp1 << ", tmp2=" << tmp2 << endl;
 		  //cout << Swk.t();
@@ -717,7 +915,7 @@ conv->DumpTo(cout);
 		  gk(k,k) = 1/(0.5*tmp1 + 0.5*tmp2 + 0.1); // prior q1 == 10 (1/q1 == 0.1)
 		  //  end
 		  
-		  akmean(k) = gk(k) * (Nvoxels*0.5 + 1.0); // prior q2 == 1.0
+		  akmean(k) = gk(k) * (NvoxelsTotal*0.5 + 1.0); // prior q2 == 1.0
 		}
 		
 		break;
@@ -769,6 +967,40 @@ conv->DumpTo(cout);
 
 
 // UPDATE DELTA & RHO ESTIMATES
+
+// The R and D searches for different parameters are independent, so if 
+// we have more than one process, do them all at once here and let the 
+// loop below just pick up the results.
+vector<vector<double> > precomputed(Nparams);
+if (nProcesses > 1 && (!isFirstIteration || updateSpatialPriorOnFirstIteration))
+{
+  vector<int> ks;
+  for (int k = 1; k <= Nparams; k++)
+    if (spatialPriorsTypes[k-1] == 'R' || spatialPriorsTypes[k-1] == 'D')
+      ks.push_back(k);
+
+  if (ks.size() > 1)
+    {
+      Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - parallel delta updates");
+      vector<vector<double> > results;
+      SmoothingScaleTasks tasks(*this, ks, fwdPosteriorVox, 
+				fwdPosteriorWithoutPrior, delta, rho);
+      tasks.RunAll(ks.size(), results);
+      for (unsigned i = 0; i < ks.size(); i++)
+	{
+	  if (results[i].size() > 2)
+	    {
+	      SymmetricMatrix Cinv(covar.GetDistances().Nrows());
+	      assert((int)results[i].size() == 2 + Cinv.Storage());
+	      Cinv << &results[i][2];
+	      covar.AddCinv(results[i][0], Cinv);
+	      results[i].resize(2);
+	    }
+	  precomputed[ks[i]-1] = results[i];
+	}
+    }
+}
+
 for (int k = 1; k <= Nparams; k++)
 {
 Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
@@ -815,28 +1047,9 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
 	  case 'R': case 'D': case 'F':
 	    // Reorganize data by parameter (rather than by voxel)
-	    DiagonalMatrix covRatio(Nvoxels);
-	    ColumnVector meanDiffRatio(Nvoxels);
-	    const double priorCov = initialFwdPrior->GetCovariance()(k,k);
-	    const double priorCovSqrt = sqrt(priorCov);
-	    const double priorMean = initialFwdPrior->means(k);
-
-	    
-	    
-	    for (int v = 1; v <= Nvoxels; v++)
-	      {
-		// Isolate just the dimensionless quantities we need
-
-		// Penny:
-	        covRatio(v,v) = fwdPosteriorVox.at(v-1).GetCovariance()(k,k) 
-		  / priorCov;
-		// Hacky:
-		//LOG_ERR("WARNING: Using hacky covRatio calculation (precision rather than covariance!\n!");		
-		//		covRatio(v,v) = 1 / fwdPosteriorVox.at(v-1).GetPrecisions()(k,k) / priorCov; 
-
-		meanDiffRatio(v) = (fwdPosteriorVox.at(v-1).means(k) - priorMean) 
-		  / priorCovSqrt;
-	      }
+	    DiagonalMatrix covRatio;
+	    ColumnVector meanDiffRatio;
+	    CalcSmoothingRatios(k, fwdPosteriorVox, covRatio, meanDiffRatio);
 	    
 	    //	SymmetricMatrix covRatioSupplemented(Nvoxels);
 	    // Recover the off-diagonal elements of fwdPriorVox/priorCov
@@ -876,43 +1089,19 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	    DiagonalMatrix deltaMax = delta * maxPrecisionIncreasePerIteration;
 	    
 
-	    if (type == 'R')
-	      {
-		if (alwaysInitialDeltaGuess>0) delta(k) = alwaysInitialDeltaGuess;
-		if (useEvidenceOptimization)
-		  {
-		    Warning::IssueAlways("Using R... mistake??");
-		    delta(k) = OptimizeEvidence(fwdPosteriorWithoutPrior, k, initialFwdPrior, delta(k), true, &rho(k));
-		    LOG_ERR("\nSpatialPrior " << k << " type R eo : " << delta(k) << " " << rho(k) << " 0\n");		  }
-		else
-		  {		    
-		    Warning::IssueAlways("Using R without EO... mistake??");
-		    // Spatial priors with rho & delta
-		    delta(k) = OptimizeSmoothingScale( covRatio, meanDiffRatio,
-						       delta(k), &rho(k), true);
-		    LOG_ERR("\nSpatialPrior " << k << " type R vb : " << delta(k) << " " << rho(k) << " 0\n");
-
-		  }
-	      }
-	    else if (type == 'D')
+	    if (type == 'R' || type == 'D')
 	      {
-                if (alwaysInitialDeltaGuess>0) delta(k) = alwaysInitialDeltaGuess;
-
-		// Spatial priors with only delta
-		if (useEvidenceOptimization)
+		if (!precomputed.at(k-1).empty())
 		  {
-		    delta(k) = OptimizeEvidence(fwdPosteriorWithoutPrior, k, initialFwdPrior, delta(k));
-		    LOG_ERR("\nSpatialPrior " << k << " type D eo : " << delta(k) << " 0 0\n");
+		    // Already optimized in parallel, above
+		    delta(k) = precomputed[k-1][0];
+		    rho(k) = precomputed[k-1][1];
 		  }
 		else
 		  {
-		    Warning::IssueAlways("Using D without EO... mistake??");
-		    delta(k) = OptimizeSmoothingScale( covRatio, meanDiffRatio, 
-						       delta(k), &rho(k), false );
-		    LOG_ERR("\nSpatialPrior " << k << " type D vb : " << delta(k) << " 0 0\n");
-
+		    UpdateSmoothingScale(k, type, covRatio, meanDiffRatio,
+					 fwdPosteriorWithoutPrior, delta(k), rho(k));
 		  }
-		
 	      }
 	    else // type == 'F'
 	      {	
@@ -1004,8 +1193,8 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 		      sTmp(v,v) = 4*spatialDims*spatialDims; // nn added later
 		      
 		      // neighbours = (2*Ndim) * -2
-		      for (vector<int>::iterator nidIt = neighbours[v-1].begin();
-			   nidIt != neighbours[v-1].end(); nidIt++)
+		      for (const int* nidIt = neighbours.Begin(v);
+			   nidIt != neighbours.End(v); nidIt++)
 			{
 			  int nid = *nidIt; // neighbour ID (voxel number)
 			  assert(sTmp(v,nid) == 0);
@@ -1014,8 +1203,8 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 			}
 		      
 		      // neighbours2 = 1 (for each appearance)	    
-		      for (vector<int>::iterator nidIt = neighbours2[v-1].begin();
-			   nidIt != neighbours2[v-1].end(); nidIt++)
+		      for (const int* nidIt = neighbours2.Begin(v);
+			   nidIt != neighbours2.End(v); nidIt++)
 			{
 			  int nid2 = *nidIt; // neighbour ID (voxel number)
 			  sTmp(v,nid2) += 1; // not =1, because duplicates are ok.
@@ -1035,6 +1224,9 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
     // ITERATE OVER VOXELS
     for (int v = 1; v <= Nvoxels; v++)
       {
+	if (!blockOwned.empty() && !blockOwned[v-1])
+	  continue; // halo voxel, updated by its own block
+
 	// some models may want extra information about the data
 	if (suppdata.Ncols() > 0) {
 	  model->pass_in_data(  data.Column(v) ,  suppdata.Column(v) );
@@ -1092,8 +1284,8 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
 	    double weight8 = 0; // weighted +8
 	    ColumnVector contrib8(Nparams); contrib8 = 0.0;
-	    for (vector<int>::iterator nidIt = neighbours[v-1].begin();
-		 nidIt != neighbours[v-1].end(); nidIt++) 
+	    for (const int* nidIt = neighbours.Begin(v);
+		 nidIt != neighbours.End(v); nidIt++) 
 	      // iterate over neighbour ids
 	      {
 		int nid = *nidIt;
@@ -1104,8 +1296,8 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	    
 	    double weight12 = 0; // weighted -1, may be duplicated
 	    ColumnVector contrib12(Nparams); contrib12 = 0.0;
-	    for (vector<int>::iterator nidIt = neighbours2[v-1].begin();
-		 nidIt != neighbours2[v-1].end(); nidIt++)
+	    for (const int* nidIt = neighbours2.Begin(v);
+		 nidIt != neighbours2.End(v); nidIt++)
 	      // iterate over neighbour ids
 	      {
 		int nid = *nidIt;
@@ -1116,7 +1308,7 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 	    
 	    // Set prior mean & precisions
 	    
-	    int nn = neighbours[v-1].size();
+	    int nn = neighbours.Count(v);
 	    
 	    //	    if (useDirichletBC)
 	    if (shrinkageType == 'p')
@@ -1629,6 +1821,9 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
     // Back to your regularly-scheduled voxelwise calculations
     for (int v = 1; v <= Nvoxels; v++)
       {
+	if (!blockOwned.empty() && !blockOwned[v-1])
+	  continue;
+
 	// some models may want extra information about the data
 	if (suppdata.Ncols() > 0) {
 	  model->pass_in_data(  data.Column(v) ,  suppdata.Column(v) );
@@ -1681,6 +1876,35 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
 
     // Moved shrinkage updates to the beginning!!
 
+    // Get the latest means for the halo from the neighbouring blocks
+    if (!blockOwned.empty())
+      BlockExchangeHalo(fwdPosteriorVox);
+
+    // Snapshot everything every so often.  Write it alongside the old one 
+    // and then swap it in, so there's always a whole iteration on disk.
+    iterationsDone++;
+    if (checkpointEvery > 0 && iterationsDone % checkpointEvery == 0)
+      {
+	Tracer_Plus tr("SpatialVariationalBayes::DoCalculations - checkpoint");
+	const string tmpName = CheckpointFilename() + ".tmp";
+	Checkpoint snapshot;
+	snapshot.Start(tmpName, Nvoxels, CheckpointLayout(), 1000);
+	for (int v = 1; v <= Nvoxels; v++)
+	  snapshot.AddVoxel(v, MVNDist(fwdPosteriorVox[v-1], 
+	    noiseVox[v-1]->OutputAsMVN()), resultFs.at(v-1));
+
+	vector<double> state(1, iterationsDone);
+	for (int k = 1; k <= Nparams; k++) state.push_back(delta(k));
+	for (int k = 1; k <= Nparams; k++) state.push_back(rho(k));
+	for (int k = 1; k <= Nparams; k++) state.push_back(akmean(k));
+	snapshot.AddExtra(state);
+	snapshot.Close();
+
+	if (rename(tmpName.c_str(), CheckpointFilename().c_str()) != 0)
+	  throw Runtime_error(("Couldn't replace checkpoint file " 
+			       + CheckpointFilename()).c_str());
+      }
+
     isFirstIteration = false;
     
     // next iteration:
@@ -1743,10 +1967,16 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
   //}
 
 
+  // Keep the hyperparameters, in case this is a coarse level of --multires
+  multiresDelta = delta;
+  multiresRho = rho;
+  multiresAkmean = akmean;
+
   for (int v = 1; v <= Nvoxels; v++)
     {
       resultMVNs[v-1] = new MVNDist(
         fwdPosteriorVox[v-1], noiseVox[v-1]->OutputAsMVN() );
+      KeepModelFit(v, linearVox[v-1], fwdPosteriorVox[v-1].means);
 
       if (alsoSaveWithoutPrior)
 	{
@@ -1810,45 +2040,309 @@ Tracer tr("SpatialVariationalBayes::DoCalculations - delta updates");
     }
 }
 
-// Binary search for data(index) == num
-// Assumes data is sorted ascending!!
-// Either returns an index such that data(index) == num
-//   or -1 if num is not present in data. 
-inline int binarySearch(const ColumnVector& data, int num)
+// Messages between each block's process and the parent.  Every block 
+// runs the same sequence of iterations, so the parent just waits until all
+// blocks have sent the same kind of message, and then answers them.
+enum { blockSum = 1, blockHalo, blockDone, blockFailed };
+
+static void SendBlockMessage(int fd, int tag, const vector<double>& payload)
 {
-  int first = 1, last = data.Nrows();
+  const int n = payload.size();
+  if (!WriteFully(fd, &tag, sizeof(tag)) || !WriteFully(fd, &n, sizeof(n))
+      || (n > 0 && !WriteFully(fd, &payload[0], n*sizeof(double))))
+    throw Runtime_error("Lost contact with another spatial block process");
+}
 
-  while (first <= last)
-    {
-      int test = (first+last)/2;
-
-      if (data(test) < num)
-	first = test + 1;
-      else if (data(test) > num)
-	last = test - 1;
-      else if (data(test) == num)
-	return test;
-      else
-	assert(false); // logic error!  data wasn't sorted?
-    }
-  return -1;
+static int ReceiveBlockMessage(int fd, vector<double>& payload)
+{
+  int tag, n;
+  if (!ReadFully(fd, &tag, sizeof(tag)) || !ReadFully(fd, &n, sizeof(n)) || n < 0)
+    throw Runtime_error("Lost contact with another spatial block process");
+  payload.resize(n);
+  if (n > 0 && !ReadFully(fd, &payload[0], n*sizeof(double)))
+    throw Runtime_error("Lost contact with another spatial block process");
+  return tag;
 }
 
-bool IsCoordMatrixCorrectlyOrdered(const Matrix& voxelCoords)
+// Replace each value by its sum over all blocks
+void SpatialVariationalBayes::BlockSumAll(vector<double>& values) const
 {
-    assert(voxelCoords.Nrows()==3);
-    const int nVoxels = voxelCoords.Ncols();
-    for (int v = 1; v <= nVoxels-1; v++)
+  Tracer_Plus tr("SpatialVariationalBayes::BlockSumAll");
+  SendBlockMessage(blockToHub, blockSum, values);
+  if (ReceiveBlockMessage(blockFromHub, values) != blockSum)
+    throw Logic_error("Unexpected reply from spatial block hub");
+}
+
+void SpatialVariationalBayes::BlockExchangeHalo(vector<MVNDist>& fwdPosteriorVox) const
+{
+  Tracer_Plus tr("SpatialVariationalBayes::BlockExchangeHalo");
+  const int Nparams = model->NumParams();
+
+  vector<double> means;
+  means.reserve(blockSendVoxels.size() * Nparams);
+  for (unsigned i = 0; i < blockSendVoxels.size(); i++)
+    for (int k = 1; k <= Nparams; k++)
+      means.push_back(fwdPosteriorVox.at(blockSendVoxels[i]-1).means(k));
+  SendBlockMessage(blockToHub, blockHalo, means);
+
+  if (ReceiveBlockMessage(blockFromHub, means) != blockHalo
+      || means.size() != blockHaloVoxels.size() * Nparams)
+    throw Logic_error("Unexpected reply from spatial block hub");
+  for (unsigned i = 0; i < blockHaloVoxels.size(); i++)
+    for (int k = 1; k <= Nparams; k++)
+      fwdPosteriorVox.at(blockHaloVoxels[i]-1).means(k) = means[i*Nparams + k-1];
+}
+
+// Split the volume into slabs along z and solve each one in a separate 
+// process, with a halo of two slices (enough for neighbours-of-neighbours)
+// borrowed from the slabs on either side.  The halo means are refreshed at
+// the end of every iteration, so unlike the serial code the voxels next to
+// a slab boundary see their neighbours' means from the previous iteration.
+// Returns false if the volume can't be split, in which case the caller 
+// should just carry on in the usual way.
+bool SpatialVariationalBayes::DoBlockCalculations(const DataSet& allData)
+{
+  Tracer_Plus tr("SpatialVariationalBayes::DoBlockCalculations");
+  const Matrix& coords = allData.GetVoxelCoords();
+  const int Nvoxels = allData.GetVoxelData().Ncols();
+  const int Nparams = model->NumParams();
+
+  if (spatialPriorsTypes.find_first_not_of("NAmMpP") != string::npos)
+    throw Invalid_option("--spatial-blocks only supports N, A, m, M, p and P priors");
+  if (useEvidenceOptimization || multiresLevels > 1 
+      || continueFromFile != "" || lockedLinearFile != "")
+    throw Invalid_option("--spatial-blocks can't be used with evidence optimization, --multires, --continue-from-mvn or --locked-linear-from-mvn");
+  if (coords.Ncols() != Nvoxels)
+    throw Invalid_option("--spatial-blocks needs voxel coordinates");
+
+  // Slab boundaries: roughly equal numbers of voxels, whole slices only
+  vector<int> firstOwned, lastOwned;
+  for (int v = 1; v <= Nvoxels; v++)
+    {
+      if (v > 1 && coords(3,v) < coords(3,v-1))
+	throw Invalid_option("--spatial-blocks needs voxels ordered by slice");
+      const bool newSlice = (v == 1 || coords(3,v) != coords(3,v-1));
+      if (v == 1 || (newSlice && 
+	  (v-1) >= double(Nvoxels) * firstOwned.size() / spatialBlocks))
+	{
+	  if (v > 1) lastOwned.push_back(v-1);
+	  firstOwned.push_back(v);
+	}
+    }
+  lastOwned.push_back(Nvoxels);
+  const int Nblocks = firstOwned.size();
+
+  if (Nblocks < 2)
+    {
+      Warning::IssueOnce("--spatial-blocks: not enough slices to split the volume");
+      return false;
+    }
+
+  // Each slab's voxel range including the halo, and which voxels in the 
+  // halos need to be sent from their owners.
+  const int haloSlices = (spatialDims >= 3) ? 2 : 0;
+  vector<int> firstLocal(Nblocks), lastLocal(Nblocks);
+  vector<bool> inSomeHalo(Nvoxels, false);
+  for (int b = 0; b < Nblocks; b++)
+    {
+      const double zLow = coords(3, firstOwned[b]) - haloSlices;
+      const double zHigh = coords(3, lastOwned[b]) + haloSlices;
+      firstLocal[b] = firstOwned[b];
+      while (firstLocal[b] > 1 && coords(3, firstLocal[b]-1) >= zLow)
+	firstLocal[b]--;
+      lastLocal[b] = lastOwned[b];
+      while (lastLocal[b] < Nvoxels && coords(3, lastLocal[b]+1) <= zHigh)
+	lastLocal[b]++;
+      for (int v = firstLocal[b]; v <= lastLocal[b]; v++)
+	if (v < firstOwned[b] || v > lastOwned[b])
+	  inSomeHalo[v-1] = true;
+    }
+
+  LOG_ERR("Splitting " << Nvoxels << " voxels into " << Nblocks 
+	  << " slabs along z, each solved by a separate process" << endl);
+
+  cout.flush();
+  if (EasyLog::LogStarted())
+    LOG.flush();
+  void (*oldSigpipe)(int) = signal(SIGPIPE, SIG_IGN); // errors are handled instead
+
+  vector<int> toBlock(Nblocks, -1), fromBlock(Nblocks, -1);
+  vector<pid_t> pids(Nblocks, -1);
+  for (int b = 0; b < Nblocks; b++)
     {
-	ColumnVector diff = voxelCoords.Column(v+1) - voxelCoords.Column(v);
-	int d = sign(diff(1)) + 10*sign(diff(2)) + 100*sign(diff(3)); // +1 = +x, +10 = +y, +100 = +z, -99 = -z+x, etc.
-        if (d<=0) 
+      int down[2], up[2];
+      if (pipe(down) != 0 || pipe(up) != 0)
+	throw Runtime_error("Couldn't create pipes for --spatial-blocks");
+      pids[b] = fork();
+      if (pids[b] < 0)
+	throw Runtime_error("Couldn't start a process for --spatial-blocks");
+
+      if (pids[b] == 0)
 	{
-	    LOG << "Found mis-ordered voxels " << v << " and " << v+1 << ": d=" << d << endl;
-	    return false;
+	  // Block process: set up the local problem and run it as usual
+	  close(down[1]); close(up[0]);
+	  for (int c = 0; c < b; c++) 
+	    { close(toBlock[c]); close(fromBlock[c]); }
+	  signal(SIGPIPE, oldSigpipe);
+	  blockFromHub = down[0];
+	  blockToHub = up[1];
+
+	  int status = 0;
+	  try
+	    {
+	      const int offset = firstLocal[b] - 1; // global id = local + offset
+	      DataSet blockData;
+	      allData.SubsetVoxels(blockData, firstLocal[b], lastLocal[b]);
+	      blockOwned.assign(lastLocal[b] - offset, false);
+	      for (int v = firstOwned[b]; v <= lastOwned[b]; v++)
+		{
+		  blockOwned[v-offset-1] = true;
+		  if (inSomeHalo[v-1])
+		    blockSendVoxels.push_back(v-offset);
+		}
+	      for (int v = firstLocal[b]; v <= lastLocal[b]; v++)
+		if (v < firstOwned[b] || v > lastOwned[b])
+		  blockHaloVoxels.push_back(v-offset);
+
+	      DoCalculations(blockData);
+
+	      // Send back the results for our own voxels
+	      const int len = resultMVNs.at(0)->GetSize();
+	      vector<double> packed;
+	      packed.push_back(len);
+	      packed.push_back(resultFs.empty() ? 0 : 1);
+	      for (int v = firstOwned[b]; v <= lastOwned[b]; v++)
+		{
+		  const MVNDist& mvn = *resultMVNs[v-offset-1];
+		  const SymmetricMatrix& cov = mvn.GetCovariance();
+		  for (int i = 1; i <= len; i++)
+		    packed.push_back(mvn.means(i));
+		  for (int i = 1; i <= len; i++)
+		    for (int j = 1; j <= i; j++)
+		      packed.push_back(cov(i,j));
+		  if (!resultFs.empty())
+		    packed.push_back(resultFs[v-offset-1]);
+		}
+	      SendBlockMessage(blockToHub, blockDone, packed);
+	    }
+	  catch (...)
+	    {
+	      LOG_ERR("Exception in spatial block " << b+1 << endl);
+	      status = 1;
+	      try { SendBlockMessage(blockToHub, blockFailed, vector<double>()); }
+	      catch (...) { }
+	    }
+	  cout.flush();
+	  if (EasyLog::LogStarted())
+	    LOG.flush();
+	  _exit(status);
 	}
+
+      close(down[0]); close(up[1]);
+      toBlock[b] = down[1];
+      fromBlock[b] = up[0];
     }
-    return true;
+
+  // Hub: relay between the blocks until they've all finished
+  bool failed = false;
+  try
+    {
+      Matrix means(Nparams, Nvoxels);
+      vector<vector<double> > msgs(Nblocks);
+      while (true)
+	{
+	  int tag = -1;
+	  for (int b = 0; b < Nblocks; b++)
+	    {
+	      const int t = ReceiveBlockMessage(fromBlock[b], msgs[b]);
+	      if (t == blockFailed || (b > 0 && t != tag))
+		throw Runtime_error("A --spatial-blocks process failed (see logfile)");
+	      tag = t;
+	    }
+
+	  if (tag == blockSum)
+	    {
+	      vector<double> sums(msgs[0].size(), 0.0);
+	      for (int b = 0; b < Nblocks; b++)
+		for (unsigned i = 0; i < sums.size(); i++)
+		  sums[i] += msgs[b].at(i);
+	      for (int b = 0; b < Nblocks; b++)
+		SendBlockMessage(toBlock[b], blockSum, sums);
+	    }
+	  else if (tag == blockHalo)
+	    {
+	      for (int b = 0; b < Nblocks; b++)
+		{
+		  int i = 0;
+		  for (int v = firstOwned[b]; v <= lastOwned[b]; v++)
+		    if (inSomeHalo[v-1])
+		      {
+			for (int k = 1; k <= Nparams; k++)
+			  means(k,v) = msgs[b].at(i++);
+		      }
+		}
+	      for (int b = 0; b < Nblocks; b++)
+		{
+		  vector<double> halo;
+		  for (int v = firstLocal[b]; v <= lastLocal[b]; v++)
+		    if (v < firstOwned[b] || v > lastOwned[b])
+		      for (int k = 1; k <= Nparams; k++)
+			halo.push_back(means(k,v));
+		  SendBlockMessage(toBlock[b], blockHalo, halo);
+		}
+	    }
+	  else if (tag == blockDone)
+	    {
+	      const int len = int(msgs[0].at(0));
+	      const bool haveF = (msgs[0].at(1) != 0);
+	      resultMVNs.resize(Nvoxels, NULL);
+	      resultModelFitValid.assign(Nvoxels, false); // not sent back
+	      if (haveF)
+		resultFs.resize(Nvoxels, 9999);
+	      for (int b = 0; b < Nblocks; b++)
+		{
+		  unsigned i = 2;
+		  for (int v = firstOwned[b]; v <= lastOwned[b]; v++)
+		    {
+		      MVNDist* mvn = new MVNDist(len);
+		      SymmetricMatrix cov(len);
+		      for (int r = 1; r <= len; r++)
+			mvn->means(r) = msgs[b].at(i++);
+		      for (int r = 1; r <= len; r++)
+			for (int c = 1; c <= r; c++)
+			  cov(r,c) = msgs[b].at(i++);
+		      mvn->SetCovariance(cov);
+		      resultMVNs[v-1] = mvn;
+		      if (haveF)
+			resultFs[v-1] = msgs[b].at(i++);
+		    }
+		}
+	      break;
+	    }
+	  else
+	    throw Logic_error("Unknown message from a --spatial-blocks process");
+	}
+    }
+  catch (...)
+    {
+      failed = true;
+    }
+
+  for (int b = 0; b < Nblocks; b++)
+    {
+      close(toBlock[b]);
+      close(fromBlock[b]);
+      int status;
+      waitpid(pids[b], &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	failed = true;
+    }
+  signal(SIGPIPE, oldSigpipe);
+
+  if (failed)
+    throw Runtime_error("A --spatial-blocks process failed (see logfile)");
+
+  return true;
 }
 
 void SpatialVariationalBayes::CalcNeighbours(const Matrix& voxelCoords)
@@ -1858,28 +2352,28 @@ void SpatialVariationalBayes::CalcNeighbours(const Matrix& voxelCoords)
     // that they're integers!
 
     const int nVoxels = voxelCoords.Ncols();
-    if (nVoxels < 2) return;
-    if (!IsCoordMatrixCorrectlyOrdered(voxelCoords))
-	throw Invalid_option("Coordinate matrix must be in correct order to use adjacency-based priors.");
-
-#ifdef __FABBER_LIBRARYONLY
-    throw Logic_error("CalcNeighbours currently requires NEWIMAGE to be compiled in.");
-#else
-    volume<float> mask(voxelCoords.Row(1).Maximum()+1, voxelCoords.Row(2).Maximum()+1, voxelCoords.Row(3).Maximum()+1); 
-    mask = 0.0; 
-    for (int v=1; v<=nVoxels; v++)
-    {
-	float& maskVox = mask( voxelCoords(1,v), voxelCoords(2,v), voxelCoords(3,v) );
-	assert(maskVox == 0);
-	maskVox = v;
-    }
+    if (nVoxels < 2)
+      {
+	// No neighbours, but don't keep the lists from an earlier call
+	neighbours.Clear();
+	neighbours2.Clear();
+	for (int v = 1; v <= nVoxels; v++)
+	  {
+	    neighbours.EndVoxel();
+	    neighbours2.EndVoxel();
+	  }
+	return;
+      }
 
-    // Essential thing: threshold the mask!
-    mask.binarise(1e-16,mask.max()+1,exclusive);
+    const int dims[3] = { int(voxelCoords.Row(1).Maximum())+1, 
+			  int(voxelCoords.Row(2).Maximum())+1, 
+			  int(voxelCoords.Row(3).Maximum())+1 };
+    vector<int> positions(nVoxels);
+    for (int v = 1; v <= nVoxels; v++)
+	positions[v-1] = int(voxelCoords(1,v)) 
+	    + dims[0]*(int(voxelCoords(2,v)) + dims[1]*int(voxelCoords(3,v)));
 
-    // Okay, now we've built up a close-enough mask matrix, pass the buck to the old version:
-    CalcNeighbours(mask);
-#endif // __FABBER_LIBRARYONLY
+    CalcNeighbours(positions, dims);
 }
 
 #ifndef __FABBER_LIBRARYONLY
@@ -1887,95 +2381,73 @@ void SpatialVariationalBayes::CalcNeighbours(const volume<float>& mask)
 {
   Tracer_Plus tr("SpatialVariationalBayes::CalcNeighbours");
 
-  ColumnVector preThresh((int)mask.sum());
-  const int nVoxels = preThresh.Nrows();
-
-  assert(nVoxels > 0); // Probably because mask is empty, logic error
-
-  int offset(0);
-  int count(1);
+  // Voxels are numbered in the same order as volume4D::matrix(mask) uses
+  vector<int> positions;
+  int offset = 0;
   for(int z=0;z<mask.zsize();z++)
     for(int y=0;y<mask.ysize();y++)     
       for(int x=0;x<mask.xsize();x++)
       {
 	if (mask(x,y,z)!=0) 
-	  preThresh(count++)=offset;
+	  positions.push_back(offset);
 	offset++;
       }
 
-  vector<int> delta;
-  if (spatialDims >= 1)
-  { 
-    delta.push_back(1); // next row
-    delta.push_back(-1); // prev row
-  }
-  if (spatialDims >= 2)
-  {
-    delta.push_back(mask.xsize()); // next column
-    delta.push_back(-mask.xsize()); // prev column
-  }
-  if (spatialDims >= 3)
-  {
-    delta.push_back(mask.xsize()*mask.ysize()); // next slice
-    delta.push_back(-mask.xsize()*mask.ysize()); // prev slice
-  }
+  assert(positions.size() > 0); // Probably because mask is empty, logic error
 
-  /* Tedious output and I'm pretty sure this is working correctly.  
-  LOG << "Using offsets of " << delta 
-      << "\nNote these have not been checked!\n"
-      << "Also note that they may wrap around if both edges are in mask\n";
-  */
-  
-  neighbours.resize(nVoxels);
-  
-  for(int vid = 1; vid <= nVoxels; vid++) // voxel id
+  const int dims[3] = { mask.xsize(), mask.ysize(), mask.zsize() };
+  CalcNeighbours(positions, dims);
+}
+#endif //__FABBER_LIBRARYONLY
+
+// positions[v-1] is the offset of voxel v into a dims[0] x dims[1] x dims[2]
+// volume (x changing fastest).  Neighbours are found by looking up an index
+// volume, so this is a couple of linear passes over the voxels.
+void SpatialVariationalBayes::CalcNeighbours(const vector<int>& positions, const int dims[3])
+{
+  Tracer_Plus tr("SpatialVariationalBayes::CalcNeighbours from positions");
+  const int nVoxels = positions.size();
+
+  // Voxel id (from 1) at each position, or 0 if not in the mask
+  vector<int> index(dims[0]*dims[1]*dims[2], 0);
+  for (int v = 1; v <= nVoxels; v++)
     {
-      int pos = int(preThresh(vid));
+      assert(index.at(positions[v-1]) == 0);
+      index[positions[v-1]] = v;
+    }
 
-      for (unsigned n = 0; n < delta.size(); n++) // neighbour-search number
-	{
-	  
-	  // is there a voxel at this neighbour position?
-	  int id = binarySearch(preThresh, pos + delta[n]);
-	  // indexed from 1; id == -1 if not found.
-	  
-	  // No such voxel: continue
-	  if (id < 0)
-	    continue;
-
-	  // Check for wrap-around
-	  if ( (delta.size() > n+2) &&
-	       (
-		( (delta[n]>0) && (pos %  delta[n+2] == 0) ) ||
-		( (delta[n]<0) && (pos % -delta[n+2] == 1) ) ) 
-	       )
-	    {
-	      /* Tedious, and I never looked at it anyway.
-	      LOG_ERR("Note: avoiding wrap-around from position "
-		      << pos << " to " << pos + delta[n] << endl);
-	      */
-	      continue;
-	    }
+  const int stride[3] = { 1, dims[0], dims[0]*dims[1] };
 
-	  // If we get this far, add it to the list
-	  neighbours.at(vid-1).push_back(id);
+  neighbours.Clear(); // may be called again at a different resolution
+  for (int vid = 1; vid <= nVoxels; vid++)
+    {
+      const int pos = positions[vid-1];
+      const int xyz[3] = { pos % dims[0], (pos / dims[0]) % dims[1], 
+			   pos / stride[2] };
+
+      // next & previous row, column, slice; never wraps around an edge
+      for (int dim = 0; dim < spatialDims; dim++)
+	{
+	  if (xyz[dim] + 1 < dims[dim] && index[pos + stride[dim]] > 0)
+	    neighbours.Add(index[pos + stride[dim]]);
+	  if (xyz[dim] > 0 && index[pos - stride[dim]] > 0)
+	    neighbours.Add(index[pos - stride[dim]]);
 	}
+      neighbours.EndVoxel();
     }
   
   // Neighbours-of-neighbours, excluding self, and duplicated if there 
   // are two routes to get there (diagonally connected)
-  neighbours2.resize(nVoxels);
+  neighbours2.Clear();
   for(int vid = 1; vid <= nVoxels; vid++)
     {
-      for (unsigned n1 = 0; n1 < neighbours.at(vid-1).size(); n1++)
+      for (const int* n1 = neighbours.Begin(vid); n1 != neighbours.End(vid); n1++)
 	{
-	  int n1id = neighbours[vid-1].at(n1);
 	  int checkNofN = 0;
-	  for (unsigned n2 = 0; n2 < neighbours.at(n1id-1).size(); n2++)
+	  for (const int* n2 = neighbours.Begin(*n1); n2 != neighbours.End(*n1); n2++)
 	    {
-	      int n2id = neighbours[n1id-1].at(n2);
-	      if (n2id != vid)
-		neighbours2[vid-1].push_back(n2id);
+	      if (*n2 != vid)
+		neighbours2.Add(*n2);
 	      else
 		checkNofN++;
 	    }
@@ -1983,16 +2455,9 @@ void SpatialVariationalBayes::CalcNeighbours(const volume<float>& mask)
 	  // Each of this voxel's neighbours must have this voxel 
 	  // as a neighbour.
 	}
+      neighbours2.EndVoxel();
     }    
-
-  /* Tedious, and I never looked at it anyway.
-  LOG << "Neighbours are (for dims==" << spatialDims << ")\n";
-  for (int v = 1; v <= nVoxels; v++)
-    LOG << v << ": " << neighbours.at(v-1) 
-	<< "-" << neighbours2.at(v-1) << endl;
-  */
 }
-#endif //__FABBER_LIBRARYONLY
 
 #if defined(__FABBER_LIBRARYONLY_TESTWITHNEWIMAGE) || !defined(__FABBER_LIBRARYONLY)
 // Helper function, also used in fabber_library's test main()
@@ -2087,6 +2552,25 @@ void CovarianceCache::CalcDistances(const NEWMAT::Matrix& voxelCoords, const str
     positions[2] = voxelCoords.Row(3).t();
     const int nVoxels = positions[0].Nrows();
     const double dimSize[3] = {1.0, 1.0, 1.0};  // dimSize is already included in voxelCoords
+
+    // Any cached matrices belong to the old distances
+    Cinv_cache.clear(); Cinv_lastUsed.clear();
+    CiCodistCi_cache.clear(); CiCodistCi_lastUsed.clear();
+
+    // FNV-1a hash of the coordinates, used to key the on-disk cache
+    this->distanceMeasure = distanceMeasure;
+    maskHash = 14695981039346656037ULL;
+    for (int v = 1; v <= nVoxels; v++)
+      for (int dim = 0; dim < 3; dim++)
+	{
+	  const double pos = positions[dim](v);
+	  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&pos);
+	  for (unsigned b = 0; b < sizeof(double); b++)
+	    {
+	      maskHash ^= bytes[b];
+	      maskHash *= 1099511628211ULL;
+	    }
+	}
     
     if (nVoxels > 7500)
       LOG_SAFE_ELSE_CERR("WARNING: Over " << int(2.5*nVoxels*nVoxels*8/1e9) 
@@ -2159,7 +2643,6 @@ void CovarianceCache::CalcDistances(const NEWMAT::Matrix& voxelCoords, const str
     
 }
 
-#include "tools.h"
 
 // /*
 class DerivFdRho : public GenericFunction1D
@@ -2568,6 +3051,103 @@ double DerivFdDelta::Calculate(const double delta) const
     return out;
 }
 
+// Dimensionless per-voxel quantities for parameter k, as used by 
+// OptimizeSmoothingScale
+void SpatialVariationalBayes::CalcSmoothingRatios(int k,
+  const vector<MVNDist>& fwdPosteriorVox,
+  DiagonalMatrix& covRatio, ColumnVector& meanDiffRatio) const
+{
+  const int Nvoxels = fwdPosteriorVox.size();
+  covRatio.ReSize(Nvoxels);
+  meanDiffRatio.ReSize(Nvoxels);
+  const double priorCov = initialFwdPrior->GetCovariance()(k,k);
+  const double priorCovSqrt = sqrt(priorCov);
+  const double priorMean = initialFwdPrior->means(k);
+
+  for (int v = 1; v <= Nvoxels; v++)
+    {
+      // Isolate just the dimensionless quantities we need
+
+      // Penny:
+      covRatio(v,v) = fwdPosteriorVox.at(v-1).GetCovariance()(k,k)
+	/ priorCov;
+      // Hacky:
+      //LOG_ERR("WARNING: Using hacky covRatio calculation (precision rather than covariance!\n!");
+      //              covRatio(v,v) = 1 / fwdPosteriorVox.at(v-1).GetPrecisions()(k,k) / priorCov;
+
+      meanDiffRatio(v) = (fwdPosteriorVox.at(v-1).means(k) - priorMean)
+	/ priorCovSqrt;
+    }
+}
+
+// New delta (and rho, for R) for parameter k, starting from deltaK/rhoK
+void SpatialVariationalBayes::UpdateSmoothingScale(int k, char type,
+  const DiagonalMatrix& covRatio, const ColumnVector& meanDiffRatio,
+  const vector<MVNDist*>& fwdPosteriorWithoutPrior,
+  double& deltaK, double& rhoK) const
+{
+  Tracer_Plus tr("SpatialVariationalBayes::UpdateSmoothingScale");
+  if (type == 'R')
+    {
+      if (alwaysInitialDeltaGuess>0) deltaK = alwaysInitialDeltaGuess;
+      if (useEvidenceOptimization)
+	{
+	  Warning::IssueAlways("Using R... mistake??");
+	  deltaK = OptimizeEvidence(fwdPosteriorWithoutPrior, k, initialFwdPrior, deltaK, true, &rhoK);
+	  LOG_ERR("\nSpatialPrior " << k << " type R eo : " << deltaK << " " << rhoK << " 0\n");
+	}
+      else
+	{
+	  Warning::IssueAlways("Using R without EO... mistake??");
+	  // Spatial priors with rho & delta
+	  deltaK = OptimizeSmoothingScale( covRatio, meanDiffRatio,
+					     deltaK, &rhoK, true);
+	  LOG_ERR("\nSpatialPrior " << k << " type R vb : " << deltaK << " " << rhoK << " 0\n");
+	}
+    }
+  else if (type == 'D')
+    {
+      if (alwaysInitialDeltaGuess>0) deltaK = alwaysInitialDeltaGuess;
+
+      // Spatial priors with only delta
+      if (useEvidenceOptimization)
+	{
+	  deltaK = OptimizeEvidence(fwdPosteriorWithoutPrior, k, initialFwdPrior, deltaK);
+	  LOG_ERR("\nSpatialPrior " << k << " type D eo : " << deltaK << " 0 0\n");
+	}
+      else
+	{
+	  Warning::IssueAlways("Using D without EO... mistake??");
+	  deltaK = OptimizeSmoothingScale( covRatio, meanDiffRatio,
+					     deltaK, &rhoK, false );
+	  LOG_ERR("\nSpatialPrior " << k << " type D vb : " << deltaK << " 0 0\n");
+	}
+    }
+}
+
+void SmoothingScaleTasks::RunTask(int task, vector<double>& results) const
+{
+  const int k = ks.at(task);
+  DiagonalMatrix covRatio;
+  ColumnVector meanDiffRatio;
+  svb.CalcSmoothingRatios(k, fwdPosteriorVox, covRatio, meanDiffRatio);
+
+  double deltaK = delta(k);
+  double rhoK = rho(k);
+  svb.UpdateSmoothingScale(k, svb.spatialPriorsTypes[k-1], covRatio, meanDiffRatio,
+			   fwdPosteriorWithoutPrior, deltaK, rhoK);
+  results.resize(2);
+  results[0] = deltaK;
+  results[1] = rhoK;
+
+  if (deltaK >= 0)
+    {
+      // Usually a cache hit, since the search has just evaluated it
+      const SymmetricMatrix& Cinv = svb.covar.GetCinv(deltaK);
+      results.insert(results.end(), Cinv.Store(), Cinv.Store() + Cinv.Storage());
+    }
+}
+
 double SpatialVariationalBayes::OptimizeEvidence(
   // const vector<MVNDist>& fwdPriorVox, // used for parameters other than k
   const vector<MVNDist*>& fwdPosteriorWithoutPrior, // used for parameter k
@@ -2739,54 +3319,54 @@ bool CovarianceCache::GetCachedInRange(double* guess, double lower, double upper
 const SymmetricMatrix& CovarianceCache::GetCinv(double delta) const
 {
   Tracer_Plus tr("CovarianceCache::GetCinv");
-  if (Cinv_cache[delta].Nrows() == 0)
-    {
-
-#ifdef NOCACHE
-	Warning::IssueOnce("Cache is disabled to avoid memory problems!");
-	Cinv_cache.clear();
-#endif
+  Cinv_lastUsed[delta] = ++useCounter;
 
+  Cinv_cache_type::iterator it = Cinv_cache.find(delta);
+  if (it == Cinv_cache.end())
+    {
+      // Make room first, so we never hold more than the budget plus one matrix
+      EnforceCacheBudget(delta);
+      SymmetricMatrix& Cinv = Cinv_cache[delta];
 
-      //      cout << "[" << flush;
-      //      cout << "GetCinv cache miss... " << flush;
-      //      const int Nvoxels = distances.Nrows();
-      //      SymmetricMatrix C(Nvoxels);
-      //      for (int a = 1; a <= Nvoxels; a++)
-      //	for (int b = 1; b <= a; b++)
-      //	  C(a,b) = exp(-0.5*distances(a,b)/delta);
-      //      Cinv_cache[delta] = C.i();
-      Cinv_cache[delta] = GetC(delta).i();
-      //      cout << "done." << endl;
-      //      cout << "]" << flush;
+      if (!LoadFromDisk("Cinv", delta, Cinv))
+	{
+	  Cinv = GetC(delta).i();
+	  SaveToDisk("Cinv", delta, Cinv);
+	}
+      return Cinv;
     }
   else
     {
       //      cout << "GetCinv cache hit!\n";
     }
 
-  return Cinv_cache[delta];
+  return it->second;
 }
 
 const SymmetricMatrix& CovarianceCache::GetCiCodistCi(double delta, 
 		double* CiCodistTrace) const
 {
-  if (CiCodistCi_cache[delta].first.Nrows() == 0)
+  CiCodistCi_lastUsed[delta] = ++useCounter;
+
+  CiCodistCi_cache_type::iterator it = CiCodistCi_cache.find(delta);
+  if (it == CiCodistCi_cache.end())
     {
-#ifdef NOCACHE
-	CiCodistCi_cache.clear();
-#endif
+      EnforceCacheBudget(delta);
+      pair<SymmetricMatrix,double>& entry = CiCodistCi_cache[delta];
+
+      if (!LoadFromDisk("CiCodistCi", delta, entry.first, &entry.second))
+	{
       //      cout << "{" << flush;
-      GetCinv(delta); // for sensible messages, make sure cache hits
+      const SymmetricMatrix& Cinv = GetCinv(delta); // for sensible messages, make sure cache hits
       //cout << "GetCiCodistCi cache miss... " << flush;
-      Matrix CiCodist = GetCinv(delta) * SP(GetC(delta), distances);
-      CiCodistCi_cache[delta].second = CiCodist.Trace();
-      Matrix CiCodistCi_tmp = CiCodist*GetCinv(delta);
-      CiCodistCi_cache[delta].first << CiCodistCi_tmp; // Force symmetric
+      Matrix CiCodist = Cinv * SP(GetC(delta), distances);
+      entry.second = CiCodist.Trace();
+      Matrix CiCodistCi_tmp = CiCodist*Cinv;
+      entry.first << CiCodistCi_tmp; // Force symmetric
     
       { // check something
 	double maxAbsErr = 
-	  (CiCodistCi_cache[delta].first - CiCodistCi_tmp).MaximumAbsoluteValue();
+	  (entry.first - CiCodistCi_tmp).MaximumAbsoluteValue();
 	if (maxAbsErr > CiCodistCi_tmp.MaximumAbsoluteValue() * 1e-5 )
 	  // If that test fails, you're probably in trouble.
 	  // Reducing it to e.g. 1e-5 (to make dist2 work) 
@@ -2802,11 +3382,159 @@ const SymmetricMatrix& CovarianceCache::GetCiCodistCi(double delta,
 	    assert(false);
 	  }
       }      
+      SaveToDisk("CiCodistCi", delta, entry.first, entry.second);
       //      cout << "}" << flush;
+	}
+      it = CiCodistCi_cache.find(delta);
     }
 
   if (CiCodistTrace != NULL) 
-    (*CiCodistTrace) = CiCodistCi_cache[delta].second;
-  return CiCodistCi_cache[delta].first;
+    (*CiCodistTrace) = it->second.second;
+  return it->second.first;
+}
+
+void CovarianceCache::SetCachePolicy(double budgetMB, const string& diskDir)
+{
+  if (budgetMB < 0)
+    throw Invalid_option("--covariance-cache-mb must not be negative");
+  cacheBudgetBytes = budgetMB * 1024 * 1024;
+  cacheDir = diskDir;
+  if (cacheDir != "")
+    LOG << "Caching C^-1 factorisations in directory '" << cacheDir << "'" << endl;
+}
+
+// Drop least-recently-used matrices until there is room for one more.
+// Entries for keepDelta are never dropped, since the caller may still be
+// holding a reference to one of them.
+void CovarianceCache::AddCinv(double delta, const SymmetricMatrix& Cinv) const
+{
+  Tracer_Plus tr("CovarianceCache::AddCinv");
+  Cinv_lastUsed[delta] = ++useCounter;
+
+  if (Cinv_cache.find(delta) == Cinv_cache.end())
+    {
+      EnforceCacheBudget(delta);
+      Cinv_cache[delta] = Cinv;
+    }
+}
+
+void CovarianceCache::EnforceCacheBudget(double keepDelta) const
+{
+  const int Nvoxels = distances.Nrows();
+  const double bytesPerMatrix = 8.0 * Nvoxels * (Nvoxels + 1) / 2;
+
+  while (bytesPerMatrix * (Cinv_cache.size() + CiCodistCi_cache.size() + 1) 
+	 > cacheBudgetBytes)
+    {
+      bool oldestIsCinv = false;
+      double oldestDelta = keepDelta;
+      unsigned long oldestUse = useCounter + 1;
+      for (Cinv_cache_type::const_iterator it = Cinv_cache.begin();
+	   it != Cinv_cache.end(); it++)
+	if (it->first != keepDelta && Cinv_lastUsed[it->first] < oldestUse)
+	  {
+	    oldestUse = Cinv_lastUsed[it->first];
+	    oldestDelta = it->first;
+	    oldestIsCinv = true;
+	  }
+      for (CiCodistCi_cache_type::const_iterator it = CiCodistCi_cache.begin();
+	   it != CiCodistCi_cache.end(); it++)
+	if (it->first != keepDelta && CiCodistCi_lastUsed[it->first] < oldestUse)
+	  {
+	    oldestUse = CiCodistCi_lastUsed[it->first];
+	    oldestDelta = it->first;
+	    oldestIsCinv = false;
+	  }
+
+      if (oldestUse > useCounter)
+	break; // only keepDelta entries are left
+
+      if (oldestIsCinv)
+	{
+	  Cinv_cache.erase(oldestDelta);
+	  Cinv_lastUsed.erase(oldestDelta);
+	}
+      else
+	{
+	  CiCodistCi_cache.erase(oldestDelta);
+	  CiCodistCi_lastUsed.erase(oldestDelta);
+	}
+    }
 }
 
+string CovarianceCache::CacheFilename(const string& what, double delta) const
+{
+  char key[128];
+  sprintf(key, "_%016llx_%.17g", (unsigned long long)maskHash, delta);
+  return cacheDir + "/" + what + "_" + distanceMeasure + key + ".bin";
+}
+
+// File layout: magic, Nvoxels, delta, trace, then the lower triangle in
+// NEWMAT's SymmetricMatrix storage order.
+static const char covCacheMagic[8] = "FABCOV1";
+
+bool CovarianceCache::LoadFromDisk(const string& what, double delta, 
+				   SymmetricMatrix& out, double* trace) const
+{
+  if (cacheDir == "")
+    return false;
+
+  Tracer_Plus tr("CovarianceCache::LoadFromDisk");
+  ifstream in(CacheFilename(what, delta).c_str(), ios::in | ios::binary);
+  if (!in.good())
+    return false;
+
+  char magic[8];
+  int N;
+  double fileDelta, fileTrace;
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&N), sizeof(N));
+  in.read(reinterpret_cast<char*>(&fileDelta), sizeof(fileDelta));
+  in.read(reinterpret_cast<char*>(&fileTrace), sizeof(fileTrace));
+  if (!in.good() || memcmp(magic, covCacheMagic, sizeof(magic)) != 0
+      || N != distances.Nrows() || fileDelta != delta)
+    {
+      Warning::IssueOnce("Ignoring mismatched covariance cache file(s) in " + cacheDir);
+      return false;
+    }
+
+  out.ReSize(N);
+  in.read(reinterpret_cast<char*>(out.Store()), sizeof(Real) * out.Storage());
+  if (!in.good())
+    {
+      Warning::IssueOnce("Ignoring truncated covariance cache file(s) in " + cacheDir);
+      out.ReSize(0);
+      return false;
+    }
+
+  if (trace != NULL)
+    *trace = fileTrace;
+  return true;
+}
+
+void CovarianceCache::SaveToDisk(const string& what, double delta, 
+				 const SymmetricMatrix& in, double trace) const
+{
+  if (cacheDir == "")
+    return;
+
+  Tracer_Plus tr("CovarianceCache::SaveToDisk");
+  // Write to a temporary name and rename, so concurrent runs sharing the
+  // directory never see a half-written file.
+  const string filename = CacheFilename(what, delta);
+  const string tmpname = filename + ".tmp" + stringify(getpid());
+  ofstream out(tmpname.c_str(), ios::out | ios::binary);
+  const int N = in.Nrows();
+  out.write(covCacheMagic, sizeof(covCacheMagic));
+  out.write(reinterpret_cast<const char*>(&N), sizeof(N));
+  out.write(reinterpret_cast<const char*>(&delta), sizeof(delta));
+  out.write(reinterpret_cast<const char*>(&trace), sizeof(trace));
+  out.write(reinterpret_cast<const char*>(in.Store()), sizeof(Real) * in.Storage());
+  out.close();
+
+  if (!out.good() || rename(tmpname.c_str(), filename.c_str()) != 0)
+    {
+      remove(tmpname.c_str());
+      Warning::IssueOnce("Couldn't write covariance cache file(s) in " + cacheDir);
+    }
+}
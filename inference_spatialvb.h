@@ -67,20 +67,31 @@
     innovation@isis.ox.ac.uk quoting reference DE/9564. */
 
 #include "inference_vb.h"
+#include <stdint.h>
 #ifndef __FABBER_LIBRARYONLY
 #include "newimage/newimageall.h"
 #endif //__FABBER_LIBRARYONLY
 
 class CovarianceCache {
  public:
+  CovarianceCache() : maskHash(0), cacheBudgetBytes(0), useCounter(0) { return; }
+
 #ifndef __FABBER_LIBRARYONLY
   void CalcDistances(const NEWIMAGE::volume<float>& mask, const string& distanceMeasure);
 #endif //__FABBER_LIBRARYONLY
   void CalcDistances(const NEWMAT::Matrix& voxelCoords, const string& distanceMeasure);
   const SymmetricMatrix& GetDistances() const { return distances; }
 
+  void SetCachePolicy(double budgetMB, const string& diskDir);
+  // Keep at most budgetMB of Cinv/CiCodistCi matrices in memory (least
+  // recently used are dropped first; the current delta is always kept).
+  // If diskDir is non-empty, factorisations are also saved there and 
+  // reused by later runs on the same mask, distance measure and delta.
+
   const ReturnMatrix GetC(double delta) const; // quick to calculate
   const SymmetricMatrix& GetCinv(double delta) const;
+  void AddCinv(double delta, const SymmetricMatrix& Cinv) const;
+  // Put a C^-1 worked out elsewhere (e.g. in a worker process) in the cache.
 
   //  const Matrix& GetCiCodist(double delta) const;
   const SymmetricMatrix& GetCiCodistCi(double delta, double* CiCodistTrace = NULL) const;
@@ -91,22 +102,57 @@ class CovarianceCache {
 
  private:
   SymmetricMatrix distances;
+  string distanceMeasure;
+  uint64_t maskHash; // of the voxel coordinates, for the on-disk cache keys
+
   typedef map<double, SymmetricMatrix> Cinv_cache_type;
   mutable Cinv_cache_type Cinv_cache; 
   
   typedef map<double, pair<SymmetricMatrix,double> > CiCodistCi_cache_type;
   //  mutable CiCodist_cache_type CiCodist_cache; // only really use the Trace
   mutable CiCodistCi_cache_type CiCodistCi_cache;
+
+  // LRU bookkeeping, shared between both caches
+  double cacheBudgetBytes;
+  string cacheDir;
+  mutable unsigned long useCounter;
+  mutable map<double, unsigned long> Cinv_lastUsed;
+  mutable map<double, unsigned long> CiCodistCi_lastUsed;
+  void EnforceCacheBudget(double keepDelta) const;
+
+  string CacheFilename(const string& what, double delta) const;
+  bool LoadFromDisk(const string& what, double delta, SymmetricMatrix& out, double* trace = NULL) const;
+  void SaveToDisk(const string& what, double delta, const SymmetricMatrix& in, double trace = 0) const;
 };
 
 
 
 
+// Voxel adjacency in compressed-row form: the neighbours of voxel v (ids
+// from 1) are Begin(v)..End(v)-1.  Built one voxel at a time: Add() each
+// neighbour of voxel 1, EndVoxel(), then the same for voxel 2, etc.
+class NeighbourList {
+ public:
+  NeighbourList() : offsets(1, 0) { return; }
+  void Clear() { offsets.assign(1, 0); ids.clear(); }
+  void Add(int id) { ids.push_back(id); }
+  void EndVoxel() { offsets.push_back(ids.size()); }
+
+  int NumVoxels() const { return offsets.size() - 1; }
+  int Count(int v) const { return offsets[v] - offsets[v-1]; }
+  const int* Begin(int v) const { return ids.empty() ? NULL : &ids[0] + offsets[v-1]; }
+  const int* End(int v) const { return ids.empty() ? NULL : &ids[0] + offsets[v]; }
+
+ private:
+  vector<int> offsets; // NumVoxels()+1 entries
+  vector<int> ids;
+};
+
 class SpatialVariationalBayes : public VariationalBayesInferenceTechnique {
 public:
     SpatialVariationalBayes() : 
         VariationalBayesInferenceTechnique(), 
-        spatialDims(-1) { return; }
+        spatialDims(-1), blockToHub(-1), blockFromHub(-1) { return; }
     virtual void Setup(ArgsType& args); // no changes needed
     virtual void DoCalculations(const DataSet& data);
 //    virtual ~SpatialVariationalBayes();
@@ -124,12 +170,13 @@ public:
 
     double maxPrecisionIncreasePerIteration; // Should be >1, or -1 = unlimited
 
-    vector<vector<int> > neighbours; // Sparse matrix would be easier
-    vector<vector<int> > neighbours2; // Sparse matrix would be easier
+    NeighbourList neighbours;
+    NeighbourList neighbours2; // duplicated if there are two routes there
 #ifndef __FABBER_LIBRARYONLY
     void CalcNeighbours(const NEWIMAGE::volume<float>& mask);
 #endif //__FABBER_LIBRARYONLY
     void CalcNeighbours(const Matrix& voxelCoords);
+    void CalcNeighbours(const vector<int>& positions, const int dims[3]);
 
     //vector<string> imagepriorstr; now inherited from spatialvb
     
@@ -156,6 +203,29 @@ public:
 
     bool bruteForceDeltaSearch;
 
+    // Coarse-to-fine solution: number of resolution levels (1 = off).
+    // Each coarser level is solved first and its results (posteriors, 
+    // delta, rho, akmean) initialise the next finer one.
+    int multiresLevels;
+    DiagonalMatrix multiresDelta;
+    DiagonalMatrix multiresRho;
+    DiagonalMatrix multiresAkmean;
+
+    // Domain decomposition: with --spatial-blocks=N the volume is split into
+    // N slabs along z, each solved by its own process.  Neighbouring slabs 
+    // swap the posterior means of their boundary slices every iteration and
+    // the akmean sums are added up over all slabs, via pipes to the parent.
+    int spatialBlocks;
+    bool DoBlockCalculations(const DataSet& allData);
+    // The rest is only set in the process running one block:
+    vector<bool> blockOwned; // false for halo voxels (owned by another block)
+    vector<int> blockSendVoxels; // our voxels that other blocks need
+    vector<int> blockHaloVoxels; // voxels whose means come from other blocks
+    int blockToHub;
+    int blockFromHub;
+    void BlockSumAll(vector<double>& values) const;
+    void BlockExchangeHalo(vector<MVNDist>& fwdPosteriorVox) const;
+
     double OptimizeSmoothingScale(
       const DiagonalMatrix& covRatio,
       //const SymmetricMatrix& covRatioSupplemented,
@@ -164,6 +234,16 @@ public:
       bool allowRhoToVary = true,
       bool allowDeltaToVary = true) const;
 
+    // Used by the delta & rho updates (and SmoothingScaleTasks, which can
+    // run them for several parameters at once)
+    void CalcSmoothingRatios(int k, const vector<MVNDist>& fwdPosteriorVox,
+      DiagonalMatrix& covRatio, ColumnVector& meanDiffRatio) const;
+    void UpdateSmoothingScale(int k, char type,
+      const DiagonalMatrix& covRatio, const ColumnVector& meanDiffRatio,
+      const vector<MVNDist*>& fwdPosteriorWithoutPrior,
+      double& deltaK, double& rhoK) const;
+    friend class SmoothingScaleTasks;
+
     double OptimizeEvidence(
       // const vector<MVNDist>& fwdPriorVox, // used for parameters other than k
       const vector<MVNDist*>& fwdPosteriorWithoutPrior, // used for parameter k
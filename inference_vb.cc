@@ -68,6 +68,7 @@
 
 #include "inference_vb.h"
 #include "convergence.h"
+#include "checkpoint.h"
 
 #ifndef __FABBER_LIBRARYONLY
 using namespace NEWIMAGE;
@@ -224,6 +225,13 @@ void VariationalBayesInferenceTechnique::Setup(ArgsType& args)
   
 }
 
+// False if ReCentre threw, leaving linear centred on an earlier voxel
+static bool CentredOn(const LinearFwdModel& linear, const ColumnVector& means)
+{
+  const ColumnVector centre = linear.Centre();
+  return centre.Nrows() == means.Nrows() && centre == means;
+}
+
 void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData) 
 {
   Tracer_Plus tr("VariationalBayesInferenceTechnique::DoCalculations");
@@ -269,10 +277,29 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 
   assert(resultMVNs.empty()); // Only call DoCalculations once
   resultMVNs.resize(Nvoxels, NULL);
+  resultModelFitValid.assign(Nvoxels, false);
 
   assert(resultFs.empty());
   resultFs.resize(Nvoxels, 9999);  // 9999 is a garbage default value
 
+  // Pick up whatever a previous run finished, and journal as we go
+  if ((resume || checkpointEvery > 0) && Nmcstep > 0)
+    throw Invalid_option("--checkpoint-every and --resume can't be used with --mcsteps");
+  vector<bool> voxelDone(Nvoxels, false);
+  Checkpoint journal;
+  long journalBytes = 0;
+  if (resume)
+    {
+      const int nDone = Checkpoint::Load(CheckpointFilename(), Nvoxels, CheckpointLayout(),
+        resultMVNs, resultFs, resultModelFit, resultModelFitValid, NULL, &journalBytes);
+      for (int v = 1; v <= Nvoxels; v++)
+	voxelDone[v-1] = (resultMVNs[v-1] != NULL);
+      LOG_ERR("Resuming: " << nDone << " of " << Nvoxels 
+	      << " voxels were already done" << endl);
+    }
+  if (checkpointEvery > 0)
+    journal.Start(CheckpointFilename(), Nvoxels, CheckpointLayout(), checkpointEvery, journalBytes);
+
   // If we're continuing from previous saved results, load them here:
   bool continuingFromFile = (continueFromFile != "");
   vector<MVNDist*> continueFromDists;
@@ -298,9 +325,9 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   for (int k=1; k<=nFwdParams; k++) {
     if (PriorsTypes[k-1] == 'I') {
       LOG_ERR("Reading Image prior ("<<k<<"): " << imagepriorstr[k-1] << endl);
-      if (EasyOptions::UsingMatrixIO())
+      if (allData.GetMatrixIO() != NULL)
 	{
-	  ImagePrior[k-1] = EasyOptions::InMatrix(imagepriorstr[k-1]);
+	  ImagePrior[k-1] = allData.GetMatrixIO()->In(imagepriorstr[k-1]);
 	}
       else
 	{
@@ -314,6 +341,10 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   }
  }
 
+  // Shared by all voxels, so if the model is linear in some parameters 
+  // their Jacobian columns are only calculated once (ReCentre resets the rest)
+  LinearizedFwdModel linear( model );
+
   // main loop over motion correction iterations and VB calculations
   bool continuefromprevious = false; //indicates that we should continue from a previous run (i.e. after a motion correction step)
   for (int step = 0; step <= Nmcstep; step++) {
@@ -322,6 +353,9 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   // loop over voxels doing VB calculations
   for (int voxel = 1; voxel <= Nvoxels; voxel++)
     {
+      if (voxelDone[voxel-1])
+	continue;
+
       ColumnVector y = data.Column(voxel);
       ColumnVector vcoords = coords.Column(voxel);
       if (suppdata.Ncols() > 0) {
@@ -390,8 +424,6 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
       MVNDist fwdPriorSave(fwdPrior);
 
       
-      LinearizedFwdModel linear( model );
-      
       // Setup for ARD (fwdmodel will decide if there is anything to be done)
       double Fard = 0;
       model->SetupARD( fwdPosterior, fwdPrior, Fard ); // THIS USES ARD IN THE MODEL AND IS DEPRECEATED
@@ -537,7 +569,12 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 	  fwdPosterior, noiseVox->OutputAsMVN() );
 	if (needF)
 	  resultFs.at(voxel-1) = F;
-	modelpred.Column(voxel) = linear.Offset(); // get the model prediction which is stored within the linearized forward model
+	// get the model prediction which is stored within the linearized forward model
+	if (CentredOn(linear, fwdPosterior.means))
+	  modelpred.Column(voxel) = linear.Offset();
+	else
+	  modelpred.Column(voxel) = 0.0;
+	KeepModelFit(voxel, linear, fwdPosterior.means);
 
       } catch (...) {
 	// Even that can fail, due to results being singular
@@ -550,9 +587,19 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
 
 	if (needF)
 	  resultFs.at(voxel-1) = F;
-	modelpred.Column(voxel) = linear.Offset(); // get the model prediction which is stored within the linearized forward model
+	modelpred.Column(voxel) = 0.0; // linear may not even be centred on this voxel
+	KeepModelFit(voxel, linear, tmp->means.Rows(1, fwdPosterior.means.Nrows()));
       }
       
+      if (journal.IsOpen())
+	{
+	  ColumnVector fit;
+	  if (resultModelFitValid[voxel-1])
+	    fit = resultModelFit.Column(voxel);
+	  journal.AddVoxel(voxel, *resultMVNs[voxel-1], resultFs.at(voxel-1),
+			   resultModelFitValid[voxel-1] ? &fit : NULL);
+	}
+
       delete noiseVox; noiseVox = NULL;
       delete noiseVoxSave;
     } //END of voxelwise updates
@@ -567,6 +614,8 @@ void VariationalBayesInferenceTechnique::DoCalculations(const DataSet& allData)
   continuefromprevious = true; //we now take resultMVNs and use these as the starting point if we are to run again
   }// END of Steps that include motion correction and VB updates
 
+  journal.Close();
+
     while (continueFromDists.size()>0)
     {
       delete continueFromDists.back();
@@ -76,9 +76,12 @@ int main() {cout << "MVNTOOL not built; compiled with __FABBER_LIBRARYONLY optio
 #include <stdexcept>
 #include <map>
 #include <string>
+#include <cstdio>
+#include <cstdlib>
 #include "dist_mvn.h"
 #include "easyoptions.h"
 #include "newimage/newimageall.h"
+#include "fslio/fslio.h"
 
 using namespace Utilities;
 using namespace MISCMATHS;
@@ -86,6 +89,10 @@ using namespace NEWIMAGE;
 
 /* Function declarations */
 void Usage(const string& errorString = "");
+int StreamingExtract(const string& infile, const volume<float>& mask, 
+		     const string& list, const vector<string>& paramNames, bool verbose);
+int StreamingSet(const string& infile, const string& outfile, const volume<float>& mask, 
+		 const string& list, const vector<string>& paramNames, bool verbose);
 
 int main(int argc, char** argv)
 {
@@ -115,6 +122,33 @@ int main(int argc, char** argv)
 	    int cparam=0;
 	    outfile = args.ReadWithDefault("output",infile);
 
+	    // Streaming modes: any number of parameters in one pass
+	    string extractList = args.ReadWithDefault("extract","");
+	    string setList = args.ReadWithDefault("set","");
+	    if (extractList != "" || setList != "")
+	      {
+		if (extractList != "" && setList != "")
+		  throw Invalid_option("Cannot use --extract and --set at the same time");
+
+		vector<string> paramNames;
+		string plistfile = args.ReadWithDefault("param-list","");
+		if (plistfile != "")
+		  {
+		    ifstream paramFile(plistfile.c_str());
+		    string currparam;
+		    while (getline(paramFile,currparam))
+		      if (currparam != "") paramNames.push_back(currparam);
+		  }
+
+		volume<float> mask;
+		read_volume(mask,maskfile);
+		mask.binarise(1e-16,mask.max()+1,exclusive);
+
+		if (extractList != "")
+		  return StreamingExtract(infile, mask, extractList, paramNames, verbose);
+		return StreamingSet(infile, outfile, mask, setList, paramNames, verbose);
+	      }
+
 	    bool ins; bool write;
 
 	    double val;	double var;
@@ -365,19 +399,12 @@ int main(int argc, char** argv)
 	      Matrix image;
 	      image.ReSize(1,nVoxels);
 
-	      if (bval) {
-		if (verbose) cout << "Extracting value for parameter:" << param << endl;
-		for (int vox = 1; vox <= nVoxels; vox++)
-		  {
-		    image(1,vox) = vmvnin[vox-1]->means(param);
-		  }
-	      }
-	      else if (bvar) {
-		if (verbose) cout << "Extracting variance for parameter:" << param << endl;
-		for (int vox = 1; vox <= nVoxels; vox++)
-		  {
-		    image(1,vox) = vmvnin[vox-1]->GetCovariance()(param,param);
-		  }
+	      if (bval || bvar) {
+		if (verbose) cout << "Extracting " << (bval ? "value" : "variance") 
+				  << " for parameter:" << param << endl;
+		Matrix means, variances;
+		MVNDist::GetMarginals(vmvnin, means, variances);
+		image = (bval ? means : variances).Row(param);
 	      }
 	      else if (cvar) {
 		if (verbose) cout << "Extracting co-variance for parameter " << param << "with parameter" << cparam << endl;
@@ -418,6 +445,464 @@ int main(int argc, char** argv)
 	return 1;
 }
 
+// Reads one entry of an MVN file at a time, in the order MVNDist::Save 
+// uses (lower triangle of the covariance, means, then a 1), so only what's
+// asked for is ever in memory.  Works on NIFTI and packed files.  A NIFTI
+// file is opened once; reading entries in ascending order is a single 
+// sequential pass over it, which matters when it's gzipped.
+class MVNEntryReader {
+public:
+  MVNEntryReader(const string& filename, const volume<float>& mask);
+  ~MVNEntryReader();
+
+  int NumParams() const { return nParams; }
+  int NumVoxels() const { return nVoxels; }
+  int NumEntries() const { return nParams*(nParams+1)/2 + nParams + 1; }
+  const PackedMVNFile* Packed() const { return packed; }
+  const FSLIO* Header() const { return fslio; } // NULL for packed
+  const vector<size_t>& MaskOffsets() const { return offsets; }
+
+  static int CovEntry(int r, int c) { if (r < c) swap(r,c); return r*(r-1)/2 + c; }
+  int MeanEntry(int p) const { return nParams*(nParams+1)/2 + p; }
+
+  void Read(int entry, ColumnVector& out);
+
+private:
+  string filename;
+  const volume<float>& mask;
+  int nParams;
+  int nVoxels;
+  PackedMVNFile* packed; // NULL for NIFTI
+
+  // NIFTI only
+  FSLIO* fslio;
+  vector<size_t> offsets; // of the mask voxels within a volume
+  vector<char> buffer;    // one volume as stored
+  bool isDouble;
+  bool scaled;
+  float slope, intercept;
+  int nextEntry;          // where the file is positioned
+
+  MVNEntryReader(const MVNEntryReader&);
+  const MVNEntryReader& operator=(const MVNEntryReader&);
+};
+
+MVNEntryReader::MVNEntryReader(const string& name, const volume<float>& m)
+  : filename(name), mask(m), packed(NULL), fslio(NULL), isDouble(false), 
+    scaled(false), slope(1), intercept(0), nextEntry(1)
+{
+  const string packedName = PackedMVNFile::Find(filename);
+  if (packedName != "")
+    {
+      packed = new PackedMVNFile(packedName);
+      packed->CheckMask(mask);
+      nParams = packed->NumParams();
+      nVoxels = packed->NumVoxels();
+      return;
+    }
+
+  fslio = FslOpen(filename.c_str(), "rb");
+  if (fslio == NULL)
+    throw Invalid_option("Couldn't open " + filename);
+  short x, y, z, t;
+  FslGetDim(fslio, &x, &y, &z, &t);
+  if (x != mask.xsize() || y != mask.ysize() || z != mask.zsize())
+    throw Invalid_option("Mask and MVN file are different sizes");
+  nParams = ((int)sqrt(8*t+1)-3)/2;
+  if (t != NumEntries())
+    throw Invalid_option(filename + " doesn't look like an MVN file");
+
+  short dataType;
+  FslGetDataType(fslio, &dataType);
+  if (dataType != DT_FLOAT32 && dataType != DT_FLOAT64)
+    throw Invalid_option(filename + " isn't stored as floating point; "
+			 "convert it with fslmaths -odt float first");
+  isDouble = (dataType == DT_FLOAT64);
+  scaled = (FslGetIntensityScaling(fslio, &slope, &intercept) != 0);
+  buffer.resize(size_t(x)*y*z * (isDouble ? sizeof(double) : sizeof(float)));
+
+  // Same voxel order as volume::matrix(mask)
+  for (int k = 0; k < z; k++)
+    for (int j = 0; j < y; j++)
+      for (int i = 0; i < x; i++)
+	if (mask(i,j,k) != 0)
+	  offsets.push_back(i + size_t(x)*(j + size_t(y)*k));
+  nVoxels = offsets.size();
+}
+
+MVNEntryReader::~MVNEntryReader() 
+{ 
+  delete packed; 
+  if (fslio != NULL) 
+    FslClose(fslio);
+}
+
+void MVNEntryReader::Read(int entry, ColumnVector& out)
+{
+  assert(entry >= 1 && entry <= NumEntries());
+  out.ReSize(nVoxels);
+  if (packed == NULL)
+    {
+      // Seeking forwards in a gzipped file decompresses what's skipped;
+      // seeking backwards starts again from the top.  So read in order.
+      if (entry != nextEntry)
+	FslSeekVolume(fslio, entry-1);
+      if (FslReadVolumes(fslio, &buffer[0], 1) != 1)
+	throw Runtime_error(("Couldn't read volume " + stringify(entry) 
+			     + " of " + filename).c_str());
+      nextEntry = entry+1;
+      const float* flt = reinterpret_cast<const float*>(&buffer[0]);
+      const double* dbl = reinterpret_cast<const double*>(&buffer[0]);
+      for (int v = 1; v <= nVoxels; v++)
+	{
+	  const double val = isDouble ? dbl[offsets[v-1]] : flt[offsets[v-1]];
+	  out(v) = scaled ? val*slope + intercept : val;
+	}
+      return;
+    }
+
+  const int nCov = nParams*(nParams+1)/2;
+  if (entry > nCov + nParams)
+    {
+      out = 1.0;
+      return;
+    }
+  int r = 0, c = 0;
+  if (entry <= nCov)
+    {
+      // Invert CovEntry
+      for (r = 1; r*(r+1)/2 < entry; r++) { }
+      c = entry - r*(r-1)/2;
+    }
+  for (int v = 1; v <= nVoxels; v++)
+    out(v) = (r > 0) ? packed->Covariance(v, r, c) 
+      : packed->Mean(v, entry - nCov);
+}
+
+// Writes a NIFTI MVN file one entry (volume) at a time, with the input's
+// header.  It goes to a temporary name and is only renamed over filename 
+// by Close(), since filename may well be the file we're reading from.
+class MVNEntryWriter {
+public:
+  MVNEntryWriter(const string& filename, const MVNEntryReader& like, 
+		 const volume<float>& mask, int nEntries);
+  ~MVNEntryWriter() { if (fslio != NULL) FslClose(fslio); }
+
+  void Write(const ColumnVector& values);
+  void Close();
+
+private:
+  string base;    // filename without extension
+  string tmpBase;
+  FSLIO* fslio;
+  const vector<size_t>& offsets;
+  vector<float> buffer;
+  int nEntries, written;
+  bool ok;
+
+  MVNEntryWriter(const MVNEntryWriter&);
+  const MVNEntryWriter& operator=(const MVNEntryWriter&);
+};
+
+MVNEntryWriter::MVNEntryWriter(const string& filename, const MVNEntryReader& like,
+			       const volume<float>& mask, int n)
+  : fslio(NULL), offsets(like.MaskOffsets()), 
+    buffer(size_t(mask.xsize())*mask.ysize()*mask.zsize()), 
+    nEntries(n), written(0), ok(true)
+{
+  char* b = FslMakeBaseName(filename.c_str());
+  base = b;
+  free(b);
+  tmpBase = base + "_mvntool_tmp";
+
+  fslio = FslOpen(tmpBase.c_str(), "wb");
+  if (fslio == NULL)
+    throw Runtime_error(("Couldn't create " + tmpBase).c_str());
+  FslCloneHeader(fslio, like.Header());
+  FslSetDim(fslio, mask.xsize(), mask.ysize(), mask.zsize(), nEntries);
+  FslSetDimensionality(fslio, 4);
+  FslSetDataType(fslio, DT_FLOAT32);
+  FslSetIntent(fslio, NIFTI_INTENT_SYMMATRIX, 0, 0, 0);
+  // Values are written as they are, and their range isn't known up front
+  fslio->niftiptr->scl_slope = 1;
+  fslio->niftiptr->scl_inter = 0;
+  fslio->niftiptr->cal_min = 0;
+  fslio->niftiptr->cal_max = 0;
+  FslWriteHeader(fslio);
+}
+
+void MVNEntryWriter::Write(const ColumnVector& values)
+{
+  assert(fslio != NULL && written < nEntries);
+  assert(values.Nrows() == (int)offsets.size());
+  fill(buffer.begin(), buffer.end(), 0.0f);
+  for (unsigned v = 0; v < offsets.size(); v++)
+    buffer[offsets[v]] = values(v+1);
+  ok = ok && (FslWriteVolumes(fslio, &buffer[0], 1) == 1);
+  written++;
+}
+
+void MVNEntryWriter::Close()
+{
+  assert(fslio != NULL);
+  // Same extension(s) as the temporary file, which follow FSLOUTPUTTYPE
+  const string hdrName = fslio->niftiptr->fname;
+  const string imgName = fslio->niftiptr->iname;
+  ok = (FslClose(fslio) == 0) && ok && (written == nEntries);
+  fslio = NULL;
+  if (!ok)
+    throw Runtime_error(("Couldn't write " + hdrName).c_str());
+
+  if (rename(hdrName.c_str(), (base + hdrName.substr(tmpBase.size())).c_str()) != 0
+      || (imgName != hdrName && rename(imgName.c_str(), 
+				       (base + imgName.substr(tmpBase.size())).c_str()) != 0))
+    throw Runtime_error(("Couldn't rename " + hdrName + " to " + base).c_str());
+}
+
+// A parameter given by number, or by name if there are names to go on
+static int ParamNumber(const string& s, const vector<string>& names, int nParams)
+{
+  for (unsigned i = 0; i < names.size(); i++)
+    if (names[i] == s)
+      return i+1;
+  int p = 0;
+  try { p = convertTo<int>(s); } 
+  catch (Invalid_option&) { throw Invalid_option("Unknown parameter: " + s); }
+  if (p < 1 || p > nParams)
+    throw Invalid_option("Parameter number out of range: " + s);
+  return p;
+}
+
+// Split "a,b,c" (or with another separator)
+static vector<string> SplitList(const string& list, char sep)
+{
+  vector<string> items;
+  string::size_type start = 0;
+  while (start <= list.size())
+    {
+      string::size_type end = list.find(sep, start);
+      if (end == string::npos) end = list.size();
+      items.push_back(list.substr(start, end - start));
+      start = end + 1;
+    }
+  return items;
+}
+
+static void SaveImage(const ColumnVector& values, const volume<float>& mask, 
+		      const string& filename)
+{
+  volume4D<float> output(mask.xsize(),mask.ysize(),mask.zsize(),1);
+  copybasicproperties(mask,output);
+  output.setmatrix(values.t(),mask);
+  output.setDisplayMaximumMinimum(output.max(),output.min());
+  output.set_intent(NIFTI_INTENT_NONE,0,0,0);
+  save_volume4D(output,filename);
+}
+
+int StreamingExtract(const string& infile, const volume<float>& mask, 
+		     const string& list, const vector<string>& paramNames, bool verbose)
+{
+  MVNEntryReader in(infile, mask);
+  const vector<string>& names = (paramNames.empty() && in.Packed()) 
+    ? in.Packed()->ParamNames() : paramNames;
+
+  // Work out which entry each output needs, then read them in file order
+  multimap<int, string> outputs;
+  const vector<string> items = SplitList(list, ',');
+  for (unsigned i = 0; i < items.size(); i++)
+    {
+      const string::size_type eq = items[i].find('=');
+      if (eq == string::npos)
+	throw Invalid_option("--extract items look like val:<param>=<file>, not " + items[i]);
+      const vector<string> what = SplitList(items[i].substr(0, eq), ':');
+      const string file = items[i].substr(eq+1);
+      int entry;
+      if (what[0] == "val" && what.size() == 2)
+	entry = in.MeanEntry(ParamNumber(what[1], names, in.NumParams()));
+      else if (what[0] == "var" && what.size() == 2)
+	{
+	  const int p = ParamNumber(what[1], names, in.NumParams());
+	  entry = MVNEntryReader::CovEntry(p, p);
+	}
+      else if (what[0] == "cvar" && what.size() == 3)
+	entry = MVNEntryReader::CovEntry(ParamNumber(what[1], names, in.NumParams()),
+					 ParamNumber(what[2], names, in.NumParams()));
+      else
+	throw Invalid_option("Unknown --extract item: " + items[i]);
+      outputs.insert(make_pair(entry, file));
+    }
+
+  ColumnVector values;
+  int lastEntry = 0;
+  for (multimap<int, string>::const_iterator it = outputs.begin(); 
+       it != outputs.end(); ++it)
+    {
+      if (it->first != lastEntry)
+	in.Read(it->first, values);
+      lastEntry = it->first;
+      if (verbose) cout << "Writing " << it->second << endl;
+      SaveImage(values, mask, it->second);
+    }
+
+  if (verbose) cout << "Done." << endl;
+  return 0;
+}
+
+// A number, or the name of an image to take one value per voxel from
+static ColumnVector ValueOrImage(const string& s, const volume<float>& mask, int nVoxels)
+{
+  ColumnVector values(nVoxels);
+  try 
+    { 
+      values = convertTo<double>(s); 
+    }
+  catch (Invalid_option&)
+    {
+      volume4D<float> vol;
+      read_volume4D(vol,s);
+      values = vol.matrix(mask).Row(1).t();
+    }
+  return values;
+}
+
+int StreamingSet(const string& infile, const string& outfile, const volume<float>& mask, 
+		 const string& list, const vector<string>& paramNames, bool verbose)
+{
+  MVNEntryReader in(infile, mask);
+  const int nVoxels = in.NumVoxels();
+  const vector<string>& names = (paramNames.empty() && in.Packed()) 
+    ? in.Packed()->ParamNames() : paramNames;
+
+  // Items are write:<param>=<mean>:<var> or new:<param>=<mean>:<var>.  New
+  // parameters are numbered as in the output; written ones as in the input.
+  // Each mean and var is a number or an image.
+  map<int, pair<string, string> > writes, inserts;
+  const vector<string> items = SplitList(list, ',');
+  for (unsigned i = 0; i < items.size(); i++)
+    {
+      const string::size_type eq = items[i].find('=');
+      const string::size_type colon = items[i].find(':');
+      const vector<string> values = SplitList(
+        eq == string::npos ? "" : items[i].substr(eq+1), ':');
+      if (eq == string::npos || colon > eq || values.size() != 2)
+	throw Invalid_option("--set items look like write:<param>=<mean>:<var>, not " + items[i]);
+      const string kind = items[i].substr(0, colon);
+      const string param = items[i].substr(colon+1, eq-colon-1);
+      if (kind == "write")
+	writes[ParamNumber(param, names, in.NumParams())] = make_pair(values[0], values[1]);
+      else if (kind == "new")
+	inserts[convertTo<int>(param)] = make_pair(values[0], values[1]);
+      else
+	throw Invalid_option("Unknown --set item: " + items[i]);
+    }
+
+  // Where each output parameter comes from (0 = inserted)
+  const int nOut = in.NumParams() + inserts.size();
+  vector<int> fromParam(nOut+1, 0);
+  vector<int> toParam(in.NumParams()+1, 0);
+  for (int p = 1, q = 1; p <= nOut; p++)
+    if (inserts.count(p) == 0)
+      {
+	if (q > in.NumParams())
+	  throw Invalid_option("Cannot insert parameter " + stringify(p) 
+			       + ", not enough parameters in existing MVN");
+	toParam[q] = p;
+	fromParam[p] = q++;
+      }
+
+  // The new means and variances, by output parameter
+  map<int, pair<ColumnVector, ColumnVector> > newValues;
+  for (map<int, pair<string, string> >::const_iterator it = inserts.begin(); 
+       it != inserts.end(); ++it)
+    newValues[it->first] = make_pair(ValueOrImage(it->second.first, mask, nVoxels),
+				     ValueOrImage(it->second.second, mask, nVoxels));
+  for (map<int, pair<string, string> >::const_iterator it = writes.begin(); 
+       it != writes.end(); ++it)
+    newValues[toParam[it->first]] = make_pair(ValueOrImage(it->second.first, mask, nVoxels),
+					      ValueOrImage(it->second.second, mask, nVoxels));
+
+  // New means and variances, by output parameter (NULL if none)
+  vector<const pair<ColumnVector, ColumnVector>*> newFor(nOut+1, 
+    (const pair<ColumnVector, ColumnVector>*)NULL);
+  for (map<int, pair<ColumnVector, ColumnVector> >::const_iterator it = newValues.begin(); 
+       it != newValues.end(); ++it)
+    newFor[it->first] = &it->second;
+
+  // The output is written as the input is read, so neither is ever all in
+  // memory.  Inserting parameters doesn't reorder the others, so the input
+  // is still read in file order.
+  if (verbose) cout << "Save file" << endl;
+  if (in.Packed() != NULL)
+    {
+      // Packed files are per voxel, and the input is mapped, so go by voxel
+      string packedOut = outfile;
+      if (packedOut.size() < 5 || packedOut.substr(packedOut.size()-5) != ".fmvn")
+	packedOut += ".fmvn";
+      const string tmpOut = packedOut + ".tmp";
+      const PackedMVNFile& from = *in.Packed();
+      // Names no longer line up if anything was inserted
+      PackedMVNWriter out(tmpOut, nVoxels, nOut,
+			  inserts.empty() ? from.ParamNames() : vector<string>(),
+			  PackedMVNFile::HashMask(mask), from.DoublePrecision());
+      ColumnVector means(nOut);
+      SymmetricMatrix cov(nOut);
+      for (int v = 1; v <= nVoxels; v++)
+	{
+	  for (int r = 1; r <= nOut; r++)
+	    {
+	      means(r) = newFor[r] ? newFor[r]->first(v) : from.Mean(v, fromParam[r]);
+	      for (int c = 1; c <= r; c++)
+		if (r == c && newFor[r])
+		  cov(r,c) = newFor[r]->second(v);
+		else if (fromParam[r] == 0 || fromParam[c] == 0)
+		  cov(r,c) = 0;
+		else
+		  cov(r,c) = from.Covariance(v, fromParam[r], fromParam[c]);
+	    }
+	  out.AddVoxel(means, cov);
+	}
+      out.Close();
+      if (rename(tmpOut.c_str(), packedOut.c_str()) != 0)
+	throw Runtime_error(("Couldn't rename " + tmpOut + " to " + packedOut).c_str());
+    }
+  else
+    {
+      MVNEntryWriter out(outfile, in, mask, nOut*(nOut+1)/2 + nOut + 1);
+      ColumnVector values, zeros(nVoxels);
+      zeros = 0;
+      for (int r = 1; r <= nOut; r++)
+	for (int c = 1; c <= r; c++)
+	  {
+	    if (r == c && newFor[r])
+	      out.Write(newFor[r]->second);
+	    else if (fromParam[r] == 0 || fromParam[c] == 0)
+	      out.Write(zeros);
+	    else
+	      {
+		in.Read(MVNEntryReader::CovEntry(fromParam[r], fromParam[c]), values);
+		out.Write(values);
+	      }
+	  }
+      for (int p = 1; p <= nOut; p++)
+	{
+	  if (newFor[p])
+	    out.Write(newFor[p]->first);
+	  else
+	    {
+	      in.Read(in.MeanEntry(fromParam[p]), values);
+	      out.Write(values);
+	    }
+	}
+      ColumnVector ones(nVoxels);
+      ones = 1;
+      out.Write(ones);
+      out.Close();
+    }
+
+  if (verbose) cout << "Done." << endl;
+  return 0;
+}
+
 void Usage(const string& errorString)
 {
   cout << "\nUsage: mvntool <arguments>\n"
@@ -437,7 +922,14 @@ void Usage(const string& errorString)
        << " --valim=<NIFITfile> : Image to write for mean of parameter." << endl
        << " --varim=<NIFITfile> : Image to write for variance of parameter." << endl
        << " --val=<mean_value>  : Mean value for parameter to be written." << endl
-       << " --var=<variance>    : Variance of parameter to be written." << endl
+       << " --var=<variance>    : Variance of parameter to be written." << endl << endl
+       << " Streaming behaviour (any number of parameters in one pass over the file):" << endl
+       << " --extract=<list> : Comma separated items val:<p>=<NIFTIfile>, var:<p>=<NIFTIfile>" << endl
+       << "   or cvar:<p>:<q>=<NIFTIfile>.  e.g. --extract=val:1=mean_f,var:1=var_f,var:2=var_d" << endl
+       << " --set=<list> : Comma separated items write:<p>=<mean>:<var> (overwrite parameter p)" << endl
+       << "   or new:<p>=<mean>:<var> (insert so the new parameter is p in the output)." << endl
+       << "   <mean> and <var> are values or NIFTI images.  Output goes to --output as above." << endl
+       << "   [--param-list=<file>] : Parameter names, so <p> can be a name (packed MVNs carry their own)" << endl
        << endl;
 }
 
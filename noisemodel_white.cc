@@ -143,7 +143,7 @@ void WhiteParams::Dump(const string indent) const
 //WhiteNoiseModel::WhiteNoiseModel(const string& pattern) 
 //  : phiPattern(pattern)
 WhiteNoiseModel::WhiteNoiseModel(ArgsType& args)
-  : phiPattern(args.ReadWithDefault("noise-pattern","1"))
+  : phiPattern(args.ReadWithDefault("noise-pattern","1")), JtQJ_id(0)
 { 
   Tracer_Plus tr("WhiteNoiseModel::WhiteNoiseModel");
   assert(phiPattern.length() > 0);
@@ -199,6 +199,7 @@ void WhiteNoiseModel::MakeQis(int dataLen) const
 
   // Regenerate the Qis
   Qis.clear();
+  JtQJ.clear();
   DiagonalMatrix zeroes(dataLen);
   zeroes = 0.0;
   Qis.resize(nPhis, zeroes); // initialize all to zero
@@ -216,6 +217,19 @@ void WhiteNoiseModel::MakeQis(int dataLen) const
 	 "At least one Phi was unused! This is probably a bad thing.");
 }
 
+void WhiteNoiseModel::MakeJtQJ(const LinearFwdModel& linear) const
+{
+  Tracer_Plus tr("WhiteNoiseModel::MakeJtQJ");
+  if (JtQJ.size() == Qis.size() && JtQJ_id == linear.JacobianId())
+    return;  // already up-to-date
+
+  const Matrix& J = linear.Jacobian();
+  JtQJ.resize(Qis.size());
+  for (unsigned i = 0; i < Qis.size(); i++)
+    JtQJ[i] << J.t() * Qis[i] * J;
+  JtQJ_id = linear.JacobianId();
+}
+
 void WhiteNoiseModel::UpdateNoise(
     NoiseParams& noise,
     const NoiseParams& noisePrior,
@@ -233,6 +247,7 @@ void WhiteNoiseModel::UpdateNoise(
   
   // check the Qis are valid
   MakeQis(data.Nrows());
+  MakeJtQJ(linear);
   const int nPhis = Qis.size();
   assert(nPhis == posterior.nPhis);
   assert(nPhis == prior.nPhis);
@@ -243,7 +258,7 @@ void WhiteNoiseModel::UpdateNoise(
       const DiagonalMatrix& Qi = Qis[i-1];
       double tmp = 
 	(k.t() * Qi * k).AsScalar()
-	+ (theta.GetCovariance() * J.t() * Qi * J).Trace();
+	+ (theta.GetCovariance() * JtQJ[i-1]).Trace();
       
       posterior.phis[i-1].b =
 	1/( tmp*0.5 + 1/prior.phis[i-1].b);
@@ -291,6 +306,7 @@ void WhiteNoiseModel::UpdateTheta(
   // Make sure Qis are up-to-date
   MakeQis(data.Nrows());
   assert(Qis.size() == (unsigned)noise.nPhis);
+  MakeJtQJ(linear);
 
   // Marginalize over phi distributions
   DiagonalMatrix X(data.Nrows()); 
@@ -301,10 +317,10 @@ void WhiteNoiseModel::UpdateTheta(
   // Adding up all the Qis will give you the identity matrix.
 
   // Calculate Lambda & Lambda*m (without priors)
-  SymmetricMatrix Ltmp;
-  Ltmp << J.t() * X * J;  
-  // use << instead of = because this is considered a lossy assignment
-  // (since NEWMAT isn't smart enough to know J'*X*J is always symmetric)
+  SymmetricMatrix Ltmp = JtQJ[0] * noise.phis[0].CalcMean();
+  for (unsigned i = 2; i <= Qis.size(); i++)
+    Ltmp += JtQJ[i-1] * noise.phis[i-1].CalcMean();
+  // = J'*X*J, but without going through the data points again
   ColumnVector mTmp = J.t() * X * (data - gml + J*ml);
 
   // Update Lambda and m (including priors)
@@ -381,6 +397,8 @@ double WhiteNoiseModel::CalcFreeEnergy(
   	const ColumnVector& data) const
 {
     Tracer_Plus tr("WhiteNoiseModel::CalcFreeEnergy");
+    MakeQis(data.Nrows());
+    MakeJtQJ(linear);
     const int nPhis = Qis.size();
     const WhiteParams& noise = dynamic_cast<const WhiteParams&>(noiseIn);
     const WhiteParams& noisePrior = dynamic_cast<const WhiteParams&>(noisePriorIn);
@@ -428,9 +446,13 @@ double WhiteNoiseModel::CalcFreeEnergy(
 
    expectedLogPosteriorParts[1] = 0; //*NB not required
   
+  SymmetricMatrix JtJ = JtQJ[0];
+  for (int i = 1; i < nPhis; i++)
+    JtJ += JtQJ[i];
+
   expectedLogPosteriorParts[2] =
     -0.5 * (k.t() *  k).AsScalar() 
-    -0.5 * (J.t() * J * Linv).Trace(); //*NB remove Qsum
+    -0.5 * (JtJ * Linv).Trace(); //*NB remove Qsum
   
   expectedLogPosteriorParts[3] =
     +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue()
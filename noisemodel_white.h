@@ -146,4 +146,10 @@ class WhiteNoiseModel : public NoiseModel {
   // Diagonal matrices, indicating which data points use each phi
   mutable vector<DiagonalMatrix> Qis; // mutable because it's used as a cache
   void MakeQis(int dataLen) const;
+
+  // J'*Qi*J for each phi.  Only recalculated when the linear model's
+  // JacobianId changes, which for a linear model is never.
+  mutable vector<SymmetricMatrix> JtQJ;
+  mutable unsigned long JtQJ_id;
+  void MakeJtQJ(const LinearFwdModel& linear) const;
 };
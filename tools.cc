@@ -68,7 +68,11 @@
 
 #include "tools.h"
 #include "easylog.h"
+#include "miscmaths/miscprob.h"
+using MISCMATHS::igamc;
 #include <limits>
+#include <unistd.h>
+#include <sys/wait.h>
 
 double DescendingZeroFinder::FindZero() const
 {
@@ -271,3 +275,251 @@ double RiddlersGuesstimator::GetGuess(double lower, double upper, double atLower
   return x3;
 
 }
+
+// read()/write() may transfer less than asked for, particularly on pipes
+bool WriteFully(int fd, const void* buf, size_t len)
+{
+  const char* p = static_cast<const char*>(buf);
+  while (len > 0)
+    {
+      ssize_t n = write(fd, p, len);
+      if (n <= 0) return false;
+      p += n; len -= n;
+    }
+  return true;
+}
+
+bool ReadFully(int fd, void* buf, size_t len)
+{
+  char* p = static_cast<char*>(buf);
+  while (len > 0)
+    {
+      ssize_t n = read(fd, p, len);
+      if (n <= 0) return false;
+      p += n; len -= n;
+    }
+  return true;
+}
+
+void ParallelTasks::RunAll(int nTasks, vector<vector<double> >& results) const
+{
+  Tracer_Plus tr("ParallelTasks::RunAll");
+  results.clear();
+  results.resize(nTasks);
+
+  if (maxProcs <= 1 || nTasks <= 1)
+    {
+      for (int t = 0; t < nTasks; t++)
+	RunTask(t, results[t]);
+      return;
+    }
+
+  // Anything still buffered would otherwise be written again by each child
+  cout.flush();
+  if (EasyLog::LogStarted())
+    LOG.flush();
+
+  for (int first = 0; first < nTasks; first += maxProcs)
+    {
+      const int last = (first + maxProcs < nTasks) ? first + maxProcs : nTasks;
+      vector<int> fds;
+      vector<pid_t> pids;
+
+      for (int t = first; t < last; t++)
+	{
+	  int fd[2];
+	  if (pipe(fd) != 0)
+	    throw Runtime_error("ParallelTasks: couldn't create a pipe");
+	  pid_t pid = fork();
+	  if (pid < 0)
+	    throw Runtime_error("ParallelTasks: couldn't start a worker process");
+
+	  if (pid == 0)
+	    {
+	      // Worker: run the task, send the results, and leave without
+	      // running any destructors that belong to the parent
+	      close(fd[0]);
+	      vector<double> out;
+	      int n;
+	      try 
+		{
+		  RunTask(t, out);
+		  n = out.size();
+		}
+	      catch (const exception& e)
+		{
+		  n = -1;
+		  LOG_ERR_SAFE("Worker process for task " << t << " failed:\n  " 
+			       << e.what() << endl);
+		}
+	      catch (Exception)
+		{
+		  n = -1;
+		  LOG_ERR_SAFE("Worker process for task " << t << " failed:\n  " 
+			       << Exception::what() << endl);
+		}
+	      catch (...)
+		{
+		  n = -1;
+		  LOG_ERR_SAFE("Worker process for task " << t 
+			       << " failed with an unknown exception" << endl);
+		}
+	      bool ok = WriteFully(fd[1], &n, sizeof(n));
+	      if (ok && n > 0)
+		ok = WriteFully(fd[1], &out[0], n*sizeof(double));
+	      cout.flush();
+	      if (EasyLog::LogStarted())
+		LOG.flush();
+	      _exit((ok && n >= 0) ? 0 : 1);
+	    }
+
+	  close(fd[1]);
+	  fds.push_back(fd[0]);
+	  pids.push_back(pid);
+	}
+
+      bool failed = false;
+      for (int t = first; t < last; t++)
+	{
+	  const int fd = fds[t-first];
+	  int n = -1;
+	  if (!ReadFully(fd, &n, sizeof(n)) || n < 0)
+	    failed = true;
+	  else
+	    {
+	      results[t].resize(n);
+	      if (n > 0 && !ReadFully(fd, &results[t][0], n*sizeof(double)))
+		failed = true;
+	    }
+	  close(fd);
+	  int status;
+	  waitpid(pids[t-first], &status, 0);
+	}
+
+      if (failed)
+	throw Runtime_error("ParallelTasks: a worker process failed (see logfile)");
+    }
+}
+
+IncompleteGammaTable::IncompleteGammaTable(double amin_, double amax_, double tol)
+  : amin(amin_), amax(amax_), xlow(0.25)
+{
+    Tracer_Plus tr("IncompleteGammaTable::IncompleteGammaTable");
+    assert(amin > 0 && amax > amin && tol > 0);
+
+    // Beyond xmax, Q(a,x) <= Q(amax,x) is negligible for every a in the table
+    xmax = amax;
+    while (igamc(amax, xmax) > tol*1e-3)
+        xmax *= 1.5;
+
+    double step = 0.05;
+    for (int refine = 0; ; refine++)
+    {
+        Build(step, step);
+        maxError = MeasureError();
+        if (maxError <= tol || refine == 3)
+            break;
+        step /= 2;
+    }
+
+    LOG << "IncompleteGammaTable: a in [" << amin << ", " << amax 
+        << "], x in [0, " << xmax << "], " << na << "x" << nx 
+        << " nodes, max error " << maxError << endl;
+
+    valid = (maxError <= tol);
+    if (!valid)
+    {
+        Warning::IssueOnce("Incomplete gamma table error (" + stringify(maxError)
+            + ") is above the requested tolerance (" + stringify(tol) 
+            + "); using exact igamc instead");
+        std::vector<double>().swap(q);
+        std::vector<double>().swap(dq);
+    }
+}
+
+double IncompleteGammaTable::MeasureError() const
+{
+    Tracer_Plus tr("IncompleteGammaTable::MeasureError");
+
+    // Check on the half-step grid, which includes the middle of every cell
+    // edge as well as the cell centres (the nodes themselves are exact in
+    // x but not in between the a rows), plus the x = xlow boundary where 
+    // the table takes over from igamc
+    double err = 0;
+    for (int i2 = 0; i2 <= 2*(na-1); i2++)
+    {
+        double a = amin + i2*ha/2;
+        for (int j2 = -1; j2 <= 2*(nx-1); j2++)
+        {
+            if (i2 % 2 == 0 && j2 >= 0 && j2 % 2 == 0) 
+                continue; // node: exact by construction
+            double x = (j2 < 0) ? xlow : j2*hx/2;
+            if (x < xlow || x >= xmax) continue;
+            double e = fabs(Interpolate(a, x) - igamc(a, x));
+            if (e > err) err = e;
+        }
+    }
+    return err;
+}
+
+void IncompleteGammaTable::Build(double aStep, double xStep)
+{
+    Tracer_Plus tr("IncompleteGammaTable::Build");
+
+    na = (int)ceil((amax-amin)/aStep) + 1;
+    ha = (amax-amin)/(na-1);
+    nx = (int)ceil(xmax/xStep) + 1;
+    hx = xmax/(nx-1);
+    
+    q.resize(na*nx);
+    dq.resize(na*nx);
+    for (int i = 0; i < na; i++)
+    {
+        double a = amin + i*ha;
+        double lga = lgamma(a);
+        for (int j = 0; j < nx; j++)
+        {
+            double x = j*hx;
+            q[i*nx+j] = (j == 0) ? 1.0 : igamc(a, x);
+            dq[i*nx+j] = (j == 0) ? (a == 1 ? -1.0 : 0.0) 
+                                  : -exp((a-1)*log(x) - x - lga);
+        }
+    }
+}
+
+double IncompleteGammaTable::Interpolate(double a, double x) const
+{
+    // Cubic Hermite in x along the four a rows nearest to a...
+    int j = (int)(x/hx);
+    if (j > nx-2) j = nx-2;
+    double t = x/hx - j;
+    double t2 = t*t, t3 = t2*t;
+    double h00 = 2*t3 - 3*t2 + 1, h10 = (t3 - 2*t2 + t)*hx;
+    double h01 = -2*t3 + 3*t2, h11 = (t3 - t2)*hx;
+
+    double u = (a-amin)/ha;
+    int i = (int)u - 1;
+    if (i < 0) i = 0;
+    if (i > na-4) i = na-4;
+    u -= i;
+
+    double row[4];
+    for (int r = 0; r < 4; r++)
+    {
+        int n = (i+r)*nx + j;
+        row[r] = h00*q[n] + h10*dq[n] + h01*q[n+1] + h11*dq[n+1];
+    }
+
+    // ...then Lagrange through those, at nodes u = 0, 1, 2, 3
+    return - row[0]*(u-1)*(u-2)*(u-3)/6 + row[1]*u*(u-2)*(u-3)/2
+           - row[2]*u*(u-1)*(u-3)/2 + row[3]*u*(u-1)*(u-2)/6;
+}
+
+double IncompleteGammaTable::Q(double a, double x) const
+{
+    if (!valid || a < amin || a > amax || x < xlow)
+        return igamc(a, x);
+    if (x >= xmax)
+        return 0.0;
+    return Interpolate(a, x);
+}
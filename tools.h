@@ -70,6 +70,7 @@
 using namespace NEWMAT;
 #include <math.h>
 #include <assert.h>
+#include <vector>
 
 class GenericFunction1D
 {
@@ -230,3 +231,57 @@ public:
     DescendingZeroFinder(const GenericFunction1D& f) : ZeroFinder(f) { return; }
     virtual double FindZero() const;
 };
+
+// Blocking read()/write() of exactly len bytes, e.g. over a pipe.  Return
+// false on error or end-of-file.
+bool ReadFully(int fd, void* buf, size_t len);
+bool WriteFully(int fd, const void* buf, size_t len);
+
+// Runs a batch of independent calculations in parallel.  Most of FABBER 
+// (Tracer_Plus, Warning, the log) isn't thread-safe, so each task runs in a
+// fork()ed copy of the process and sends its results back through a pipe.
+// With maxProcesses <= 1 the tasks are simply run one after another.
+class ParallelTasks
+{
+public:
+    ParallelTasks(int maxProcesses) : maxProcs(maxProcesses) { return; }
+    virtual ~ParallelTasks() { return; }
+
+    // Tasks are numbered from 0 to nTasks-1.  Anything changed apart from
+    // results is lost when running in a separate process!
+    virtual void RunTask(int task, std::vector<double>& results) const = 0;
+
+    void RunAll(int nTasks, std::vector<std::vector<double> >& results) const;
+
+private:
+    int maxProcs;
+};
+
+// Upper regularised incomplete gamma function Q(a,x), i.e. MISCMATHS::igamc,
+// interpolated from a table for amin <= a <= amax: cubic in a and cubic 
+// Hermite in x (using the exact dQ/dx).  The grid is refined until the error
+// against igamc at the centres and edge midpoints of every cell is below 
+// tol; if it can't get there the table is dropped and Q is just igamc.
+// Outside the table, and for small x (where Q goes like 1 - x^a and isn't
+// smooth enough to interpolate), igamc itself is used.
+class IncompleteGammaTable
+{
+public:
+    IncompleteGammaTable(double amin, double amax, double tol = 1e-6);
+    double Q(double a, double x) const;
+    double MaxError() const { return maxError; } // measured, not estimated
+    bool Valid() const { return valid; } // false if tol couldn't be reached
+
+private:
+    void Build(double aStep, double xStep);
+    double MeasureError() const;
+    double Interpolate(double a, double x) const;
+
+    double amin, amax, xlow, xmax;
+    double ha, hx; // grid spacing
+    int na, nx;
+    std::vector<double> q;  // Q(amin+i*ha, j*hx) at [i*nx+j]
+    std::vector<double> dq; // dQ/dx at the same points
+    double maxError;
+    bool valid;
+};
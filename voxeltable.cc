@@ -0,0 +1,211 @@
+/*  voxeltable.cc - Sparse result files: values for the voxels in the mask only
+
+    Michael Chappell, FMRIB Image Analysis Group
+
+    Copyright (C) 2007-2008 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#include "voxeltable.h"
+#include <cstdio>
+#include <cstring>
+#include "easyoptions.h"
+
+using namespace NEWIMAGE;
+
+static const char tableMagic[8] = { 'F','A','B','V','T','A','B','2' };
+
+static void FormToFloats(const Matrix& form, float* out)
+{
+  for (int r = 1; r <= 4; r++)
+    for (int c = 1; c <= 4; c++)
+      *out++ = (form.Nrows() == 4 && form.Ncols() == 4) ? form(r,c) : (r == c);
+}
+
+static ReturnMatrix FormFromFloats(const float* in)
+{
+  Matrix form(4,4);
+  for (int r = 1; r <= 4; r++)
+    for (int c = 1; c <= 4; c++)
+      form(r,c) = *in++;
+  form.Release();
+  return form;
+}
+
+void VoxelTable::Save(const string& filename, const volume<float>& mask,
+		      const Matrix& values, int intent)
+{
+  Tracer_Plus tr("VoxelTable::Save");
+
+  // Same voxel order as volume4D::matrix(mask)/setmatrix, and the same
+  // test as PackedMVNFile::HashMask (DataSet has binarised the mask)
+  vector<int> coords;
+  for (int z = 0; z < mask.zsize(); z++)
+    for (int y = 0; y < mask.ysize(); y++)
+      for (int x = 0; x < mask.xsize(); x++)
+	if (mask(x,y,z) > 0)
+	  {
+	    coords.push_back(x);
+	    coords.push_back(y);
+	    coords.push_back(z);
+	  }
+  const int nVoxels = coords.size()/3;
+  const int nVolumes = values.Nrows();
+  if (values.Ncols() != nVoxels)
+    throw Logic_error("VoxelTable::Save: wrong number of voxels");
+
+  const int dims[3] = { mask.xsize(), mask.ysize(), mask.zsize() };
+  const float pixdims[3] = { mask.xdim(), mask.ydim(), mask.zdim() };
+  const uint64_t maskHash = PackedMVNFile::HashMask(mask);
+  // setmatrix(values,mask) would have given the image the mask's orientation
+  const int formCodes[2] = { mask.sform_code(), mask.qform_code() };
+  float forms[2][16];
+  FormToFloats(mask.sform_mat(), forms[0]);
+  FormToFloats(mask.qform_mat(), forms[1]);
+
+  FILE* out = fopen(filename.c_str(), "wb");
+  if (out == NULL)
+    throw Runtime_error(("Couldn't create " + filename).c_str());
+  fwrite(tableMagic, 1, 8, out);
+  fwrite(dims, sizeof(int), 3, out);
+  fwrite(pixdims, sizeof(float), 3, out);
+  fwrite(&nVoxels, sizeof(int), 1, out);
+  fwrite(&nVolumes, sizeof(int), 1, out);
+  fwrite(&maskHash, sizeof(uint64_t), 1, out);
+  fwrite(&intent, sizeof(int), 1, out);
+  fwrite(formCodes, sizeof(int), 2, out);
+  fwrite(forms, sizeof(float), 32, out);
+  bool ok = (nVoxels == 0 
+	     || fwrite(&coords[0], sizeof(int), coords.size(), out) == coords.size());
+
+  vector<float> column(nVoxels);
+  for (int t = 1; t <= nVolumes && ok && nVoxels > 0; t++)
+    {
+      for (int v = 1; v <= nVoxels; v++)
+	column[v-1] = values(t,v);
+      ok = (fwrite(&column[0], sizeof(float), nVoxels, out) == (size_t)nVoxels);
+    }
+  if (fclose(out) != 0 || !ok)
+    throw Runtime_error(("Couldn't write " + filename).c_str());
+}
+
+VoxelTable::VoxelTable(const string& filename)
+{
+  Tracer_Plus tr("VoxelTable::VoxelTable");
+
+  FILE* in = fopen(filename.c_str(), "rb");
+  if (in == NULL)
+    throw Invalid_option("Couldn't open " + filename);
+
+  char magic[8];
+  int nVoxels = -1, nVolumes = -1;
+  bool ok = (fread(magic, 1, 8, in) == 8)
+    && memcmp(magic, tableMagic, 8) == 0
+    && fread(dims, sizeof(int), 3, in) == 3
+    && fread(pixdims, sizeof(float), 3, in) == 3
+    && fread(&nVoxels, sizeof(int), 1, in) == 1
+    && fread(&nVolumes, sizeof(int), 1, in) == 1
+    && fread(&maskHash, sizeof(uint64_t), 1, in) == 1
+    && nVoxels >= 0 && nVolumes >= 0
+    && fread(&intent, sizeof(int), 1, in) == 1
+    && fread(formCodes, sizeof(int), 2, in) == 2
+    && fread(forms, sizeof(float), 32, in) == 32;
+  if (ok)
+    {
+      coords.resize(3*nVoxels);
+      ok = (nVoxels == 0 
+	    || fread(&coords[0], sizeof(int), coords.size(), in) == coords.size());
+    }
+  for (int i = 0; i < (int)coords.size() && ok; i++)
+    ok = (coords[i] >= 0 && coords[i] < dims[i%3]);
+
+  if (ok)
+    {
+      values.ReSize(nVolumes, nVoxels);
+      vector<float> column(nVoxels);
+      for (int t = 1; t <= nVolumes && ok && nVoxels > 0; t++)
+	{
+	  ok = (fread(&column[0], sizeof(float), nVoxels, in) == (size_t)nVoxels);
+	  for (int v = 1; v <= nVoxels && ok; v++)
+	    values(t,v) = column[v-1];
+	}
+    }
+  fclose(in);
+  if (!ok)
+    throw Invalid_option(filename + " isn't a voxel table, or is truncated");
+}
+
+void VoxelTable::Expand(volume4D<float>& output) const
+{
+  Tracer_Plus tr("VoxelTable::Expand");
+
+  output = volume4D<float>(dims[0], dims[1], dims[2], max(NumVolumes(), 1));
+  output.setdims(pixdims[0], pixdims[1], pixdims[2], 1.0);
+  output.set_sform(formCodes[0], FormFromFloats(forms[0]));
+  output.set_qform(formCodes[1], FormFromFloats(forms[1]));
+  output.set_intent(intent, 0, 0, 0);
+  output = 0;
+  for (int v = 1; v <= NumVoxels(); v++)
+    for (int t = 1; t <= NumVolumes(); t++)
+      output(coords[3*v-3], coords[3*v-2], coords[3*v-1], t-1) = values(t,v);
+}
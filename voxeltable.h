@@ -0,0 +1,116 @@
+/*  voxeltable.h - Sparse result files: values for the voxels in the mask only
+
+    Michael Chappell, FMRIB Image Analysis Group
+
+    Copyright (C) 2007-2008 University of Oxford  */
+
+/*  Part of FSL - FMRIB's Software Library
+    http://www.fmrib.ox.ac.uk/fsl
+    fsl@fmrib.ox.ac.uk
+    
+    Developed at FMRIB (Oxford Centre for Functional Magnetic Resonance
+    Imaging of the Brain), Department of Clinical Neurology, Oxford
+    University, Oxford, UK
+    
+    
+    LICENCE
+    
+    FMRIB Software Library, Release 5.0 (c) 2012, The University of
+    Oxford (the "Software")
+    
+    The Software remains the property of the University of Oxford ("the
+    University").
+    
+    The Software is distributed "AS IS" under this Licence solely for
+    non-commercial use in the hope that it will be useful, but in order
+    that the University as a charitable foundation protects its assets for
+    the benefit of its educational and research purposes, the University
+    makes clear that no condition is made or to be implied, nor is any
+    warranty given or to be implied, as to the accuracy of the Software,
+    or that it will be suitable for any particular purpose or for use
+    under any specific conditions. Furthermore, the University disclaims
+    all responsibility for the use which is made of the Software. It
+    further disclaims any liability for the outcomes arising from using
+    the Software.
+    
+    The Licensee agrees to indemnify the University and hold the
+    University harmless from and against any and all claims, damages and
+    liabilities asserted by third parties (including claims for
+    negligence) which arise directly or indirectly from the use of the
+    Software or the sale of any products based on the Software.
+    
+    No part of the Software may be reproduced, modified, transmitted or
+    transferred in any form or by any means, electronic or mechanical,
+    without the express permission of the University. The permission of
+    the University is not required if the said reproduction, modification,
+    transmission or transference is done without financial return, the
+    conditions of this Licence are imposed upon the receiver of the
+    product, and all original and amended source code is included in any
+    transmitted product. You may be held legally responsible for any
+    copyright infringement that is caused or encouraged by your failure to
+    abide by these terms and conditions.
+    
+    You are not permitted under this Licence to use this Software
+    commercially. Use for which any financial return is received shall be
+    defined as commercial use, and includes (1) integration of all or part
+    of the source code or the Software into a product for sale or license
+    by or on behalf of Licensee to third parties or (2) use of the
+    Software or any derivative of it for research with the final aim of
+    developing software products for sale or license to a third party or
+    (3) use of the Software or any derivative of it for research with the
+    final aim of developing non-software products for sale or license to a
+    third party, or (4) use of the Software to provide any service to an
+    external organisation for which payment is received. If you are
+    interested in using the Software commercially, please contact Isis
+    Innovation Limited ("Isis"), the technology transfer company of the
+    University, to negotiate a licence. Contact details are:
+    innovation@isis.ox.ac.uk quoting reference DE/9564. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "dist_mvn.h"
+
+// A result image stored as a table with one row per voxel in the mask 
+// (--sparse-output), instead of a full-FOV NIFTI that's mostly zeros.  
+// The file is a header (magic, image dimensions, voxel sizes, number of 
+// voxels and volumes, the mask hash, then the NIFTI intent code and the 
+// mask's sform and qform codes and matrices), then the x,y,z coordinates
+// of each voxel (from 0, in newimage's mask order), then the values one 
+// volume at a time as floats -- so each volume is a contiguous column.
+// fabber_expand turns one back into the NIFTI image fabber would have 
+// written.
+class VoxelTable
+{
+public:
+    // values has a row per volume and a column per voxel in the mask, as
+    // for volume4D::setmatrix
+    static void Save(const string& filename, const NEWIMAGE::volume<float>& mask,
+		     const Matrix& values, int intent);
+
+    VoxelTable(const string& filename); // reads the whole file
+
+    int NumVoxels() const { return coords.size()/3; }
+    int NumVolumes() const { return values.Nrows(); }
+    int Dim(int d) const { return dims[d]; }
+    float VoxelSize(int d) const { return pixdims[d]; }
+    uint64_t MaskHash() const { return maskHash; }
+    int Intent() const { return intent; }
+    const vector<int>& Coords() const { return coords; } // x,y,z per voxel
+    const Matrix& Values() const { return values; } // as for Save
+
+    void Expand(NEWIMAGE::volume4D<float>& output) const;
+        // with the intent and orientation it was saved with
+
+private:
+    int dims[3];
+    float pixdims[3];
+    uint64_t maskHash;
+    int intent;
+    int formCodes[2];    // sform, qform
+    float forms[2][16];  // 4x4, row by row
+    vector<int> coords;
+    Matrix values;
+};